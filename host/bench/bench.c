@@ -0,0 +1,450 @@
+/**
+ * @file bench.c
+ * @brief Instruction counts of the Loconet queues and the receive path
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Measures the work of the Loconet code in instructions of the host build
+ * (host_count_start), which is repeatable but not the count of the device:
+ *
+ *   build/host/bench [tx|build|rx|all] [capture]
+ *
+ * - tx: the cost of queueing a message (loconet_tx_queue_6) and of taking
+ *   it off the queue and completing it (loconet_tx_process and
+ *   loconet_tx_stop), of the priorities loconet_tx_messages.c uses. For a
+ *   burst of 64 messages, with the heap they take, and for one message at
+ *   a time with 1 to 64 messages waiting.
+ * - build: building and queueing the fast clock message, and answering an
+ *   LNCV read (loconet_rx_process of the request).
+ * - rx: the capture, host/replay/layout.ln by default, a message at a
+ *   time through loconet_rx_buffer_push (the receive interrupt) and
+ *   loconet_rx_process (the main loop). Handled are the messages
+ *   loconet_rx_process passed on, the echo of messages of the device
+ *   included if the code receives those. The stack is the most
+ *   loconet_rx_process and the handlers used, measured on a stack of
+ *   their own.
+ *
+ * It only uses the interface the Loconet code had from the start, so the
+ * same bench builds against an older checkout for numbers before a change:
+ *
+ *   make bench BENCH_TREE=../old BENCH_BINARY=build/host/bench-old
+ *
+ * The device is set up as src/main.c, and runs its main loop and virtual
+ * time between the messages of the capture, which is not counted.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <malloc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ucontext.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_cv.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+#include "loconet/loconet_tx_messages.h"
+#include "utils/eeprom.h"
+
+#include "components/fast_clock.h"
+
+#include "domotica/domotica.h"
+
+#ifndef BENCH_CORPUS
+#define BENCH_CORPUS "host/replay/layout.ln"
+#endif
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+FAST_CLOCK_BUILD(2)
+
+//-----------------------------------------------------------------------------
+void irq_handler_eic(void);
+void irq_handler_eic(void) {
+  if (loconet_handle_eic()) {
+    return;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off);
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off)
+{
+  (void) mask_on;
+  (void) mask_off;
+}
+
+//-----------------------------------------------------------------------------
+// A byte on the wire: start bit, 8 data bits and a stop bit of 60us
+#define BENCH_BYTE_US (10 * HOST_LINE_BIT_US)
+
+// Messages taken off the queue at each depth
+#define BENCH_TX_ROUNDS 48
+
+// Deepest queue, the pool of the host build holds it (see the Makefile)
+#define BENCH_TX_DEPTH 64
+
+// A 6 byte opcode nobody answers or coalesces
+#define BENCH_TX_OPCODE 0xD7
+
+// Queue priorities used by loconet_tx_messages.c
+static const uint8_t bench_tx_priorities[] = { 1, 5, 10 };
+
+// Stack of loconet_rx_process and the handlers, and of the signal handlers
+// of the model, so those do not count
+#define BENCH_STACK_Size (64 * 1024)
+#define BENCH_STACK_PAINT 0xA5
+
+static uint8_t bench_stack[BENCH_STACK_Size];
+static uint8_t bench_signal_stack[BENCH_STACK_Size];
+static ucontext_t bench_context;
+static ucontext_t bench_loop_context;
+
+// Bytes of the capture, each opcode starts a message
+static uint8_t *bench_bytes = NULL;
+static uint32_t bench_length = 0;
+
+//-----------------------------------------------------------------------------
+static void bench_fail(const char *path, const char *message)
+{
+  fprintf(stderr, "bench: %s: %s\n", path, message);
+  exit(1);
+}
+
+// Since the transactions, loconet_loop resends requests
+extern void loconet_transaction_process(void) __attribute__((weak));
+
+// Run the main loop of the device for us of virtual time. The receive part
+// of loconet_loop is left to bench_process, which is counted.
+static void bench_run(uint32_t us)
+{
+  for (; us; us--) {
+    loconet_tx_process();
+    if (loconet_transaction_process) {
+      loconet_transaction_process();
+    }
+    fast_clock_loop();
+    domotica_loop();
+    host_run(1);
+  }
+}
+
+// Handle what was received, returns the messages handled. loconet_rx_process
+// used to return 0 after skipping a stray byte as well, so stop at the
+// second 0 in a row. What is left is handled the next time.
+static uint32_t bench_process(void)
+{
+  uint32_t handled = 0;
+  for (uint8_t idle = 0; idle < 2;) {
+    if (loconet_rx_process()) {
+      handled++;
+      idle = 0;
+    } else {
+      idle++;
+    }
+  }
+  return handled;
+}
+
+static size_t bench_heap(void)
+{
+  return mallinfo2().uordblks;
+}
+
+//-----------------------------------------------------------------------------
+// Take the first message off the queue, as when the line is idle, and
+// complete it as the interrupt does after its last byte. Only with a
+// message waiting: the first loconet_tx_stop freed the message but kept
+// pointing at it.
+static void bench_tx_dequeue(void)
+{
+  loconet_status.bit.IDLE = 1;
+  loconet_tx_process();
+  loconet_tx_stop();
+}
+
+// The interrupt did not send, keep it from starting on the message later
+static void bench_tx_quiet(void)
+{
+  SERCOM2->USART.INTENCLR.reg = SERCOM_USART_INTENCLR_DRE;
+}
+
+static void bench_tx_drain(void)
+{
+  while (loconet_tx_queue_size()) {
+    bench_tx_dequeue();
+    bench_tx_quiet();
+  }
+}
+
+// A burst: the deepest queue filled at once, then sent
+static void bench_tx_burst(void)
+{
+  uint64_t enqueue = 0;
+  uint64_t dequeue = 0;
+  size_t heap = bench_heap();
+
+  for (uint8_t count = 0; count < BENCH_TX_DEPTH; count++) {
+    host_count_start();
+    loconet_tx_queue_6(BENCH_TX_OPCODE, bench_tx_priorities[count % 3], count, 0, 0, 0);
+    enqueue += host_count_stop();
+  }
+  heap = bench_heap() - heap;
+  while (loconet_tx_queue_size()) {
+    host_count_start();
+    bench_tx_dequeue();
+    dequeue += host_count_stop();
+    bench_tx_quiet();
+  }
+
+  printf("tx:     burst of %u, enqueue %.1f, dequeue %.1f instructions per message, heap %lu bytes\n",
+    BENCH_TX_DEPTH, (double)enqueue / BENCH_TX_DEPTH, (double)dequeue / BENCH_TX_DEPTH, (unsigned long)heap);
+}
+
+// One message in, one out, with depth - 1 messages waiting
+static void bench_tx_depth(void)
+{
+  uint8_t sequence = 0;
+
+  printf("        depth  enqueue  dequeue  instructions per message\n");
+  for (uint8_t depth = 1; depth <= BENCH_TX_DEPTH; depth *= 2) {
+    for (uint8_t count = 1; count < depth; count++, sequence++) {
+      loconet_tx_queue_6(BENCH_TX_OPCODE, bench_tx_priorities[sequence % 3], sequence & 0x7F, 0, 0, 0);
+    }
+    // The scheduler takes in the waiting messages, the line is busy
+    loconet_status.bit.IDLE = 0;
+    loconet_tx_process();
+
+    uint64_t enqueue = 0;
+    uint64_t dequeue = 0;
+    for (uint8_t round = 0; round < BENCH_TX_ROUNDS; round++, sequence++) {
+      host_count_start();
+      loconet_tx_queue_6(BENCH_TX_OPCODE, bench_tx_priorities[sequence % 3], sequence & 0x7F, 0, 0, 0);
+      enqueue += host_count_stop();
+      host_count_start();
+      bench_tx_dequeue();
+      dequeue += host_count_stop();
+      bench_tx_quiet();
+    }
+    printf("        %5u  %7.1f  %7.1f\n", depth,
+      (double)enqueue / BENCH_TX_ROUNDS, (double)dequeue / BENCH_TX_ROUNDS);
+    bench_tx_drain();
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Push a message and handle it, returns the instructions of both
+static uint64_t bench_receive(const uint8_t *data, uint8_t length)
+{
+  host_count_start();
+  for (uint8_t index = 0; index < length; index++) {
+    loconet_rx_buffer_push(data[index]);
+  }
+  bench_process();
+  return host_count_stop();
+}
+
+static void bench_build(void)
+{
+  // LNCV programming of address 3: start, read LNCV 14, stop
+  static const uint8_t start[] = { 0xE5, 0x0F, 0x01, 0x49, 0x4B, 0x21, 0x41, 0x3A, 0x04, 0x00, 0x00, 0x03, 0x00, 0x00, 0x4B };
+  static const uint8_t read[]  = { 0xE5, 0x0F, 0x01, 0x49, 0x4B, 0x1F, 0x01, 0x3A, 0x04, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x38 };
+  static const uint8_t stop[]  = { 0xE5, 0x0F, 0x01, 0x49, 0x4B, 0x21, 0x01, 0x3A, 0x04, 0x00, 0x00, 0x03, 0x00, 0x40, 0x4B };
+  uint64_t clock = 0;
+  uint64_t lncv = 0;
+
+  bench_receive(start, sizeof(start));
+  bench_run(50000);
+  for (uint8_t round = 0; round < BENCH_TX_ROUNDS; round++) {
+    host_count_start();
+    loconet_tx_fast_clock(0x01, 0x7F, 0x7F, 0x00, 0x00, round & 0x7F, 0x00, 0x00);
+    clock += host_count_stop();
+    lncv += bench_receive(read, sizeof(read));
+    // Both go out before the next round
+    bench_run(50000);
+  }
+  bench_receive(stop, sizeof(stop));
+  bench_run(50000);
+
+  printf("build:  fast clock %.1f, lncv read %.1f instructions per message\n",
+    (double)clock / BENCH_TX_ROUNDS, (double)lncv / BENCH_TX_ROUNDS);
+}
+
+//-----------------------------------------------------------------------------
+static void bench_add(uint8_t byte)
+{
+  static uint32_t size = 0;
+  if (bench_length == size) {
+    size = size ? 2 * size : 4096;
+    bench_bytes = realloc(bench_bytes, size);
+    if (!bench_bytes) {
+      bench_fail("capture", "out of memory");
+    }
+  }
+  bench_bytes[bench_length++] = byte;
+}
+
+// Hexadecimal bytes, # comments, timestamps (followed by a colon) skipped,
+// as host/replay/replay.c reads text captures
+static void bench_read(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  char word[32];
+
+  if (!file) {
+    bench_fail(path, "cannot open");
+  }
+  while (fscanf(file, "%31s", word) == 1) {
+    char *end;
+    if (word[0] == '#') {
+      fscanf(file, "%*[^\n]");
+    } else if (word[strlen(word) - 1] != ':') {
+      unsigned long value = strtoul(word, &end, 16);
+      if (*end || value > 0xFF) {
+        bench_fail(path, "bad byte");
+      }
+      bench_add(value);
+    }
+  }
+  fclose(file);
+}
+
+// The main loop on bench_stack: handle what is received, then back
+static void bench_loop(void)
+{
+  for (;;) {
+    bench_process();
+    swapcontext(&bench_loop_context, &bench_context);
+  }
+}
+
+// The capture again, with the main loop on a painted stack, returns the
+// bytes of it that were used
+static uint32_t bench_rx_stack(void)
+{
+  memset(bench_stack, BENCH_STACK_PAINT, sizeof(bench_stack));
+  getcontext(&bench_loop_context);
+  bench_loop_context.uc_stack.ss_sp = bench_stack;
+  bench_loop_context.uc_stack.ss_size = sizeof(bench_stack);
+  bench_loop_context.uc_link = NULL;
+  makecontext(&bench_loop_context, bench_loop, 0);
+
+  for (uint32_t index = 0; index < bench_length;) {
+    uint32_t length = 1;
+    while (index + length < bench_length && !(bench_bytes[index + length] & 0x80)) {
+      length++;
+    }
+    for (uint32_t count = 0; count < length; count++) {
+      loconet_rx_buffer_push(bench_bytes[index + count]);
+    }
+    swapcontext(&bench_context, &bench_loop_context);
+    index += length;
+    bench_run(length * BENCH_BYTE_US);
+  }
+
+  uint32_t unused = 0;
+  while (unused < sizeof(bench_stack) && bench_stack[unused] == BENCH_STACK_PAINT) {
+    unused++;
+  }
+  return sizeof(bench_stack) - unused;
+}
+
+static void bench_rx(const char *path)
+{
+  uint32_t messages = 0;
+  uint32_t handled = 0;
+  uint64_t interrupt = 0;
+  uint64_t loop = 0;
+
+  bench_read(path);
+
+  // Counted pass
+  for (uint32_t index = 0; index < bench_length;) {
+    uint32_t length = 1;
+    while (index + length < bench_length && !(bench_bytes[index + length] & 0x80)) {
+      length++;
+    }
+    host_count_start();
+    for (uint32_t count = 0; count < length; count++) {
+      loconet_rx_buffer_push(bench_bytes[index + count]);
+    }
+    interrupt += host_count_stop();
+    host_count_start();
+    handled += bench_process();
+    loop += host_count_stop();
+    messages++;
+    index += length;
+    bench_run(length * BENCH_BYTE_US);
+  }
+  uint32_t stack = bench_rx_stack();
+
+  printf("rx:     %s, %u messages, %u handled\n", path, messages, handled);
+  printf("        interrupt %.1f, main loop %.1f instructions per message, stack %u bytes\n",
+    (double)interrupt / messages, (double)loop / messages, stack);
+}
+
+//-----------------------------------------------------------------------------
+static void eeprom_init(void)
+{
+  // The flash image starts erased
+  if (eeprom_emulator_init() != STATUS_OK) {
+    eeprom_emulator_erase_memory();
+    if (eeprom_emulator_init() != STATUS_OK) {
+      fprintf(stderr, "eeprom emulator failed\n");
+      exit(1);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  const char *scenario = argc > 1 ? argv[1] : "all";
+  const char *path = argc > 2 ? argv[2] : BENCH_CORPUS;
+  uint8_t all = !strcmp(scenario, "all");
+
+  if (!all && strcmp(scenario, "tx") && strcmp(scenario, "build") && strcmp(scenario, "rx")) {
+    fprintf(stderr, "usage: %s [tx|build|rx|all] [capture]\n", argv[0]);
+    return 1;
+  }
+
+  // The model takes its signals here, off the measured stack
+  stack_t signal_stack = { .ss_sp = bench_signal_stack, .ss_size = sizeof(bench_signal_stack) };
+  sigaltstack(&signal_stack, NULL);
+
+  host_init();
+  host_line_attach(SERCOM2, &PORT->Group[0], 14, (0x01ul << 15) | (0x01ul << 13));
+  __enable_irq();
+
+  eeprom_init();
+
+  // Set up the device as src/main.c
+  loconet_cv_init();
+  loconet_config.bit.ADDRESS = loconet_cv_get(0);
+  loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_init();
+  fast_clock_init();
+  fast_clock_set_slave();
+  domotica_init();
+  bench_run(1000);
+
+  if (all || !strcmp(scenario, "tx")) {
+    bench_tx_burst();
+    bench_tx_depth();
+  }
+  if (all || !strcmp(scenario, "build")) {
+    bench_build();
+  }
+  if (all || !strcmp(scenario, "rx")) {
+    bench_rx(path);
+  }
+  return 0;
+}
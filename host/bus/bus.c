@@ -0,0 +1,514 @@
+/**
+ * @file bus.c
+ * @brief Loconet bus simulator, many nodes on one line
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Runs the nodes of a scenario on one line with bit level timing and
+ * writes the results per node as CSV:
+ *
+ *   build/host/bus host/bus/storm.bus [seconds] [key=value ...] > storm.csv
+ *
+ * Keys given after the seconds override those of every node, retry=0
+ * backoff=0 for instance runs a scenario without the retry limit and the
+ * random backoff.
+ *
+ * A scenario has one setting per line, # starts a comment:
+ *
+ *   duration <seconds>   virtual time to run, 10 by default
+ *   starve <ms>          latency counted as starvation, 1000 by default
+ *   seed <number>        varies the serial numbers and jitter of the nodes
+ *   node <count> <role> [key=value ...]
+ *
+ * The roles are idle, sensor, clock and lncv (see bus.h). Keys of a node,
+ * times in milliseconds:
+ *
+ *   address   LNCV 0 of the first node, the next ones count up (index + 1)
+ *   priority  LNCV 2 (5), retry LNCV 3 (8), backoff LNCV 4 (4)
+ *   coalesce  replace waiting sensor reports (0)
+ *   level     queue priority of the generated messages (5)
+ *   burst     inputs per event, or reads per LNCV session (1)
+ *   target    address the LNCV role programs, 0 for all nodes (0)
+ *   start     first event (100), period between events (1000), jitter
+ *             random delay of every event, less than the period (0)
+ *
+ * Per node the CSV has the generated messages queued and their results,
+ * the messages it put on the line (including answers), its collision
+ * rate (collided attempts over all attempts), latency percentiles from
+ * queueing to delivery, and starvation: messages later than starve,
+ * dropped, or still waiting at the end. The last row (all) is the bus:
+ * messages per second and latencies of all nodes.
+ *
+ * Every register write of a node traps (see host/samd20_host.h), so a
+ * second of forty busy nodes takes about half a minute.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "bus.h"
+
+#ifndef BUS_NODE_LIBRARY
+#define BUS_NODE_LIBRARY "build/host/bus_node.so"
+#endif
+
+// Limited by the slots for the flash images, see host/include/samd20.h
+#define BUS_NODES_Size 96
+
+// Bit time of Loconet, for the line usage
+#define BUS_BIT_US 60
+
+//-----------------------------------------------------------------------------
+typedef struct {
+  const BUS_NODE_Type *node;
+  BUS_NODE_CONFIG_Type config;
+  uint8_t driving;          // Pulled the line low during the current message
+  uint32_t results[BUS_RESULT_QUEUED + 1];
+  uint32_t late;            // Delivered later than bus_starve_us
+  uint32_t sent;            // Messages it put on the line
+  uint32_t *latency;        // Latencies of the delivered messages
+  uint32_t latency_count;
+  uint32_t latency_size;
+} BUS_NODE_STATE_Type;
+
+typedef struct {
+  uint32_t messages;        // Messages with a valid checksum
+  uint32_t bad_checksum;    // Messages with a wrong checksum
+  uint32_t framing_error;   // Bytes with a low stop bit, breaks
+  uint32_t bytes;           // All bytes on the line
+} BUS_LINE_STATS_Type;
+
+static BUS_NODE_STATE_Type bus_nodes[BUS_NODES_Size];
+static uint16_t bus_nodes_count = 0;
+static BUS_LINE_STATS_Type bus_line_stats = { 0, 0, 0, 0 };
+static uint8_t bus_line = 1;
+
+// Scenario settings
+static uint64_t bus_duration_us = 10000000;
+static uint32_t bus_starve_us = 1000000;
+static uint32_t bus_seed = 1;
+
+static const char *const bus_roles[] = {
+  [BUS_ROLE_IDLE] = "idle",
+  [BUS_ROLE_SENSOR] = "sensor",
+  [BUS_ROLE_CLOCK] = "clock",
+  [BUS_ROLE_LNCV] = "lncv",
+};
+
+//-----------------------------------------------------------------------------
+static void bus_fail(const char *path, uint32_t line, const char *message, const char *detail)
+{
+  fprintf(stderr, "%s:%u: %s '%s'\n", path, line, message, detail);
+  exit(1);
+}
+
+static double bus_number(const char *path, uint32_t line, const char *text, double maximum)
+{
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || *end || value < 0 || value > maximum) {
+    bus_fail(path, line, "invalid number", text);
+  }
+  return value;
+}
+
+// key=value of a node
+static void bus_parse_option(const char *path, uint32_t line, BUS_NODE_CONFIG_Type *config, char *option)
+{
+  char *value = strchr(option, '=');
+  if (!value) {
+    bus_fail(path, line, "expected key=value", option);
+  }
+  *value++ = 0;
+  if (!strcmp(option, "address")) {
+    config->address = bus_number(path, line, value, 1023);
+  } else if (!strcmp(option, "priority")) {
+    config->priority = bus_number(path, line, value, 15);
+  } else if (!strcmp(option, "retry")) {
+    config->retry_limit = bus_number(path, line, value, 15);
+  } else if (!strcmp(option, "backoff")) {
+    config->backoff = bus_number(path, line, value, 15);
+  } else if (!strcmp(option, "coalesce")) {
+    config->coalesce = bus_number(path, line, value, 1);
+  } else if (!strcmp(option, "level")) {
+    config->level = bus_number(path, line, value, 255);
+  } else if (!strcmp(option, "burst")) {
+    config->burst = bus_number(path, line, value, 16);
+  } else if (!strcmp(option, "target")) {
+    config->target = bus_number(path, line, value, 1023);
+  } else if (!strcmp(option, "start")) {
+    config->start_us = bus_number(path, line, value, 3600000) * 1000;
+  } else if (!strcmp(option, "period")) {
+    config->period_us = bus_number(path, line, value, 3600000) * 1000;
+  } else if (!strcmp(option, "jitter")) {
+    config->jitter_us = bus_number(path, line, value, 3600000) * 1000;
+  } else {
+    bus_fail(path, line, "unknown key", option);
+  }
+}
+
+// node <count> <role> [key=value ...]
+static void bus_parse_node(const char *path, uint32_t line, char *count_text)
+{
+  BUS_NODE_CONFIG_Type config;
+  uint16_t count = bus_number(path, line, count_text ? count_text : "", BUS_NODES_Size);
+  char *role = strtok(NULL, " \t\r\n");
+  char *option;
+
+  memset(&config, 0, sizeof(config));
+  config.role = 0xFF;
+  for (uint8_t index = 0; role && index < sizeof(bus_roles) / sizeof(bus_roles[0]); index++) {
+    if (!strcmp(role, bus_roles[index])) {
+      config.role = index;
+    }
+  }
+  if (config.role == 0xFF) {
+    bus_fail(path, line, "unknown role", role ? role : "");
+  }
+  config.address = bus_nodes_count + 1;
+  config.priority = 5;
+  config.retry_limit = 8;
+  config.backoff = 4;
+  config.level = 5;
+  config.burst = 1;
+  config.start_us = 100000;
+  config.period_us = 1000000;
+
+  while ((option = strtok(NULL, " \t\r\n"))) {
+    bus_parse_option(path, line, &config, option);
+  }
+  if (config.period_us && config.jitter_us >= config.period_us) {
+    bus_fail(path, line, "jitter should be less than the period", count_text);
+  }
+  if (bus_nodes_count + count > BUS_NODES_Size) {
+    bus_fail(path, line, "too many nodes", count_text);
+  }
+
+  for (uint16_t index = 0; index < count; index++) {
+    BUS_NODE_STATE_Type *state = &bus_nodes[bus_nodes_count];
+    state->config = config;
+    state->config.index = bus_nodes_count++;
+    state->config.address = config.address + index;
+  }
+}
+
+static void bus_parse(const char *path)
+{
+  FILE *file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  char text[256];
+  uint32_t line = 0;
+
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+  while (fgets(text, sizeof(text), file)) {
+    line++;
+    char *comment = strchr(text, '#');
+    if (comment) {
+      *comment = 0;
+    }
+    char *setting = strtok(text, " \t\r\n");
+    char *value = strtok(NULL, " \t\r\n");
+    if (!setting) {
+      continue;
+    } else if (!strcmp(setting, "node")) {
+      bus_parse_node(path, line, value);
+    } else if (!value) {
+      bus_fail(path, line, "missing value for", setting);
+    } else if (!strcmp(setting, "duration")) {
+      bus_duration_us = bus_number(path, line, value, 86400) * 1000000;
+    } else if (!strcmp(setting, "starve")) {
+      bus_starve_us = bus_number(path, line, value, 3600000) * 1000;
+    } else if (!strcmp(setting, "seed")) {
+      bus_seed = bus_number(path, line, value, UINT32_MAX);
+    } else {
+      bus_fail(path, line, "unknown setting", setting);
+    }
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  if (!bus_nodes_count) {
+    bus_fail(path, line, "no nodes in", path);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Every node loads its own copy of the library. The dynamic linker loads a
+// file (and a path) only once, so each copy comes from a memory file of its
+// own, which stays open to keep its path unique.
+static const BUS_NODE_Type *bus_load(const void *image, size_t size)
+{
+  char path[32];
+  int fd = memfd_create("bus_node", 0);
+
+  if (fd < 0 || write(fd, image, size) != (ssize_t)size) {
+    perror("bus: node library");
+    exit(1);
+  }
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "bus: %s\n", dlerror());
+    exit(1);
+  }
+  const BUS_NODE_Type *node = dlsym(library, "bus_node");
+  if (!node) {
+    fprintf(stderr, "bus: %s\n", dlerror());
+    exit(1);
+  }
+  return node;
+}
+
+static void *bus_read(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  void *image = NULL;
+
+  if (file && !fseek(file, 0, SEEK_END) && (*size = ftell(file)) > 0
+      && !fseek(file, 0, SEEK_SET) && (image = malloc(*size))
+      && fread(image, 1, *size, file) == *size) {
+    fclose(file);
+    return image;
+  }
+  perror(path);
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+static void bus_report(uint8_t index, uint8_t result, uint32_t latency_us)
+{
+  BUS_NODE_STATE_Type *state = &bus_nodes[index];
+
+  state->results[result]++;
+  if (result != BUS_RESULT_DELIVERED) {
+    return;
+  }
+  if (latency_us > bus_starve_us) {
+    state->late++;
+  }
+  if (state->latency_count == state->latency_size) {
+    state->latency_size = state->latency_size ? 2 * state->latency_size : 256;
+    state->latency = realloc(state->latency, state->latency_size * sizeof(uint32_t));
+    if (!state->latency) {
+      perror("bus");
+      exit(1);
+    }
+  }
+  state->latency[state->latency_count++] = latency_us;
+}
+
+// Bytes on the line, seen by the first node. Nodes that pulled the line
+// low since the previous message sent a valid message.
+static void bus_monitor(uint8_t data, uint8_t framing_error)
+{
+  static uint8_t message[128];
+  static uint8_t length = 0;
+  static uint8_t expected = 0;
+
+  bus_line_stats.bytes++;
+  if (framing_error) {
+    bus_line_stats.framing_error++;
+    length = 0;
+    for (uint16_t index = 0; index < bus_nodes_count; index++) {
+      bus_nodes[index].driving = 0;
+    }
+    return;
+  }
+  if (data & 0x80) {
+    length = 0;
+    switch (data & 0x60) {
+      case 0x00: expected = 2; break;
+      case 0x20: expected = 4; break;
+      case 0x40: expected = 6; break;
+      default:   expected = 0; break;
+    }
+  } else if (!length) {
+    return;
+  } else if (length == 1 && !expected) {
+    expected = data;
+  }
+  if (length < sizeof(message)) {
+    message[length++] = data;
+  }
+  if (length != expected) {
+    return;
+  }
+
+  uint8_t checksum = 0xFF;
+  for (uint8_t index = 0; index < length; index++) {
+    checksum ^= message[index];
+  }
+  if (checksum) {
+    bus_line_stats.bad_checksum++;
+  } else {
+    bus_line_stats.messages++;
+  }
+  for (uint16_t index = 0; index < bus_nodes_count; index++) {
+    if (!checksum && bus_nodes[index].driving) {
+      bus_nodes[index].sent++;
+    }
+    bus_nodes[index].driving = 0;
+  }
+  length = 0;
+}
+
+//-----------------------------------------------------------------------------
+static int bus_compare(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted latencies, empty if there are none
+static void bus_percentile(FILE *out, const uint32_t *sorted, uint32_t count, uint8_t percent)
+{
+  if (!count) {
+    fprintf(out, ",");
+    return;
+  }
+  uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+  fprintf(out, ",%u", sorted[rank ? rank - 1 : 0]);
+}
+
+static void bus_row(FILE *out, const char *name, const char *role, uint16_t address, uint8_t priority,
+  const uint32_t *results, uint32_t sent, uint32_t collided, uint32_t *latency, uint32_t count,
+  uint32_t starved, uint32_t queue_high_water)
+{
+  uint32_t attempts = sent + collided;
+  qsort(latency, count, sizeof(uint32_t), bus_compare);
+  fprintf(out, "%s,%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%.2f,%.4f",
+    name, role, address, priority,
+    results[BUS_RESULT_QUEUED], results[BUS_RESULT_DELIVERED], results[BUS_RESULT_COLLIDED],
+    results[BUS_RESULT_DROPPED], results[BUS_RESULT_COALESCED], results[BUS_RESULT_REFUSED],
+    sent, sent / (bus_duration_us / 1e6), attempts ? (double)collided / attempts : 0.0);
+  bus_percentile(out, latency, count, 50);
+  bus_percentile(out, latency, count, 90);
+  bus_percentile(out, latency, count, 99);
+  bus_percentile(out, latency, count, 100);
+  fprintf(out, ",%u,%u\n", starved, queue_high_water);
+}
+
+static void bus_results(FILE *out)
+{
+  uint32_t results[BUS_RESULT_QUEUED + 1] = { 0 };
+  uint32_t collided = 0, count = 0, starved = 0, queue_high_water = 0;
+  uint32_t *latency = NULL;
+
+  fprintf(out, "node,role,address,priority,queued,delivered,collided,dropped,coalesced,refused,"
+    "sent,sent_per_s,collision_rate,p50_us,p90_us,p99_us,max_us,starved,queue_high_water\n");
+
+  for (uint16_t index = 0; index < bus_nodes_count; index++) {
+    BUS_NODE_STATE_Type *state = &bus_nodes[index];
+    BUS_NODE_STATS_Type stats;
+    char name[8];
+
+    state->node->stats(&stats);
+    uint32_t node_collided = stats.retried + stats.dropped;
+    uint32_t node_starved = state->late + state->results[BUS_RESULT_DROPPED]
+      + state->node->waiting(bus_starve_us);
+
+    snprintf(name, sizeof(name), "%u", index);
+    bus_row(out, name, bus_roles[state->config.role], state->config.address, state->config.priority,
+      state->results, state->sent, node_collided, state->latency, state->latency_count,
+      node_starved, stats.queue_high_water);
+
+    for (uint8_t result = 0; result <= BUS_RESULT_QUEUED; result++) {
+      results[result] += state->results[result];
+    }
+    collided += node_collided;
+    starved += node_starved;
+    if (stats.queue_high_water > queue_high_water) {
+      queue_high_water = stats.queue_high_water;
+    }
+    latency = realloc(latency, (count + state->latency_count + 1) * sizeof(uint32_t));
+    if (!latency) {
+      perror("bus");
+      exit(1);
+    }
+    memcpy(&latency[count], state->latency, state->latency_count * sizeof(uint32_t));
+    count += state->latency_count;
+  }
+
+  bus_row(out, "all", "", 0, 0, results, bus_line_stats.messages, collided, latency, count,
+    starved, queue_high_water);
+  free(latency);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  size_t size;
+  clock_t started = clock();
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <scenario> [seconds] [key=value ...]\n", argv[0]);
+    return 1;
+  }
+  bus_parse(argv[1]);
+  if (argc > 2) {
+    bus_duration_us = bus_number("arguments", 2, argv[2], 86400) * 1000000;
+  }
+  // Keys after the seconds apply to every node
+  for (int arg = 3; arg < argc; arg++) {
+    for (uint16_t index = 0; index < bus_nodes_count; index++) {
+      char option[64];
+      snprintf(option, sizeof(option), "%s", argv[arg]);
+      bus_parse_option("arguments", arg, &bus_nodes[index].config, option);
+    }
+  }
+
+  void *image = bus_read(BUS_NODE_LIBRARY, &size);
+  for (uint16_t index = 0; index < bus_nodes_count; index++) {
+    BUS_NODE_STATE_Type *state = &bus_nodes[index];
+    state->node = bus_load(image, size);
+    state->config.nodes = bus_nodes_count;
+    state->config.seed = (bus_seed * 0x9E3779B9u) ^ (index + 1);
+    state->config.line = &bus_line;
+    state->config.report = bus_report;
+    state->node->init(&state->config);
+  }
+  free(image);
+  bus_nodes[0].node->monitor(bus_monitor);
+
+  // The line is the wired-AND of the nodes, each microsecond
+  for (uint64_t now = 0; now < bus_duration_us; now++) {
+    if (now % BUS_LOOP_US == 0) {
+      for (uint16_t index = 0; index < bus_nodes_count; index++) {
+        bus_nodes[index].node->loop();
+      }
+    }
+    uint8_t level = 1;
+    for (uint16_t index = 0; index < bus_nodes_count; index++) {
+      if (!bus_nodes[index].node->drive()) {
+        bus_nodes[index].driving = 1;
+        level = 0;
+      }
+    }
+    bus_line = level;
+    for (uint16_t index = 0; index < bus_nodes_count; index++) {
+      bus_nodes[index].node->run(1);
+    }
+  }
+
+  bus_results(stdout);
+
+  double seconds = bus_duration_us / 1e6;
+  fprintf(stderr, "bus: %u nodes, %.3f s in %.3f s, %u messages (%.1f/s), %u bad checksum, "
+    "%u framing errors, line in use %.1f%%\n",
+    bus_nodes_count, seconds, (double)(clock() - started) / CLOCKS_PER_SEC,
+    bus_line_stats.messages, bus_line_stats.messages / seconds, bus_line_stats.bad_checksum,
+    bus_line_stats.framing_error, 100.0 * bus_line_stats.bytes * 10 * BUS_BIT_US / bus_duration_us);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * @file bus.h
+ * @brief Interface between the bus simulator and its nodes
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Each node is the Loconet code on its own copy of the peripheral model
+ * (host/samd20_host.c), built into build/host/bus_node.so. The simulator
+ * (bus.c) loads the library once per node, so every node has its own
+ * globals, and finds the functions of a node in its BUS_NODE_Type named
+ * bus_node.
+ *
+ * The simulator owns the line. Before every microsecond it sets the level
+ * to the wired-AND of drive of all nodes, then runs each node for that
+ * microsecond. Every BUS_LOOP_US it runs the main loop of the nodes.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _HOST_BUS_BUS_H_
+#define _HOST_BUS_BUS_H_
+
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+// Time between two runs of the main loop of a node
+#define BUS_LOOP_US 10
+
+//-----------------------------------------------------------------------------
+// Traffic a node generates, every period (plus jitter) from start
+#define BUS_ROLE_IDLE   0 // Only answers, e.g. LNCV reads
+#define BUS_ROLE_SENSOR 1 // Input reports (0xB2) of burst inputs at once
+#define BUS_ROLE_CLOCK  2 // Fast clock master (0xEF slot 0x7B)
+#define BUS_ROLE_LNCV   3 // LNCV programming, a message per event: start,
+                          // burst reads, stop
+
+// Results reported for a generated message, the first are those of
+// LOCONET_TX_RESULT_*
+#define BUS_RESULT_DELIVERED 0x00
+#define BUS_RESULT_COLLIDED  0x01
+#define BUS_RESULT_DROPPED   0x02
+#define BUS_RESULT_COALESCED 0x03
+#define BUS_RESULT_REFUSED   0x04 // The pool was exhausted
+#define BUS_RESULT_QUEUED    0x05
+
+// Called from the main loop of a node for every generated message. The
+// latency is the time since the message was queued.
+typedef void (*BUS_REPORT_Type)(uint8_t node, uint8_t result, uint32_t latency_us);
+
+// Called with each byte on the line, and 1 if its stop bit was low
+typedef void (*BUS_MONITOR_Type)(uint8_t data, uint8_t framing_error);
+
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint8_t index;            // Node number, from 0
+  uint8_t role;             // BUS_ROLE_*
+  uint16_t address;         // LNCV 0, sensors report address * 16 and up
+  uint8_t priority;         // LNCV 2, the priority delay of the line
+  uint8_t retry_limit;      // LNCV 3
+  uint8_t backoff;          // LNCV 4
+  uint8_t coalesce;         // loconet_config.bit.COALESCE
+  uint8_t level;            // Queue priority of the generated messages
+  uint8_t burst;            // Inputs of the sensor role, reads of the LNCV role
+  uint16_t target;          // Address the LNCV role programs, 0 for all
+  uint16_t nodes;           // Number of nodes, for the LNCV role
+  uint32_t start_us;        // First event
+  uint32_t period_us;       // Time between events
+  uint32_t jitter_us;       // Random delay added to every event
+  uint32_t seed;            // Serial number of the node, for the backoff
+  const uint8_t *line;      // Level of the line, set by the simulator
+  BUS_REPORT_Type report;
+} BUS_NODE_CONFIG_Type;
+
+typedef struct {
+  uint16_t collision;       // loconet_stats.collision
+  uint16_t retried;         // loconet_tx_stats.retried
+  uint16_t dropped;         // loconet_tx_stats.dropped
+  uint16_t pool_exhausted;  // loconet_tx_stats.pool_exhausted
+  uint16_t queue_high_water; // loconet_tx_stats.queue_high_water
+  uint16_t rx_overflow;     // loconet_rx_stats.overflow
+} BUS_NODE_STATS_Type;
+
+typedef struct {
+  void (*init)(const BUS_NODE_CONFIG_Type *config);
+  uint8_t (*drive)(void);   // Level the node drives, see host_line_drive
+  void (*run)(uint32_t us); // Advance the node, see host_run
+  void (*loop)(void);       // One pass of the main loop
+  void (*monitor)(BUS_MONITOR_Type monitor);
+  void (*stats)(BUS_NODE_STATS_Type *stats);
+  // Generated messages waiting longer than age_us
+  uint16_t (*waiting)(uint32_t age_us);
+} BUS_NODE_Type;
+
+extern const BUS_NODE_Type bus_node;
+
+#endif // _HOST_BUS_BUS_H_
@@ -0,0 +1,297 @@
+/**
+ * @file bus_node.c
+ * @brief Loconet node of the bus simulator
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * The device of src/main.c without the domotica module, and the traffic
+ * of its role. The configuration goes through the LNCVs as a user would
+ * set them. Generated messages are queued with a completion callback,
+ * which reports their result and latency to the simulator.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_cv.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+#include "utils/eeprom.h"
+
+#include "components/fast_clock.h"
+
+#include "bus.h"
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+FAST_CLOCK_BUILD(2)
+
+//-----------------------------------------------------------------------------
+void irq_handler_eic(void);
+void irq_handler_eic(void) {
+  if (loconet_handle_eic()) {
+    return;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Generated messages on their way, the context of their completion callback
+typedef struct {
+  uint64_t queued;
+  uint8_t used;
+} BUS_PENDING_Type;
+
+static BUS_PENDING_Type bus_pending[LOCONET_TX_POOL_Size];
+
+static BUS_NODE_CONFIG_Type bus_config;
+static uint32_t bus_random_state = 1;
+static uint64_t bus_next_event = 0;
+
+// Session of the LNCV role: the target and the step in the session
+static uint16_t bus_lncv_target = 0;
+static uint8_t bus_lncv_step = 0;
+
+//-----------------------------------------------------------------------------
+// Xorshift32, as loconet_tx_random
+static uint32_t bus_random(void)
+{
+  uint32_t x = bus_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  bus_random_state = x;
+  return x;
+}
+
+//-----------------------------------------------------------------------------
+static void bus_complete(uint8_t result, void *context)
+{
+  BUS_PENDING_Type *pending = context;
+  bus_config.report(bus_config.index, result, host_time() - pending->queued);
+  // A collided message is retried
+  if (result != LOCONET_TX_RESULT_COLLIDED) {
+    pending->used = 0;
+  }
+}
+
+// Queue a generated message, data is the payload as for loconet_tx_reserve
+static void bus_queue(uint8_t opcode, const uint8_t *data, uint8_t length)
+{
+  BUS_PENDING_Type *pending = 0;
+  uint8_t *payload = 0;
+
+  for (uint8_t index = 0; index < LOCONET_TX_POOL_Size && !pending; index++) {
+    if (!bus_pending[index].used) {
+      pending = &bus_pending[index];
+    }
+  }
+  if (pending) {
+    payload = loconet_tx_reserve(length);
+  }
+  if (!payload) {
+    bus_config.report(bus_config.index, BUS_RESULT_REFUSED, 0);
+    return;
+  }
+  memcpy(payload, data, length);
+  pending->used = 1;
+  pending->queued = host_time();
+  loconet_tx_on_complete(payload, bus_complete, pending);
+  loconet_tx_commit(payload, opcode, bus_config.level);
+  bus_config.report(bus_config.index, BUS_RESULT_QUEUED, 0);
+}
+
+//-----------------------------------------------------------------------------
+// Input reports for address * 16 + 1 and up, all inputs toggle together
+static void bus_sensor(void)
+{
+  static uint8_t state = 0;
+  uint8_t data[2];
+
+  state = !state;
+  for (uint8_t index = 0; index < bus_config.burst; index++) {
+    // Encoded as loconet_tx_input_rep
+    uint16_t input = bus_config.address * 16 + index + 1;
+    uint8_t odd = input & 0x01;
+    input = (input - 1) >> 1;
+    data[0] = input & 0x7F;
+    data[1] = ((input >> 7) & 0x0F) | (((odd + 1) % 2) << 5) | (state << 4) | 0x40;
+    bus_queue(0xB2, data, sizeof(data));
+  }
+}
+
+// Fast clock at rate 1, a minute further for every message
+static void bus_clock(void)
+{
+  static uint16_t minutes = 12 * 60;
+  uint8_t data[11] = {
+    0x7B, 1, 0, 0, 128 - 60 + minutes % 60, 0,
+    128 - 24 + (minutes / 60) % 24, minutes / (24 * 60), 1, 0x12, 0x34
+  };
+
+  bus_queue(0xEF, data, sizeof(data));
+  minutes++;
+}
+
+// A message of a programming session per event: start programming the
+// target, read LNCV 0 .. burst - 1, stop. Without a target the sessions
+// go round all nodes.
+static void bus_lncv(void)
+{
+  uint8_t data[12] = {
+    LOCONET_CV_SRC_KPU, LOCONET_CV_DST_UB_KPU & 0xFF, LOCONET_CV_DST_UB_KPU >> 8,
+    LOCONET_CV_REQ_CFGREAD, 0, LOCONET_CV_DEVICE_CLASS & 0xFF, LOCONET_CV_DEVICE_CLASS >> 8,
+    0, 0, 0, 0, 0
+  };
+
+  if (!bus_lncv_target) {
+    bus_lncv_target = bus_config.target ? bus_config.target : 1;
+  }
+  if (bus_lncv_step == 0) {
+    data[3] = LOCONET_CV_REQ_CFGREQUEST;
+    data[9] = bus_lncv_target & 0xFF;
+    data[10] = bus_lncv_target >> 8;
+    data[11] = LOCONET_CV_FLG_PROG_ON;
+  } else if (bus_lncv_step <= bus_config.burst) {
+    data[7] = bus_lncv_step - 1;
+  } else {
+    data[3] = LOCONET_CV_REQ_CFGREQUEST;
+    data[11] = LOCONET_CV_FLG_PROG_OFF;
+  }
+
+  // Most significant bits of the class, number, value and flags
+  for (uint8_t bit = 0; bit < 7; bit++) {
+    if (data[5 + bit] & 0x80) {
+      data[4] |= 0x01 << bit;
+      data[5 + bit] &= 0x7F;
+    }
+  }
+  bus_queue(0xE5, data, sizeof(data));
+
+  if (++bus_lncv_step > bus_config.burst + 1) {
+    bus_lncv_step = 0;
+    if (!bus_config.target) {
+      bus_lncv_target = bus_lncv_target % bus_config.nodes + 1;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void bus_schedule(void);
+
+static void bus_event(void *context)
+{
+  (void)context;
+  switch (bus_config.role) {
+    case BUS_ROLE_SENSOR: bus_sensor(); break;
+    case BUS_ROLE_CLOCK:  bus_clock(); break;
+    case BUS_ROLE_LNCV:   bus_lncv(); break;
+  }
+  if (bus_config.period_us) {
+    bus_schedule();
+  }
+}
+
+// Next event on the grid of the period, with a random delay
+static void bus_schedule(void)
+{
+  uint32_t jitter = bus_config.jitter_us ? bus_random() % bus_config.jitter_us : 0;
+  host_schedule(bus_next_event + jitter - host_time(), bus_event, NULL);
+  bus_next_event += bus_config.period_us;
+}
+
+//-----------------------------------------------------------------------------
+static void bus_eeprom_init(void)
+{
+  // The flash image starts erased
+  if (eeprom_emulator_init() != STATUS_OK) {
+    eeprom_emulator_erase_memory();
+    if (eeprom_emulator_init() != STATUS_OK) {
+      abort();
+    }
+  }
+}
+
+static void bus_init(const BUS_NODE_CONFIG_Type *config)
+{
+  bus_config = *config;
+  bus_random_state = config->seed ? config->seed : 1;
+
+  host_init();
+  // A serial number of its own, so the backoff of nodes differs
+  host_serial_number[3] ^= config->seed;
+  host_line_attach(SERCOM2, &PORT->Group[0], 14, (0x01ul << 15) | (0x01ul << 13));
+  host_line_connect(config->line);
+  __enable_irq();
+
+  bus_eeprom_init();
+  loconet_cv_init();
+  loconet_cv_set(0, config->address);
+  loconet_cv_set(2, config->priority);
+  loconet_cv_set(3, config->retry_limit);
+  loconet_cv_set(4, config->backoff);
+
+  // Set loconet basics, as src/main.c
+  loconet_config.bit.ADDRESS = loconet_cv_get(0);
+  loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_config.bit.RETRY_LIMIT = loconet_cv_get(3);
+  loconet_config.bit.BACKOFF = loconet_cv_get(4);
+  loconet_config.bit.COALESCE = config->coalesce;
+
+  loconet_init();
+
+  fast_clock_init();
+  fast_clock_set_slave();
+
+  if (config->role != BUS_ROLE_IDLE) {
+    bus_next_event = config->start_us;
+    bus_schedule();
+  }
+}
+
+static void bus_loop(void)
+{
+  loconet_loop();
+  fast_clock_loop();
+}
+
+static void bus_stats(BUS_NODE_STATS_Type *stats)
+{
+  stats->collision = loconet_stats.collision;
+  stats->retried = loconet_tx_stats.retried;
+  stats->dropped = loconet_tx_stats.dropped;
+  stats->pool_exhausted = loconet_tx_stats.pool_exhausted;
+  stats->queue_high_water = loconet_tx_stats.queue_high_water;
+  stats->rx_overflow = loconet_rx_stats.overflow;
+}
+
+static uint16_t bus_waiting(uint32_t age_us)
+{
+  uint16_t count = 0;
+  for (uint8_t index = 0; index < LOCONET_TX_POOL_Size; index++) {
+    if (bus_pending[index].used && host_time() - bus_pending[index].queued > age_us) {
+      count++;
+    }
+  }
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+// The only symbol the simulator looks up, the library is built with hidden
+// visibility
+__attribute__((visibility("default"))) const BUS_NODE_Type bus_node = {
+  bus_init,
+  host_line_drive,
+  host_run,
+  bus_loop,
+  host_line_monitor,
+  bus_stats,
+  bus_waiting,
+};
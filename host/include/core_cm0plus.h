@@ -0,0 +1,71 @@
+/**
+ * @file core_cm0plus.h
+ * @brief Cortex-M0+ core peripherals for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Replaces the CMSIS header of the same name in the host build. Registers
+ * are plain memory, so the read-only qualifiers are dropped to let the
+ * model write them. The NVIC functions enable and pend interrupt lines
+ * of the model, see host/samd20_host.h.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef __CORE_CM0PLUS_H_GENERIC
+#define __CORE_CM0PLUS_H_GENERIC
+
+#include <stdint.h>
+
+//-----------------------------------------------------------------------------
+#define __I  volatile
+#define __O  volatile
+#define __IO volatile
+
+#define __STATIC_INLINE static inline
+
+#include "core_cmInstr.h"
+#include "core_cmFunc.h"
+
+//-----------------------------------------------------------------------------
+// Interrupt lines of the model
+extern void host_nvic_enable(int32_t irqn);
+extern void host_nvic_disable(int32_t irqn);
+extern void host_nvic_set_pending(int32_t irqn);
+extern void host_nvic_clear_pending(int32_t irqn);
+extern uint32_t host_nvic_get_pending(int32_t irqn);
+
+__STATIC_INLINE void NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  host_nvic_enable(IRQn);
+}
+
+__STATIC_INLINE void NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  host_nvic_disable(IRQn);
+}
+
+__STATIC_INLINE uint32_t NVIC_GetPendingIRQ(IRQn_Type IRQn)
+{
+  return host_nvic_get_pending(IRQn);
+}
+
+__STATIC_INLINE void NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+  host_nvic_set_pending(IRQn);
+}
+
+__STATIC_INLINE void NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+  host_nvic_clear_pending(IRQn);
+}
+
+// All interrupts have the same priority in the model
+__STATIC_INLINE void NVIC_SetPriority(IRQn_Type IRQn, uint32_t priority)
+{
+  (void)IRQn;
+  (void)priority;
+}
+
+#endif // __CORE_CM0PLUS_H_GENERIC
@@ -0,0 +1,48 @@
+/**
+ * @file core_cmFunc.h
+ * @brief Cortex-M0+ core registers for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Replaces the CMSIS header of the same name in the host build. PRIMASK
+ * is a variable of the model, interrupts are only taken while it is 0.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef __CORE_CMFUNC_H
+#define __CORE_CMFUNC_H
+
+#include <stdint.h>
+
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE static inline
+#endif
+
+//-----------------------------------------------------------------------------
+extern volatile uint32_t host_primask;
+
+__STATIC_INLINE void __enable_irq(void)
+{
+  __asm__ volatile ("" ::: "memory");
+  host_primask = 0;
+}
+
+__STATIC_INLINE void __disable_irq(void)
+{
+  host_primask = 1;
+  __asm__ volatile ("" ::: "memory");
+}
+
+__STATIC_INLINE uint32_t __get_PRIMASK(void)
+{
+  return host_primask;
+}
+
+__STATIC_INLINE void __set_PRIMASK(uint32_t priMask)
+{
+  host_primask = priMask & 0x01;
+}
+
+#endif // __CORE_CMFUNC_H
@@ -0,0 +1,29 @@
+/**
+ * @file core_cmInstr.h
+ * @brief Cortex-M0+ instructions for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Replaces the CMSIS header of the same name in the host build. The model
+ * runs interrupts between the code it calls, never inside it, so barriers
+ * only have to keep the compiler from moving memory accesses.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef __CORE_CMINSTR_H
+#define __CORE_CMINSTR_H
+
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE static inline
+#endif
+
+//-----------------------------------------------------------------------------
+#define __NOP() __asm__ volatile ("" ::: "memory")
+#define __WFI() __asm__ volatile ("" ::: "memory")
+#define __ISB() __asm__ volatile ("" ::: "memory")
+#define __DSB() __asm__ volatile ("" ::: "memory")
+#define __DMB() __asm__ volatile ("" ::: "memory")
+
+#endif // __CORE_CMINSTR_H
@@ -0,0 +1,113 @@
+/**
+ * @file samd20.h
+ * @brief SAMD20 device header for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Takes the register definitions of the device header and moves the
+ * peripherals into host memory, where host/samd20_host.c models them.
+ * host_peripherals is valid after host_init.
+ *
+ * The flash is an image mapped at HOST_FLASH_ADDR by host_init. FLASH_SIZE
+ * is moved along, so the NVM driver and the EEPROM emulator use addresses
+ * in the image. It stays below HOST_FLASH_LIMIT, as NVMCTRL PARAM counts
+ * the pages up to the end of the image in 16 bits and the code keeps
+ * addresses in 32 bits. The user row is at a fixed address below the
+ * images, shared by all models in the process.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _HOST_SAMD20_H_
+#define _HOST_SAMD20_H_
+
+// The C library defines it too, as the byte order of the host
+#undef LITTLE_ENDIAN
+#include_next "samd20.h"
+
+//-----------------------------------------------------------------------------
+// Peripherals, the code sees them read-only and each write traps
+typedef struct {
+  Eic eic;
+  Evsys evsys;
+  Gclk gclk;
+  Nvmctrl nvmctrl;
+  Pm pm;
+  Port port;
+  Sercom sercom[SERCOM_INST_NUM];
+  Sysctrl sysctrl;
+  Tc tc[TC_INST_NUM];
+  Wdt wdt;
+} HOST_PERIPHERALS_Type;
+
+extern HOST_PERIPHERALS_Type *host_peripherals;
+
+#undef EIC
+#define EIC (&host_peripherals->eic)
+#undef EVSYS
+#define EVSYS (&host_peripherals->evsys)
+#undef GCLK
+#define GCLK (&host_peripherals->gclk)
+#undef NVMCTRL
+#define NVMCTRL (&host_peripherals->nvmctrl)
+#undef PM
+#define PM (&host_peripherals->pm)
+#undef PORT
+#define PORT (&host_peripherals->port)
+#undef SYSCTRL
+#define SYSCTRL (&host_peripherals->sysctrl)
+#undef WDT
+#define WDT (&host_peripherals->wdt)
+
+#undef SERCOM0
+#define SERCOM0 (&host_peripherals->sercom[0])
+#undef SERCOM1
+#define SERCOM1 (&host_peripherals->sercom[1])
+#undef SERCOM2
+#define SERCOM2 (&host_peripherals->sercom[2])
+#undef SERCOM3
+#define SERCOM3 (&host_peripherals->sercom[3])
+#undef SERCOM4
+#define SERCOM4 (&host_peripherals->sercom[4])
+#undef SERCOM5
+#define SERCOM5 (&host_peripherals->sercom[5])
+
+#undef TC0
+#define TC0 (&host_peripherals->tc[0])
+#undef TC1
+#define TC1 (&host_peripherals->tc[1])
+#undef TC2
+#define TC2 (&host_peripherals->tc[2])
+#undef TC3
+#define TC3 (&host_peripherals->tc[3])
+#undef TC4
+#define TC4 (&host_peripherals->tc[4])
+#undef TC5
+#define TC5 (&host_peripherals->tc[5])
+#undef TC6
+#define TC6 (&host_peripherals->tc[6])
+#undef TC7
+#define TC7 (&host_peripherals->tc[7])
+
+//-----------------------------------------------------------------------------
+// Flash image and user row
+extern uintptr_t host_flash_addr;
+
+#define HOST_USER_ROW    0x000FF000UL
+#define HOST_FLASH_BASE  0x00100000UL
+#define HOST_FLASH_LIMIT ((NVMCTRL_PARAM_NVMP_Msk >> NVMCTRL_PARAM_NVMP_Pos) * FLASH_PAGE_SIZE)
+#define HOST_FLASH_ADDR  host_flash_addr
+#define HOST_FLASH_SIZE  (FLASH_NB_OF_PAGES * FLASH_PAGE_SIZE)
+
+#undef FLASH_SIZE
+#define FLASH_SIZE (HOST_FLASH_ADDR + HOST_FLASH_SIZE)
+#undef NVMCTRL_USER
+#define NVMCTRL_USER HOST_USER_ROW
+
+//-----------------------------------------------------------------------------
+// Serial number words of the device, see loconet_tx.c
+extern uint32_t host_serial_number[4];
+#define LOCONET_TX_SERIAL_NUMBER(word) (host_serial_number[(word)])
+
+#endif // _HOST_SAMD20_H_
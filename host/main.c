@@ -0,0 +1,431 @@
+/**
+ * @file main.c
+ * @brief Loconet device on a virtual line, for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Runs the device of src/main.c on the model of host/samd20_host.c, with
+ * a peer on the line. The peer sets the fast clock and reads the counters
+ * of the device (LNCV 1000 and up), the device reports an input. The peer
+ * reports a sensor domotica does not use, a subscription of the device
+ * should see every report. All bytes on the line pass the monitor, which
+ * checks the messages.
+ *
+ *   build/host/starter [seconds]
+ *
+ * runs for the given virtual time, 10 seconds by default, prints the
+ * counters and fails if a read was not answered, a sensor report of the
+ * peer did not reach the subscription or a message was broken.
+ * The device compares the echo of its own bytes, so on this clean line
+ * no byte may be skipped.
+ * Built with `make host PROFILE=1` it also prints the profile probes, the
+ * interrupt times include the model of the registers. With LOOP_MONITOR=1
+ * it prints the histogram of the main loop and its stalls.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_cv.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+#include "utils/eeprom.h"
+#include "utils/loop_monitor.h"
+#include "utils/profile.h"
+
+#include "components/fast_clock.h"
+
+#include "domotica/domotica.h"
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+FAST_CLOCK_BUILD(2)
+
+//-----------------------------------------------------------------------------
+void irq_handler_eic(void);
+void irq_handler_eic(void) {
+  PROFILE_BEGIN(IRQ_EIC);
+  if (loconet_handle_eic()) {
+    PROFILE_END(IRQ_EIC);
+    return;
+  }
+  PROFILE_END(IRQ_EIC);
+}
+
+//-----------------------------------------------------------------------------
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off);
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off)
+{
+  (void) mask_on;
+  (void) mask_off;
+}
+
+//-----------------------------------------------------------------------------
+// Scenario
+#define SCENARIO_CLOCK_DELAY_US  50000
+#define SCENARIO_READ_PERIOD_US  100000
+#define SCENARIO_INPUT_PERIOD_US 150000
+#define SCENARIO_INPUT_ADDRESS   17
+#define SCENARIO_SENSOR_PERIOD_US 170000
+#define SCENARIO_SENSOR_ADDRESS  1000
+
+// Time of the fast clock sent by the peer
+#define SCENARIO_CLOCK_HOUR   12
+#define SCENARIO_CLOCK_MINUTE 30
+#define SCENARIO_CLOCK_DAY    2
+
+typedef struct {
+  uint32_t messages;        // Messages seen by the monitor
+  uint32_t bad_checksum;    // Messages with a wrong checksum
+  uint32_t framing_error;   // Bytes with a low stop bit
+  uint32_t reads;           // LNCV reads sent by the peer
+  uint32_t replies;         // LNCV replies of the device
+  uint32_t inputs;          // Input reports of the device
+  uint32_t sensors;         // Sensor reports sent by the peer
+  uint32_t subscribed;      // Sensor reports of the peer seen by the subscription
+} SCENARIO_STATS_Type;
+
+static SCENARIO_STATS_Type scenario_stats = { 0, 0, 0, 0, 0, 0, 0, 0 };
+static uint64_t scenario_end = 0;
+static uint16_t scenario_values[LOCONET_CV_STATS_Size];
+
+//-----------------------------------------------------------------------------
+static uint8_t scenario_checksum(const uint8_t *data, uint8_t length)
+{
+  uint8_t checksum = 0xFF;
+  while (length--) {
+    checksum ^= *data++;
+  }
+  return checksum;
+}
+
+// Queue a message for the peer, the last byte is the checksum
+static void scenario_send(uint8_t *data, uint8_t length)
+{
+  data[length - 1] = scenario_checksum(data, length - 1);
+  if (!host_line_send(data, length)) {
+    fprintf(stderr, "peer queue full\n");
+    exit(1);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void scenario_clock(void *context)
+{
+  (void)context;
+  uint8_t message[14] = {
+    0xEF, 0x0E, 0x7B, 1, 0, 0, 128 - 60 + SCENARIO_CLOCK_MINUTE, 0,
+    128 - 24 + SCENARIO_CLOCK_HOUR, SCENARIO_CLOCK_DAY, 1, 0x12, 0x34, 0
+  };
+  scenario_send(message, sizeof(message));
+}
+
+// LNCV read by a KPU, the counters are LNCV 1000 and up
+static void scenario_read(void *context)
+{
+  (void)context;
+  uint16_t number = LOCONET_CV_STATS_START + scenario_stats.reads % LOCONET_CV_STATS_Size;
+  uint8_t message[15] = {
+    0xE5, 0x0F, LOCONET_CV_SRC_KPU, 0x49, 0x4B, LOCONET_CV_REQ_CFGREAD, 0,
+    LOCONET_CV_DEVICE_CLASS & 0xFF, LOCONET_CV_DEVICE_CLASS >> 8,
+    number & 0xFF, number >> 8, 0, 0, 0, 0
+  };
+  for (uint8_t index = 0; index < 7; index++) {
+    if (message[7 + index] & 0x80) {
+      message[6] |= 0x01 << index;
+      message[7 + index] &= 0x7F;
+    }
+  }
+  scenario_send(message, sizeof(message));
+  scenario_stats.reads++;
+
+  // The last read is answered before the end
+  if (host_time() + 2 * SCENARIO_READ_PERIOD_US < scenario_end) {
+    host_schedule(SCENARIO_READ_PERIOD_US, scenario_read, NULL);
+  }
+}
+
+// Sensor report of another module, for an address domotica does not use
+static void scenario_sensor(void *context)
+{
+  (void)context;
+  uint16_t address = SCENARIO_SENSOR_ADDRESS;
+  uint8_t message[4] = {
+    0xB2, (address >> 1) & 0x7F, 0x40 | ((address & 0x01) << 5) | ((address >> 8) & 0x0F), 0
+  };
+  scenario_send(message, sizeof(message));
+  scenario_stats.sensors++;
+
+  // The last report is handled before the end
+  if (host_time() + 2 * SCENARIO_SENSOR_PERIOD_US < scenario_end) {
+    host_schedule(SCENARIO_SENSOR_PERIOD_US, scenario_sensor, NULL);
+  }
+}
+
+// Subscription of the device to all sensor reports
+static void scenario_subscribed(uint8_t *message, uint8_t length, void *context)
+{
+  (void)length;
+  (void)context;
+  uint16_t address = (message[1] << 1) | ((message[2] >> 5) & 0x01) | ((message[2] & 0x0F) << 8);
+  if (address == SCENARIO_SENSOR_ADDRESS) {
+    scenario_stats.subscribed++;
+  }
+}
+
+static void scenario_input(void *context)
+{
+  static bool state = false;
+  (void)context;
+  state = !state;
+  loconet_tx_input_rep(SCENARIO_INPUT_ADDRESS, state);
+  host_schedule(SCENARIO_INPUT_PERIOD_US, scenario_input, NULL);
+  host_schedule(SCENARIO_SENSOR_PERIOD_US, scenario_sensor, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Messages on the line, from the peer and the device
+static void scenario_message(uint8_t *message, uint8_t length)
+{
+  scenario_stats.messages++;
+  if (scenario_checksum(message, length)) {
+    scenario_stats.bad_checksum++;
+    return;
+  }
+  if (message[0] == 0xB2 && message[1] != ((SCENARIO_SENSOR_ADDRESS >> 1) & 0x7F)) {
+    scenario_stats.inputs++;
+  } else if (message[0] == 0xE5 && message[2] == LOCONET_CV_SRC_MODULE) {
+    // Restore the most significant bits
+    for (uint8_t index = 0; index < 7; index++) {
+      if (message[6] & (0x01 << index)) {
+        message[7 + index] |= 0x80;
+      }
+    }
+    uint16_t number = message[9] | (message[10] << 8);
+    if (number >= LOCONET_CV_STATS_START && number < LOCONET_CV_STATS_START + LOCONET_CV_STATS_Size) {
+      scenario_values[number - LOCONET_CV_STATS_START] = message[11] | (message[12] << 8);
+      scenario_stats.replies++;
+    }
+  }
+}
+
+static void scenario_monitor(uint8_t data, uint8_t framing_error)
+{
+  static uint8_t message[HOST_LINE_MESSAGE_Size];
+  static uint8_t length = 0;
+  static uint8_t expected = 0;
+
+  if (framing_error) {
+    scenario_stats.framing_error++;
+    length = 0;
+    return;
+  }
+  if (data & 0x80) {
+    length = 0;
+    switch (data & 0x60) {
+      case 0x00: expected = 2; break;
+      case 0x20: expected = 4; break;
+      case 0x40: expected = 6; break;
+      default:   expected = 0; break;
+    }
+  } else if (!length) {
+    return;
+  } else if (length == 1 && !expected) {
+    expected = data;
+  }
+  if (length < sizeof(message)) {
+    message[length++] = data;
+  }
+  if (length == expected) {
+    scenario_message(message, length);
+    length = 0;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void eeprom_init(void)
+{
+  // The flash image starts erased
+  if (eeprom_emulator_init() != STATUS_OK) {
+    eeprom_emulator_erase_memory();
+    if (eeprom_emulator_init() != STATUS_OK) {
+      fprintf(stderr, "eeprom emulator failed\n");
+      exit(1);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+#ifdef UTILS_PROFILE
+static void scenario_profile(void)
+{
+  PROFILE_STATS_Type stats;
+
+  printf("profile (" PROFILE_UNIT "):\n");
+  for (uint8_t probe = 0; probe < PROFILE_PROBES_Size; probe++) {
+    profile_get(probe, &stats);
+    if (stats.count) {
+      printf("  %-22s %8u count %8u min %8u avg %8u max\n", profile_name(probe),
+        stats.count, stats.min, (uint32_t)(stats.total / stats.count), stats.max);
+    }
+  }
+}
+#else
+#define scenario_profile(...) do {} while (0)
+#endif
+
+#if LOCONET_TX_LATENCY_BUCKETS
+static void scenario_latency(void)
+{
+  printf("latency (us):\n");
+  for (uint8_t level = 0; level < LOCONET_TX_PRIORITY_LEVELS; level++) {
+    LOCONET_TX_LATENCY_Type *latency = &loconet_tx_latency[level];
+    if (!latency->count) {
+      continue;
+    }
+    printf("  level %-2u %8u count %8u min %8u avg %8u max\n", level, latency->count,
+      latency->minimum, loconet_tx_latency_average(level), latency->maximum);
+    for (uint8_t bucket = 0; bucket < LOCONET_TX_LATENCY_BUCKETS; bucket++) {
+      if (latency->histogram[bucket]) {
+        printf("    %s %-8lu %8u\n", bucket < LOCONET_TX_LATENCY_BUCKETS - 1 ? "< " : ">=",
+          1024ul << (bucket < LOCONET_TX_LATENCY_BUCKETS - 1 ? bucket : bucket - 1),
+          latency->histogram[bucket]);
+      }
+    }
+  }
+}
+#else
+#define scenario_latency(...) do {} while (0)
+#endif
+
+#ifdef UTILS_LOOP_MONITOR
+static void scenario_loop_monitor(void)
+{
+  printf("loop (us):\n");
+  for (uint8_t bucket = 0; bucket < LOOP_MONITOR_BUCKETS; bucket++) {
+    if (loop_monitor_stats.histogram[bucket]) {
+      printf("  %s %-6lu %8u\n", bucket < LOOP_MONITOR_BUCKETS - 1 ? "< " : ">=",
+        0x01ul << (bucket < LOOP_MONITOR_BUCKETS - 1 ? bucket : bucket - 1),
+        loop_monitor_stats.histogram[bucket]);
+    }
+  }
+  for (uint8_t stage = 0; stage < LOOP_MONITOR_STAGES_Size; stage++) {
+    if (loop_monitor_stats.stalls[stage]) {
+      printf("  stall %s %u\n", loop_monitor_name(stage), loop_monitor_stats.stalls[stage]);
+    }
+  }
+  printf("  longest %s %u " TIMESTAMP_UNIT "\n",
+    loop_monitor_name(loop_monitor_stats.longest_stage), loop_monitor_stats.longest);
+}
+#else
+#define scenario_loop_monitor(...) do {} while (0)
+#endif
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  double seconds = argc > 1 ? atof(argv[1]) : 10;
+  clock_t started = clock();
+
+  host_init();
+  profile_init();
+  host_line_attach(SERCOM2, &PORT->Group[0], 14, (0x01ul << 15) | (0x01ul << 13));
+  host_line_monitor(scenario_monitor);
+  __enable_irq();
+
+  eeprom_init();
+
+  // Initialize CVs for loconet
+  loconet_cv_init();
+
+  // Set loconet basics
+  loconet_config.bit.ADDRESS = loconet_cv_get(0);
+  loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_config.bit.RETRY_LIMIT = loconet_cv_get(3);
+  loconet_config.bit.BACKOFF = loconet_cv_get(4);
+
+  // Initialize loconet
+  loconet_init();
+
+  // Set up the fast clock
+  fast_clock_init();
+  fast_clock_set_slave();
+
+  // Initialize domotica
+  domotica_init();
+
+  loop_monitor_init();
+
+  // Another consumer of sensor reports, next to domotica
+  loconet_rx_subscribe(0xB2, 0, 0, scenario_subscribed, NULL);
+
+  scenario_end = seconds * 1000000;
+  host_schedule(SCENARIO_CLOCK_DELAY_US, scenario_clock, NULL);
+  host_schedule(SCENARIO_READ_PERIOD_US, scenario_read, NULL);
+  host_schedule(SCENARIO_INPUT_PERIOD_US, scenario_input, NULL);
+
+  while (host_time() < scenario_end) {
+    PROFILE_BEGIN(LOOP);
+    loop_monitor_stage(LOOP_MONITOR_LOCONET);
+    PROFILE_BEGIN(LOOP_LOCONET);
+    loconet_loop();
+    PROFILE_END(LOOP_LOCONET);
+    loop_monitor_stage(LOOP_MONITOR_FAST_CLOCK);
+    PROFILE_BEGIN(LOOP_FAST_CLOCK);
+    fast_clock_loop();
+    PROFILE_END(LOOP_FAST_CLOCK);
+    loop_monitor_stage(LOOP_MONITOR_DOMOTICA);
+    PROFILE_BEGIN(LOOP_DOMOTICA);
+    domotica_loop();
+    PROFILE_END(LOOP_DOMOTICA);
+    PROFILE_END(LOOP);
+    loop_monitor_end();
+    host_run(10);
+  }
+
+  FAST_CLOCK_TIME_Type time = fast_clock_get_time();
+  printf("virtual %.3f s, wall %.3f s\n", host_time() / 1e6, (double)(clock() - started) / CLOCKS_PER_SEC);
+  printf("line:    %u messages, %u bad checksum, %u framing errors, %u low\n",
+    scenario_stats.messages, scenario_stats.bad_checksum, scenario_stats.framing_error, host_stats.line_low);
+  printf("peer:    %u reads, %u replies, %u inputs, %u sensors, %u subscribed, %u collisions\n",
+    scenario_stats.reads, scenario_stats.replies, scenario_stats.inputs, scenario_stats.sensors,
+    scenario_stats.subscribed, host_stats.peer_collision);
+  printf("rx:      %u received, %u bad checksum, %u skipped, %u overflow\n",
+    loconet_rx_stats.received, loconet_rx_stats.bad_checksum, loconet_rx_stats.skipped, loconet_rx_stats.overflow);
+  printf("tx:      %u retried, %u dropped, %u queue high water\n",
+    loconet_tx_stats.retried, loconet_tx_stats.dropped, loconet_tx_stats.queue_high_water);
+  printf("loconet: %u framing errors, %u collisions, %u ms busy\n",
+    loconet_stats.framing_error, loconet_stats.collision, loconet_stats.busy / 1000);
+  printf("lncv:   ");
+  for (uint8_t index = 0; index < LOCONET_CV_STATS_Size; index++) {
+    printf(" %u", scenario_values[index]);
+  }
+  printf("\nclock:   day %u %02u:%02u:%02u\n", time.day, time.hour, time.minute, time.second);
+  printf("irq:     eic %u, sercom2 %u, tc1 %u, tc2 %u, limit %u\n",
+    host_stats.irq[EIC_IRQn], host_stats.irq[SERCOM2_IRQn], host_stats.irq[TC1_IRQn],
+    host_stats.irq[TC2_IRQn], host_stats.irq_limit);
+  scenario_latency();
+  scenario_profile();
+  scenario_loop_monitor();
+
+  if (scenario_stats.replies != scenario_stats.reads || scenario_stats.subscribed != scenario_stats.sensors
+      || scenario_stats.bad_checksum
+      || scenario_stats.framing_error || loconet_rx_stats.skipped || time.day != SCENARIO_CLOCK_DAY
+      || time.hour != SCENARIO_CLOCK_HOUR || time.minute < SCENARIO_CLOCK_MINUTE) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,390 @@
+/**
+ * @file replay.c
+ * @brief Replay a Loconet capture through the receive path
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Runs the device of src/main.c on the model of host/samd20_host.c and
+ * feeds it the bytes of a capture, a message at a time, through
+ * loconet_rx_buffer_push and loconet_rx_process, as the receive interrupt
+ * and the main loop do. The handlers are the real ones, domotica included.
+ * Only pushing and processing is timed, the device runs its main loop and
+ * virtual time between the messages.
+ *
+ *   build/host/replay [capture] [passes]
+ *
+ * replays host/replay/layout.ln by default, 5 passes. It prints, of the
+ * fastest pass, the time per message by opcode class and the messages per
+ * second, and the checksum failures and resyncs of a pass.
+ *
+ * A capture holding a byte with the top bit set (every opcode has it) is
+ * raw: the bytes as received, back to back on the wire. Otherwise it is
+ * text: hexadecimal bytes, # starts a comment. A line may start with a
+ * timestamp, microseconds since the start of the capture followed by a
+ * colon, which is the time of its first byte. Other bytes follow the
+ * previous one on the wire.
+ *
+ * A message runs from an opcode up to the next opcode. A resync is a
+ * message cut short by the next opcode, data bytes after a complete
+ * message, or data bytes before the first opcode.
+ *
+ * Register writes trap on the host (see host/samd20_host.h), which costs
+ * microseconds. Messages whose handlers write registers, like LNCV
+ * writes to the flash, are dominated by it.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_cv.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+#include "utils/eeprom.h"
+
+#include "components/fast_clock.h"
+
+#include "domotica/domotica.h"
+
+#ifndef REPLAY_CORPUS
+#define REPLAY_CORPUS "host/replay/layout.ln"
+#endif
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+FAST_CLOCK_BUILD(2)
+
+//-----------------------------------------------------------------------------
+void irq_handler_eic(void);
+void irq_handler_eic(void) {
+  if (loconet_handle_eic()) {
+    return;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off);
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off)
+{
+  (void) mask_on;
+  (void) mask_off;
+}
+
+//-----------------------------------------------------------------------------
+// A byte on the wire: start bit, 8 data bits and a stop bit of 60us
+#define REPLAY_BYTE_US (10 * HOST_LINE_BIT_US)
+
+// Time of a byte without a timestamp
+#define REPLAY_UNTIMED UINT64_MAX
+
+// Opcode classes, bits 5 and 6 of the opcode give the length
+#define REPLAY_CLASS_Size 5
+#define REPLAY_CLASS_NONE 4 // Data bytes before the first opcode
+
+static const char *const replay_class_names[REPLAY_CLASS_Size] = {
+  "2 bytes", "4 bytes", "6 bytes", "variable", "no opcode"
+};
+
+typedef struct {
+  uint32_t offset;          // First byte in replay_bytes
+  uint32_t length;          // Bytes up to the next opcode
+  uint8_t class;            // REPLAY_CLASS_*, or bits 5 and 6 of the opcode
+  uint8_t truncated;        // Cut short by the next opcode
+  uint8_t trailing;         // Data bytes after the complete message
+} REPLAY_FRAME_Type;
+
+typedef struct {
+  uint32_t frames[REPLAY_CLASS_Size];
+  uint64_t ns[REPLAY_CLASS_Size];
+} REPLAY_PASS_Type;
+
+static uint8_t *replay_bytes = NULL;
+static uint64_t *replay_times = NULL;
+static uint32_t replay_length = 0;
+static REPLAY_FRAME_Type *replay_frames = NULL;
+static uint32_t replay_frame_count = 0;
+
+//-----------------------------------------------------------------------------
+static void replay_fail(const char *path, const char *message)
+{
+  fprintf(stderr, "replay: %s: %s\n", path, message);
+  exit(1);
+}
+
+static void replay_add(uint8_t byte, uint64_t at)
+{
+  static uint32_t size = 0;
+  if (replay_length == size) {
+    size = size ? 2 * size : 4096;
+    replay_bytes = realloc(replay_bytes, size);
+    replay_times = realloc(replay_times, size * sizeof(*replay_times));
+    if (!replay_bytes || !replay_times) {
+      replay_fail("capture", "out of memory");
+    }
+  }
+  replay_bytes[replay_length] = byte;
+  replay_times[replay_length++] = at;
+}
+
+// Hexadecimal bytes, # comments and timestamps followed by a colon
+static void replay_parse(const char *path, char *text)
+{
+  uint64_t at = REPLAY_UNTIMED;
+
+  while (*text) {
+    size_t length = strcspn(text, " \t\r\n#");
+    char *end;
+    if (*text == '#') {
+      text += strcspn(text, "\n");
+    } else if (!length) {
+      text++;
+    } else if (text[length - 1] == ':') {
+      at = strtoull(text, &end, 10);
+      if (end != text + length - 1) {
+        replay_fail(path, "bad timestamp");
+      }
+      text += length;
+    } else {
+      unsigned long value = strtoul(text, &end, 16);
+      if (end != text + length || value > 0xFF) {
+        replay_fail(path, "bad byte");
+      }
+      replay_add(value, at);
+      at = REPLAY_UNTIMED;
+      text += length;
+    }
+  }
+}
+
+static void replay_read(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    replay_fail(path, "cannot open");
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  if (!data || fread(data, 1, size, file) != (size_t)size) {
+    replay_fail(path, "cannot read");
+  }
+  fclose(file);
+  data[size] = 0;
+
+  uint8_t raw = 0;
+  for (long index = 0; index < size && !raw; index++) {
+    raw = data[index] & 0x80;
+  }
+  if (raw) {
+    for (long index = 0; index < size; index++) {
+      replay_add(data[index], REPLAY_UNTIMED);
+    }
+  } else {
+    replay_parse(path, data);
+  }
+  free(data);
+}
+
+//-----------------------------------------------------------------------------
+// Length of the message from its first bytes, 0 if unknown
+static uint8_t replay_expected(const uint8_t *data, uint32_t length)
+{
+  switch (data[0] & 0x60) {
+    case 0x00: return 2;
+    case 0x20: return 4;
+    case 0x40: return 6;
+  }
+  return length > 1 ? data[1] : 0;
+}
+
+// Split the bytes into messages, each opcode starts one
+static void replay_split(void)
+{
+  replay_frames = calloc(replay_length ? replay_length : 1, sizeof(*replay_frames));
+  if (!replay_frames) {
+    replay_fail("capture", "out of memory");
+  }
+  for (uint32_t index = 0; index < replay_length; index++) {
+    if (!index || (replay_bytes[index] & 0x80)) {
+      REPLAY_FRAME_Type *frame = &replay_frames[replay_frame_count++];
+      frame->offset = index;
+      frame->class = (replay_bytes[index] & 0x80) ? (replay_bytes[index] >> 5) & 0x03 : REPLAY_CLASS_NONE;
+    }
+    replay_frames[replay_frame_count - 1].length++;
+  }
+
+  for (uint32_t index = 0; index < replay_frame_count; index++) {
+    REPLAY_FRAME_Type *frame = &replay_frames[index];
+    if (frame->class == REPLAY_CLASS_NONE) {
+      frame->trailing = 1;
+      continue;
+    }
+    uint8_t expected = replay_expected(&replay_bytes[frame->offset], frame->length);
+    frame->truncated = !expected || frame->length < expected;
+    frame->trailing = expected && frame->length > expected;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t replay_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Cost of taking the time, subtracted from every message
+static uint64_t replay_overhead(void)
+{
+  uint64_t overhead = UINT64_MAX;
+  for (uint16_t count = 0; count < 1000; count++) {
+    uint64_t start = replay_ns();
+    uint64_t spent = replay_ns() - start;
+    if (spent < overhead) {
+      overhead = spent;
+    }
+  }
+  return overhead;
+}
+
+// Run the main loop of the device up to the virtual time
+static void replay_until(uint64_t at)
+{
+  while (host_time() < at) {
+    uint64_t left = at - host_time();
+    loconet_loop();
+    fast_clock_loop();
+    domotica_loop();
+    host_run(left < 10 ? left : 10);
+  }
+}
+
+static void replay_pass(REPLAY_PASS_Type *pass, uint64_t overhead)
+{
+  uint64_t base = host_time();
+  uint64_t end = base;
+
+  memset(pass, 0, sizeof(*pass));
+  for (uint32_t index = 0; index < replay_frame_count; index++) {
+    REPLAY_FRAME_Type *frame = &replay_frames[index];
+    uint64_t at = replay_times[frame->offset];
+    uint64_t start = (at != REPLAY_UNTIMED && base + at > end) ? base + at : end;
+
+    // Received once the first byte is in
+    replay_until(start + REPLAY_BYTE_US);
+
+    uint64_t started = replay_ns();
+    for (uint32_t count = 0; count < frame->length; count++) {
+      loconet_rx_buffer_push(replay_bytes[frame->offset + count]);
+    }
+    while (loconet_rx_process());
+    uint64_t spent = replay_ns() - started;
+
+    pass->frames[frame->class]++;
+    pass->ns[frame->class] += spent > overhead ? spent - overhead : 0;
+    end = start + frame->length * REPLAY_BYTE_US;
+  }
+  replay_until(end);
+}
+
+//-----------------------------------------------------------------------------
+static void eeprom_init(void)
+{
+  // The flash image starts erased
+  if (eeprom_emulator_init() != STATUS_OK) {
+    eeprom_emulator_erase_memory();
+    if (eeprom_emulator_init() != STATUS_OK) {
+      fprintf(stderr, "eeprom emulator failed\n");
+      exit(1);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  const char *path = argc > 1 ? argv[1] : REPLAY_CORPUS;
+  int passes = argc > 2 ? atoi(argv[2]) : 5;
+  clock_t started = clock();
+
+  replay_read(path);
+  replay_split();
+  if (!replay_frame_count || passes < 1) {
+    replay_fail(path, "nothing to replay");
+  }
+
+  host_init();
+  host_line_attach(SERCOM2, &PORT->Group[0], 14, (0x01ul << 15) | (0x01ul << 13));
+  __enable_irq();
+
+  eeprom_init();
+
+  // Set up the device as src/main.c
+  loconet_cv_init();
+  loconet_config.bit.ADDRESS = loconet_cv_get(0);
+  loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_config.bit.RETRY_LIMIT = loconet_cv_get(3);
+  loconet_config.bit.BACKOFF = loconet_cv_get(4);
+  loconet_init();
+  fast_clock_init();
+  fast_clock_set_slave();
+  domotica_init();
+
+  // Counters of the first pass, the device handles later passes alike
+  uint64_t overhead = replay_overhead();
+  LOCONET_RX_STATS_Type before = loconet_rx_stats;
+  REPLAY_PASS_Type pass, best;
+  uint64_t best_ns = UINT64_MAX;
+  LOCONET_RX_STATS_Type first = { 0 };
+
+  for (int count = 0; count < passes; count++) {
+    replay_pass(&pass, overhead);
+    if (!count) {
+      first = loconet_rx_stats;
+    }
+    uint64_t ns = 0;
+    for (uint8_t class = 0; class < REPLAY_CLASS_Size; class++) {
+      ns += pass.ns[class];
+    }
+    if (ns < best_ns) {
+      best_ns = ns;
+      best = pass;
+    }
+  }
+
+  uint32_t truncated = 0;
+  uint32_t trailing = 0;
+  for (uint32_t index = 0; index < replay_frame_count; index++) {
+    truncated += replay_frames[index].truncated;
+    trailing += replay_frames[index].trailing;
+  }
+
+  printf("replay:   %s, %u messages, %u bytes, %d passes\n", path, replay_frame_count, replay_length, passes);
+  printf("virtual %.3f s, wall %.3f s, %lu ns to take the time\n",
+    host_time() / 1e6, (double)(clock() - started) / CLOCKS_PER_SEC, (unsigned long)overhead);
+  printf("class     messages  ns/message\n");
+  for (uint8_t class = 0; class < REPLAY_CLASS_Size; class++) {
+    if (best.frames[class]) {
+      printf("%-9s %8u  %10.1f\n", replay_class_names[class], best.frames[class], (double)best.ns[class] / best.frames[class]);
+    }
+  }
+  printf("%-9s %8u  %10.1f  %.0f messages/s\n", "all", replay_frame_count,
+    (double)best_ns / replay_frame_count, best_ns ? replay_frame_count * 1e9 / best_ns : 0);
+  printf("rx:       %u received, %u bad checksum, %u bad length, %u filtered, %u skipped, %u overflow\n",
+    (uint16_t)(first.received - before.received), (uint16_t)(first.bad_checksum - before.bad_checksum),
+    (uint16_t)(first.bad_length - before.bad_length), (uint16_t)(first.filtered - before.filtered),
+    (uint16_t)(first.skipped - before.skipped), (uint16_t)(first.overflow - before.overflow));
+  printf("resync:   %u, %u messages cut short, %u with data bytes after them\n",
+    truncated + trailing, truncated, trailing);
+  return 0;
+}
@@ -0,0 +1,614 @@
+/**
+ * @file rings.c
+ * @brief Handoff between the main loop and the interrupts, on two threads
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Checks the rings between the main loop and the interrupts with the
+ * interrupt role on a thread of its own:
+ *
+ *   build/host/rings [messages] [seed]
+ *
+ * The main thread runs the main loop. Every RINGS_IRQ_PERIOD us a timer
+ * signal stops it wherever it is, its handler waits while the interrupt
+ * thread runs the interrupt handler. The main loop is preempted at any
+ * instruction, as on the device, but never runs at the same time as the
+ * interrupt. While PRIMASK is set the interrupt is refused, the next one
+ * comes soon.
+ *
+ * The peripherals are plain memory here, the model of samd20_host.c is
+ * not thread safe and not needed.
+ *
+ * - tx: the main loop commits messages and runs loconet_tx_process, the
+ *   interrupt sends the current message a byte at a time, compares the
+ *   echo, collides now and then (loconet_irq_collision) and commits
+ *   messages of its own, as another interrupt handler would. Every
+ *   message should be sent exactly once and in order of its producer.
+ *   Collided messages are retried without limit.
+ * - rx stalled: the interrupt floods the RX ring while the main loop does
+ *   not run, then the main loop empties it. The interrupt should never
+ *   wait, messages which did not fit are counted as overflow.
+ * - rx flood: the interrupt floods the RX ring while the main loop takes
+ *   messages from it, pausing now and then. Every message should be
+ *   dispatched whole and in order, or counted as dropped.
+ * - rx oversized: a message which does not fit in the empty ring is
+ *   counted as oversized, one with a length byte below 3 as bad length,
+ *   the next message is dispatched.
+ *
+ * Fails if a check fails or a phase does not finish within
+ * RINGS_TIMEOUT seconds.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+//-----------------------------------------------------------------------------
+// The parts of the model the code refers to. Registers are plain memory.
+static HOST_PERIPHERALS_Type rings_peripherals;
+HOST_PERIPHERALS_Type *host_peripherals = &rings_peripherals;
+volatile uint32_t host_primask = 0;
+uintptr_t host_flash_addr = 0;
+uint32_t host_serial_number[4] = { 0x4C4F434F, 0x4E455448, 0x4F535453, 0x414D4432 };
+
+void host_nvic_enable(int32_t irqn) { (void) irqn; }
+void host_nvic_disable(int32_t irqn) { (void) irqn; }
+void host_nvic_set_pending(int32_t irqn) { (void) irqn; }
+void host_nvic_clear_pending(int32_t irqn) { (void) irqn; }
+uint32_t host_nvic_get_pending(int32_t irqn) { (void) irqn; return 0; }
+
+//-----------------------------------------------------------------------------
+// Seconds a phase may take
+#ifndef RINGS_TIMEOUT
+#define RINGS_TIMEOUT 120
+#endif
+
+// Opcode of the test messages, variable length and not handled by the
+// library itself
+#define RINGS_OPCODE 0xE6
+
+// Producers of TX messages
+#define RINGS_PRODUCER_MAIN 0
+#define RINGS_PRODUCER_IRQ  1
+#define RINGS_PRODUCER_Size 2
+
+// Payload of a TX message: producer and sequence number
+#define RINGS_TX_PAYLOAD 4
+
+// Longest RX message, messages of up to LOCONET_RX_RINGBUFFER_Size / 2 - 4
+// bytes always fit in the empty ring (128 by default). And the length of
+// one which never fits.
+#define RINGS_RX_LONGEST  60
+#define RINGS_RX_OVERSIZE 127
+
+//-----------------------------------------------------------------------------
+// Interrupts are requested by an interval timer (SIGALRM), which stops the
+// main thread wherever it is. Only the main thread takes the signal.
+#ifndef RINGS_IRQ_PERIOD
+#define RINGS_IRQ_PERIOD 50 /* us */
+#endif
+
+// Handshake of an interrupt, written by both threads
+#define RINGS_IRQ_IDLE    0
+#define RINGS_IRQ_STOPPED 1 // Main thread waits in the signal handler
+
+static volatile int rings_irq_state = RINGS_IRQ_IDLE;
+static sem_t rings_irq_request;
+
+typedef void (*RINGS_HANDLER_Type)(void);
+
+typedef struct {
+  uint64_t taken;           // Interrupts run
+  uint64_t refused;         // Interrupts refused for PRIMASK
+} RINGS_IRQ_STATS_Type;
+
+static RINGS_IRQ_STATS_Type rings_irq_stats;
+
+// First failed check, reported by the main thread
+static volatile int rings_failed = 0;
+static const char *rings_failure = NULL;
+static uint32_t rings_failure_values[2];
+
+static uint32_t rings_random_state = 1;
+
+//-----------------------------------------------------------------------------
+static void rings_fail(const char *what, uint32_t expected, uint32_t actual)
+{
+  if (!rings_failed) {
+    rings_failure = what;
+    rings_failure_values[0] = expected;
+    rings_failure_values[1] = actual;
+    rings_failed = 1;
+  }
+}
+
+// Xorshift32, as loconet_tx_random. Only used by the interrupt thread
+// once it runs.
+static uint32_t rings_random(void)
+{
+  uint32_t x = rings_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rings_random_state = x;
+  return x;
+}
+
+//-----------------------------------------------------------------------------
+// Signal handler on the main thread: wait while the interrupt runs. An
+// interrupt while PRIMASK is set is refused, the next one comes soon.
+static void rings_irq_signal(int signal)
+{
+  (void) signal;
+  if (host_primask) {
+    rings_irq_stats.refused++;
+    return;
+  }
+  __atomic_store_n(&rings_irq_state, RINGS_IRQ_STOPPED, __ATOMIC_SEQ_CST);
+  sem_post(&rings_irq_request);
+  while (__atomic_load_n(&rings_irq_state, __ATOMIC_SEQ_CST) == RINGS_IRQ_STOPPED) {
+    sched_yield();
+  }
+}
+
+typedef struct {
+  const char *phase;
+  RINGS_HANDLER_Type handler;
+  volatile int done;        // Main loop returned
+} RINGS_THREAD_Type;
+
+// Run the handler for every interrupt taken, until the main loop returns
+static void *rings_irq_thread(void *argument)
+{
+  RINGS_THREAD_Type *thread = argument;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += RINGS_TIMEOUT;
+
+  while (!thread->done) {
+    struct timespec wait;
+    clock_gettime(CLOCK_REALTIME, &wait);
+    if (wait.tv_sec >= deadline.tv_sec) {
+      fprintf(stderr, "rings: %s: timeout, a ring hangs\n", thread->phase);
+      _exit(1);
+    }
+    wait.tv_nsec += 10000000;
+    if (wait.tv_nsec >= 1000000000) {
+      wait.tv_sec++;
+      wait.tv_nsec -= 1000000000;
+    }
+    if (sem_timedwait(&rings_irq_request, &wait)) {
+      continue;
+    }
+    thread->handler();
+    rings_irq_stats.taken++;
+    __atomic_store_n(&rings_irq_state, RINGS_IRQ_IDLE, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
+// Run the main loop on this thread with handler as the interrupt, until
+// the main loop returns
+static void rings_run(const char *phase, RINGS_HANDLER_Type handler, void (*main_loop)(void))
+{
+  RINGS_THREAD_Type thread = { phase, handler, 0 };
+  struct itimerval timer = { { 0, RINGS_IRQ_PERIOD }, { 0, RINGS_IRQ_PERIOD } };
+  struct itimerval stop = { { 0, 0 }, { 0, 0 } };
+  pthread_t irq_thread;
+
+  memset(&rings_irq_stats, 0, sizeof(rings_irq_stats));
+  // Interrupts go to the main thread, the interrupt thread starts with
+  // the timer signal blocked
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  if (pthread_create(&irq_thread, NULL, rings_irq_thread, &thread)) {
+    fprintf(stderr, "rings: %s: cannot start the interrupt thread\n", phase);
+    exit(1);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+  setitimer(ITIMER_REAL, &timer, NULL);
+  main_loop();
+  setitimer(ITIMER_REAL, &stop, NULL);
+  thread.done = 1;
+  pthread_join(irq_thread, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Time for loconet_timestamp, a byte per interrupt
+static void rings_tick(void)
+{
+  TC1->COUNT16.COUNT.reg += 10 * HOST_LINE_BIT_US;
+}
+
+//-----------------------------------------------------------------------------
+// TX: main loop and another interrupt commit, the sercom interrupt sends
+typedef struct {
+  uint32_t messages;                          // Messages of the main loop
+  uint32_t committed[RINGS_PRODUCER_Size];
+  uint32_t sent[RINGS_PRODUCER_Size];         // Seen on the line
+  uint32_t delivered[RINGS_PRODUCER_Size];    // Reported to the callback
+  uint32_t collided;
+  uint32_t exhausted;                         // Pool was empty in the interrupt
+  uint8_t frame[LOCONET_TX_MESSAGE_Size];     // Bytes of the current message
+  uint8_t length;
+} RINGS_TX_Type;
+
+static RINGS_TX_Type rings_tx;
+static volatile uint32_t rings_tx_irq_committed = 0;
+
+static void rings_tx_result(uint8_t result, void *context)
+{
+  uint8_t producer = (uint8_t)(uintptr_t)context;
+  if (result == LOCONET_TX_RESULT_DELIVERED) {
+    rings_tx.delivered[producer]++;
+  } else if (result != LOCONET_TX_RESULT_COLLIDED) {
+    rings_fail("tx: result", LOCONET_TX_RESULT_DELIVERED, result);
+  }
+}
+
+static uint8_t rings_tx_commit(uint8_t producer, uint32_t sequence)
+{
+  uint8_t *payload = loconet_tx_reserve(RINGS_TX_PAYLOAD);
+  if (!payload) {
+    return 0;
+  }
+  payload[0] = producer;
+  payload[1] = (sequence >> 14) & 0x7F;
+  payload[2] = (sequence >> 7) & 0x7F;
+  payload[3] = sequence & 0x7F;
+  loconet_tx_on_complete(payload, rings_tx_result, (void *)(uintptr_t)producer);
+  // One level per producer keeps its messages in order, aging included
+  if (loconet_tx_commit(payload, RINGS_OPCODE, producer) != STATUS_OK) {
+    rings_fail("tx: commit failed", STATUS_OK, 1);
+    return 0;
+  }
+  return 1;
+}
+
+// A message of the sercom interrupt was sent completely
+static void rings_tx_sent(void)
+{
+  uint8_t *frame = rings_tx.frame;
+  if (rings_tx.length != RINGS_TX_PAYLOAD + 3 || frame[0] != RINGS_OPCODE || frame[1] != rings_tx.length) {
+    rings_fail("tx: frame length", RINGS_TX_PAYLOAD + 3, rings_tx.length);
+    return;
+  }
+  if (loconet_calc_checksum(frame, rings_tx.length - 1) != frame[rings_tx.length - 1]) {
+    rings_fail("tx: checksum", loconet_calc_checksum(frame, rings_tx.length - 1), frame[rings_tx.length - 1]);
+    return;
+  }
+  uint8_t producer = frame[2];
+  uint32_t sequence = ((uint32_t)frame[3] << 14) | ((uint32_t)frame[4] << 7) | frame[5];
+  if (producer >= RINGS_PRODUCER_Size) {
+    rings_fail("tx: producer", RINGS_PRODUCER_Size, producer);
+  } else if (sequence != rings_tx.sent[producer]) {
+    // Lost, sent twice or out of order
+    rings_fail("tx: sequence", rings_tx.sent[producer], sequence);
+  } else {
+    rings_tx.sent[producer]++;
+  }
+}
+
+// The sercom interrupt and another interrupt
+static void rings_tx_irq(void)
+{
+  rings_tick();
+
+  if (loconet_status.bit.COLLISION_DETECTED) {
+    // End of the line break of a collision
+    loconet_status.bit.COLLISION_DETECTED = 0;
+  } else if (loconet_status.bit.TRANSMIT) {
+    loconet_status.bit.IDLE = 0;
+    if (!(rings_random() % 32)) {
+      // As loconet_irq_collision
+      loconet_status.bit.COLLISION_DETECTED = 1;
+      loconet_status.bit.TRANSMIT = 0;
+      loconet_tx_reset_current_message_to_queue();
+      rings_tx.length = 0;
+      rings_tx.collided++;
+    } else if (!loconet_tx_finished()) {
+      // DRE and RXC of the echo
+      uint8_t byte = loconet_tx_next_tx_byte();
+      uint8_t echo = loconet_tx_next_rx_byte();
+      if (byte != echo) {
+        rings_fail("tx: echo", byte, echo);
+      }
+      if (rings_tx.length < LOCONET_TX_MESSAGE_Size) {
+        rings_tx.frame[rings_tx.length++] = byte;
+      }
+    } else {
+      // TXC
+      loconet_tx_stop();
+      rings_tx_sent();
+      rings_tx.length = 0;
+    }
+  } else {
+    // Line quiet, the scheduler may start
+    loconet_status.reg |= LOCONET_STATUS_IDLE;
+  }
+
+  // Another interrupt handler sends a message
+  if (!(rings_random() % 8) && rings_tx_irq_committed < rings_tx.messages / 4) {
+    if (rings_tx_commit(RINGS_PRODUCER_IRQ, rings_tx_irq_committed)) {
+      rings_tx_irq_committed++;
+    } else {
+      rings_tx.exhausted++;
+    }
+  }
+}
+
+static void rings_tx_main(void)
+{
+  uint32_t committed = 0;
+
+  for (;;) {
+    if (committed < rings_tx.messages) {
+      committed += rings_tx_commit(RINGS_PRODUCER_MAIN, committed);
+    }
+    loconet_tx_process();
+
+    uint32_t irq_committed = rings_tx_irq_committed;
+    if (rings_failed || (committed == rings_tx.messages
+        && irq_committed == rings_tx.messages / 4
+        && rings_tx.delivered[RINGS_PRODUCER_MAIN] == committed
+        && rings_tx.delivered[RINGS_PRODUCER_IRQ] == irq_committed)) {
+      break;
+    }
+  }
+  rings_tx.committed[RINGS_PRODUCER_MAIN] = committed;
+  rings_tx.committed[RINGS_PRODUCER_IRQ] = rings_tx_irq_committed;
+}
+
+static void rings_tx_check(void)
+{
+  for (uint8_t producer = 0; producer < RINGS_PRODUCER_Size; producer++) {
+    if (rings_tx.sent[producer] != rings_tx.committed[producer]) {
+      rings_fail("tx: sent", rings_tx.committed[producer], rings_tx.sent[producer]);
+    }
+  }
+  if (!rings_tx.collided) {
+    rings_fail("tx: no collisions", 1, 0);
+  }
+  if (loconet_tx_stats.pool_used || loconet_tx_queue_size()) {
+    rings_fail("tx: messages left", 0, loconet_tx_stats.pool_used + loconet_tx_queue_size());
+  }
+}
+
+//-----------------------------------------------------------------------------
+// RX: the sercom interrupt receives messages, the main loop dispatches them
+typedef struct {
+  uint32_t messages;        // Messages to send
+  uint32_t sent;
+  uint32_t dispatched;
+  uint32_t next;            // Lowest sequence number expected next
+  uint8_t stalled;          // Main loop does not run until all are sent
+  uint8_t message[RINGS_RX_OVERSIZE];
+  uint8_t length;
+  uint8_t index;            // Next byte of message to receive
+} RINGS_RX_Type;
+
+static RINGS_RX_Type rings_rx;
+static volatile int rings_rx_sent = 0;
+
+// Message with sequence number and a pattern which follows from it
+static void rings_rx_build(uint32_t sequence, uint8_t length)
+{
+  uint8_t *message = rings_rx.message;
+  message[0] = RINGS_OPCODE;
+  message[1] = length;
+  message[2] = (sequence >> 14) & 0x7F;
+  message[3] = (sequence >> 7) & 0x7F;
+  message[4] = sequence & 0x7F;
+  for (uint8_t index = 5; index < length - 1; index++) {
+    message[index] = (sequence + index) & 0x7F;
+  }
+  message[length - 1] = loconet_calc_checksum(message, length - 1);
+  rings_rx.length = length;
+  rings_rx.index = 0;
+}
+
+// The sercom interrupt receives a few bytes back to back
+static void rings_rx_irq(void)
+{
+  if (rings_rx_sent) {
+    return;
+  }
+  for (uint8_t count = 1 + rings_random() % 8; count; count--) {
+    if (rings_rx.index == rings_rx.length) {
+      if (rings_rx.sent == rings_rx.messages) {
+        rings_rx_sent = 1;
+        return;
+      }
+      rings_rx_build(rings_rx.sent++, 6 + rings_random() % (RINGS_RX_LONGEST - 5));
+    }
+    rings_tick();
+    loconet_rx_buffer_push(rings_rx.message[rings_rx.index++]);
+  }
+}
+
+static void rings_rx_subscriber(uint8_t *message, uint8_t length, void *context)
+{
+  (void) context;
+  uint32_t sequence = ((uint32_t)message[2] << 14) | ((uint32_t)message[3] << 7) | message[4];
+
+  if (length != message[1] || length < 6) {
+    rings_fail("rx: length", message[1], length);
+    return;
+  }
+  if (sequence < rings_rx.next) {
+    // Dispatched twice or out of order
+    rings_fail("rx: sequence", rings_rx.next, sequence);
+    return;
+  }
+  for (uint8_t index = 5; index < length - 1; index++) {
+    if (message[index] != ((sequence + index) & 0x7F)) {
+      rings_fail("rx: data", (sequence + index) & 0x7F, message[index]);
+      return;
+    }
+  }
+  rings_rx.next = sequence + 1;
+  rings_rx.dispatched++;
+}
+
+static void rings_rx_main(void)
+{
+  // A stalled main loop waits for the interrupt to finish
+  while (rings_rx.stalled && !rings_rx_sent && !rings_failed) {
+    sched_yield();
+  }
+  for (;;) {
+    uint8_t sent = rings_rx_sent;
+    while (loconet_rx_process());
+    if (sent || rings_failed) {
+      break;
+    }
+    // Fall behind now and then
+    if (!(rand() % 16)) {
+      for (volatile uint32_t spin = rand() % 200000; spin; spin--);
+    }
+  }
+}
+
+static void rings_rx_check(void)
+{
+  uint32_t dropped = loconet_rx_stats.overflow + loconet_rx_stats.oversized;
+  if (rings_rx.dispatched + dropped != rings_rx.sent) {
+    rings_fail("rx: dispatched and dropped", rings_rx.sent, rings_rx.dispatched + dropped);
+  }
+  if (loconet_rx_stats.received != (uint16_t)rings_rx.dispatched) {
+    rings_fail("rx: received", (uint16_t)rings_rx.dispatched, loconet_rx_stats.received);
+  }
+  if (loconet_rx_stats.oversized || loconet_rx_stats.bad_checksum) {
+    rings_fail("rx: oversized or bad checksum", 0, loconet_rx_stats.oversized + loconet_rx_stats.bad_checksum);
+  }
+  if (!loconet_rx_stats.overflow) {
+    rings_fail("rx: the ring never overflowed", 1, 0);
+  }
+}
+
+static void rings_rx_phase(const char *phase, uint32_t messages, uint8_t stalled)
+{
+  memset(&rings_rx, 0, sizeof(rings_rx));
+  memset(&loconet_rx_stats, 0, sizeof(loconet_rx_stats));
+  rings_rx.messages = messages;
+  rings_rx.stalled = stalled;
+  rings_rx_sent = 0;
+
+  clock_t started = clock();
+  rings_run(phase, rings_rx_irq, rings_rx_main);
+  rings_rx_check();
+
+  printf("%-14s %6u sent, %6u dispatched, %5u overflow, high water %3u, %8lu irqs, %6lu refused, cpu %.3f s\n",
+    phase, rings_rx.sent, rings_rx.dispatched, loconet_rx_stats.overflow, loconet_rx_stats.high_water,
+    (unsigned long)rings_irq_stats.taken, (unsigned long)rings_irq_stats.refused,
+    (double)(clock() - started) / CLOCKS_PER_SEC);
+}
+
+// A message longer than the empty ring, one with a length byte of 2, then
+// a short one
+static void rings_rx_oversized(void)
+{
+  static const uint8_t bad_length[] = { 0xE5, 0x02, 0x18 };
+
+  memset(&rings_rx, 0, sizeof(rings_rx));
+  memset(&loconet_rx_stats, 0, sizeof(loconet_rx_stats));
+
+  while (loconet_rx_process());
+  rings_rx_build(0, RINGS_RX_OVERSIZE);
+  for (uint8_t index = 0; index < rings_rx.length; index++) {
+    loconet_rx_buffer_push(rings_rx.message[index]);
+  }
+  for (uint8_t index = 0; index < sizeof(bad_length); index++) {
+    loconet_rx_buffer_push(bad_length[index]);
+  }
+  rings_rx_build(1, 6);
+  for (uint8_t index = 0; index < rings_rx.length; index++) {
+    loconet_rx_buffer_push(rings_rx.message[index]);
+  }
+  while (loconet_rx_process());
+
+  if (loconet_rx_stats.oversized != 1 || loconet_rx_stats.overflow) {
+    rings_fail("rx: oversized", 1, loconet_rx_stats.oversized);
+  }
+  if (loconet_rx_stats.bad_length != 1) {
+    rings_fail("rx: bad length", 1, loconet_rx_stats.bad_length);
+  }
+  if (rings_rx.dispatched != 1 || rings_rx.next != 2) {
+    rings_fail("rx: after oversized", 1, rings_rx.dispatched);
+  }
+  printf("%-14s %6u sent, %6u dispatched, %5u oversized, %u bad length\n", "rx oversized", 3, rings_rx.dispatched,
+    loconet_rx_stats.oversized, loconet_rx_stats.bad_length);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  uint32_t messages = argc > 1 ? strtoul(argv[1], NULL, 0) : 4000;
+  rings_random_state = argc > 2 && strtoul(argv[2], NULL, 0) ? strtoul(argv[2], NULL, 0) : 1;
+  srand(rings_random_state);
+
+  sem_init(&rings_irq_request, 0, 0);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = rings_irq_signal;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &action, NULL);
+
+  loconet_config.bit.MASTER = 1;
+  loconet_config.bit.RETRY_LIMIT = 0;
+  loconet_config.bit.BACKOFF = 2;
+  loconet_init();
+  __enable_irq();
+
+  // TX
+  clock_t started = clock();
+  memset(&rings_tx, 0, sizeof(rings_tx));
+  rings_tx.messages = messages;
+  rings_run("tx", rings_tx_irq, rings_tx_main);
+  rings_tx_check();
+  printf("%-14s %6u + %u sent, %5u collided, %5u pool exhausted, %8lu irqs, %6lu refused, cpu %.3f s\n",
+    "tx", rings_tx.sent[RINGS_PRODUCER_MAIN], rings_tx.sent[RINGS_PRODUCER_IRQ], rings_tx.collided,
+    rings_tx.exhausted, (unsigned long)rings_irq_stats.taken, (unsigned long)rings_irq_stats.refused,
+    (double)(clock() - started) / CLOCKS_PER_SEC);
+
+  // RX
+  loconet_rx_subscribe(RINGS_OPCODE, 0, 0, rings_rx_subscriber, NULL);
+  if (!rings_failed) {
+    rings_rx_phase("rx stalled", messages / 8, 1);
+  }
+  if (!rings_failed) {
+    rings_rx_phase("rx flood", messages, 0);
+  }
+  if (!rings_failed) {
+    rings_rx_oversized();
+  }
+
+  if (rings_failed) {
+    printf("FAILED %s: expected %u, got %u\n", rings_failure, rings_failure_values[0], rings_failure_values[1]);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
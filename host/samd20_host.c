@@ -0,0 +1,1116 @@
+/**
+ * @file samd20_host.c
+ * @brief Software model of the SAMD20 peripherals for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "samd20_host.h"
+
+#if !defined(__linux__) || !defined(__x86_64__)
+#error "The host build single steps writes to registers, only on x86-64 Linux"
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+//-----------------------------------------------------------------------------
+// Registers, read-only for the code and writable for the model. Both views
+// map the same memory.
+HOST_PERIPHERALS_Type *host_peripherals = NULL;
+static HOST_PERIPHERALS_Type *host_regs = NULL;
+static size_t host_regs_size = 0;
+
+uint32_t host_serial_number[4] = { 0x4C4F434F, 0x4E455448, 0x4F535453, 0x414D4432 };
+
+uintptr_t host_flash_addr = 0;
+
+volatile uint32_t host_primask = 0;
+
+HOST_STATS_Type host_stats = { { 0 }, 0, 0, 0 };
+
+static uint64_t host_now = 0;
+
+// Register reg of type contains offset
+#define HOST_REGISTER(type, reg, offset) \
+  ((uint32_t)(offset) - offsetof(type, reg) < sizeof(((type *)0)->reg))
+
+//-----------------------------------------------------------------------------
+// Interrupt handlers, unused ones are not linked in
+extern void irq_handler_eic(void) __attribute__((weak));
+extern void irq_handler_sercom0(void) __attribute__((weak));
+extern void irq_handler_sercom1(void) __attribute__((weak));
+extern void irq_handler_sercom2(void) __attribute__((weak));
+extern void irq_handler_sercom3(void) __attribute__((weak));
+extern void irq_handler_sercom4(void) __attribute__((weak));
+extern void irq_handler_sercom5(void) __attribute__((weak));
+extern void irq_handler_tc0(void) __attribute__((weak));
+extern void irq_handler_tc1(void) __attribute__((weak));
+extern void irq_handler_tc2(void) __attribute__((weak));
+extern void irq_handler_tc3(void) __attribute__((weak));
+extern void irq_handler_tc4(void) __attribute__((weak));
+extern void irq_handler_tc5(void) __attribute__((weak));
+extern void irq_handler_tc6(void) __attribute__((weak));
+extern void irq_handler_tc7(void) __attribute__((weak));
+
+static void (*const host_vectors[PERIPH_COUNT_IRQn])(void) = {
+  [EIC_IRQn] = irq_handler_eic,
+  [SERCOM0_IRQn] = irq_handler_sercom0,
+  [SERCOM1_IRQn] = irq_handler_sercom1,
+  [SERCOM2_IRQn] = irq_handler_sercom2,
+  [SERCOM3_IRQn] = irq_handler_sercom3,
+  [SERCOM4_IRQn] = irq_handler_sercom4,
+  [SERCOM5_IRQn] = irq_handler_sercom5,
+  [TC0_IRQn] = irq_handler_tc0,
+  [TC1_IRQn] = irq_handler_tc1,
+  [TC2_IRQn] = irq_handler_tc2,
+  [TC3_IRQn] = irq_handler_tc3,
+  [TC4_IRQn] = irq_handler_tc4,
+  [TC5_IRQn] = irq_handler_tc5,
+  [TC6_IRQn] = irq_handler_tc6,
+  [TC7_IRQn] = irq_handler_tc7,
+};
+
+//-----------------------------------------------------------------------------
+// Asynchronous frame: start bit, 8 data bits LSB first, stop bit
+#define HOST_UART_FRAME_BITS 10
+#define HOST_UART_HUNT 0xFF
+
+typedef struct {
+  uint16_t frame;
+  uint8_t bit;        // Bit on the line, HOST_UART_FRAME_BITS if idle
+  uint8_t elapsed;    // Microseconds into the bit
+  uint8_t bit_us;
+} HOST_UART_TX_Type;
+
+typedef struct {
+  uint16_t frame;
+  uint8_t bit;        // Next bit to sample, HOST_UART_HUNT for a start bit
+  uint8_t level;      // Line level in the previous microsecond
+  uint16_t elapsed;   // Microseconds since the start flank
+  uint16_t sample;    // Time of the next sample, in the middle of the bit
+  uint8_t bit_us;
+} HOST_UART_RX_Type;
+
+//-----------------------------------------------------------------------------
+static void host_uart_tx_reset(HOST_UART_TX_Type *tx)
+{
+  tx->bit = HOST_UART_FRAME_BITS;
+}
+
+static void host_uart_tx_start(HOST_UART_TX_Type *tx, uint8_t data, uint8_t bit_us)
+{
+  tx->frame = ((uint16_t)data << 1) | (0x01u << (HOST_UART_FRAME_BITS - 1));
+  tx->bit = 0;
+  tx->elapsed = 0;
+  tx->bit_us = bit_us;
+}
+
+static uint8_t host_uart_tx_idle(const HOST_UART_TX_Type *tx)
+{
+  return tx->bit >= HOST_UART_FRAME_BITS;
+}
+
+static uint8_t host_uart_tx_level(const HOST_UART_TX_Type *tx)
+{
+  return host_uart_tx_idle(tx) || ((tx->frame >> tx->bit) & 0x01);
+}
+
+// Returns 1 at the end of the stop bit
+static uint8_t host_uart_tx_tick(HOST_UART_TX_Type *tx)
+{
+  if (host_uart_tx_idle(tx) || ++tx->elapsed < tx->bit_us) {
+    return 0;
+  }
+  tx->elapsed = 0;
+  return ++tx->bit == HOST_UART_FRAME_BITS;
+}
+
+//-----------------------------------------------------------------------------
+static void host_uart_rx_reset(HOST_UART_RX_Type *rx, uint8_t level)
+{
+  rx->bit = HOST_UART_HUNT;
+  rx->level = level;
+}
+
+// Returns 1 with the byte in data after sampling the stop bit
+static uint8_t host_uart_rx_tick(HOST_UART_RX_Type *rx, uint8_t level, uint8_t *data, uint8_t *framing_error)
+{
+  uint8_t previous = rx->level;
+  rx->level = level;
+
+  if (rx->bit == HOST_UART_HUNT) {
+    // Wait for the flank of a start bit
+    if (previous && !level) {
+      rx->bit = 0;
+      rx->frame = 0;
+      rx->elapsed = 0;
+      rx->sample = rx->bit_us / 2;
+    }
+    return 0;
+  }
+
+  if (++rx->elapsed < rx->sample) {
+    return 0;
+  }
+  rx->sample += rx->bit_us;
+  rx->frame |= (uint16_t)level << rx->bit;
+  if (rx->bit == 0 && level) {
+    // Spike, not a start bit
+    rx->bit = HOST_UART_HUNT;
+    return 0;
+  }
+  if (++rx->bit < HOST_UART_FRAME_BITS) {
+    return 0;
+  }
+  rx->bit = HOST_UART_HUNT;
+  *data = rx->frame >> 1;
+  *framing_error = !level;
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t host_reverse(uint8_t data)
+{
+  data = (data & 0xF0) >> 4 | (data & 0x0F) << 4;
+  data = (data & 0xCC) >> 2 | (data & 0x33) << 2;
+  return (data & 0xAA) >> 1 | (data & 0x55) << 1;
+}
+
+//-----------------------------------------------------------------------------
+// NVIC
+static uint32_t host_nvic_enabled = 0;
+static uint32_t host_nvic_pending = 0;
+
+void host_nvic_enable(int32_t irqn)
+{
+  if (irqn >= 0) {
+    host_nvic_enabled |= 0x01ul << irqn;
+  }
+}
+
+void host_nvic_disable(int32_t irqn)
+{
+  if (irqn >= 0) {
+    host_nvic_enabled &= ~(0x01ul << irqn);
+  }
+}
+
+void host_nvic_set_pending(int32_t irqn)
+{
+  if (irqn >= 0) {
+    host_nvic_pending |= 0x01ul << irqn;
+  }
+}
+
+void host_nvic_clear_pending(int32_t irqn)
+{
+  if (irqn >= 0) {
+    host_nvic_pending &= ~(0x01ul << irqn);
+  }
+}
+
+uint32_t host_nvic_get_pending(int32_t irqn)
+{
+  return irqn >= 0 && (host_nvic_pending & (0x01ul << irqn));
+}
+
+//-----------------------------------------------------------------------------
+// Loconet line and the peer on it
+typedef struct {
+  uint8_t data[HOST_LINE_MESSAGE_Size];
+  uint8_t length;
+} HOST_LINE_MESSAGE_Type;
+
+typedef struct {
+  int8_t sercom;            // Attached SERCOM, -1 if none
+  uint8_t group;
+  uint32_t tx_pin;
+  uint32_t in_pins;
+  uint8_t level;
+  const uint8_t *bus;       // Level of a shared line, 0 if none
+  uint64_t high_since;
+  uint64_t break_until;
+  HOST_LINE_MONITOR_Type monitor;
+  HOST_UART_RX_Type monitor_rx;
+  HOST_UART_TX_Type peer_tx;
+  HOST_LINE_MESSAGE_Type queue[HOST_LINE_QUEUE_Size];
+  uint8_t head;
+  uint8_t tail;
+  uint8_t index;            // Next byte of the message at the head
+} HOST_LINE_Type;
+
+static HOST_LINE_Type host_line;
+
+//-----------------------------------------------------------------------------
+// PORT, the SET, CLR and TGL registers read DIR and OUT. Pins on the line
+// read the line, others read their OUT bit, as an output or an input with
+// the pull resistor enabled.
+static uint32_t host_port_in(uint8_t group)
+{
+  uint32_t in = host_regs->port.Group[group].OUT.reg;
+  if (host_line.sercom >= 0 && host_line.group == group) {
+    in = host_line.level ? in | host_line.in_pins : in & ~host_line.in_pins;
+  }
+  return in;
+}
+
+static void host_port_write(uint8_t group, uint32_t offset)
+{
+  PortGroup *regs = &host_regs->port.Group[group];
+
+  if (HOST_REGISTER(PortGroup, DIRCLR, offset)) {
+    regs->DIR.reg &= ~regs->DIRCLR.reg;
+  } else if (HOST_REGISTER(PortGroup, DIRSET, offset)) {
+    regs->DIR.reg |= regs->DIRSET.reg;
+  } else if (HOST_REGISTER(PortGroup, DIRTGL, offset)) {
+    regs->DIR.reg ^= regs->DIRTGL.reg;
+  } else if (HOST_REGISTER(PortGroup, OUTCLR, offset)) {
+    regs->OUT.reg &= ~regs->OUTCLR.reg;
+  } else if (HOST_REGISTER(PortGroup, OUTSET, offset)) {
+    regs->OUT.reg |= regs->OUTSET.reg;
+  } else if (HOST_REGISTER(PortGroup, OUTTGL, offset)) {
+    regs->OUT.reg ^= regs->OUTTGL.reg;
+  }
+}
+
+static void host_port_present(void)
+{
+  for (uint8_t group = 0; group < 2; group++) {
+    PortGroup *regs = &host_regs->port.Group[group];
+    regs->DIRCLR.reg = regs->DIRSET.reg = regs->DIRTGL.reg = regs->DIR.reg;
+    regs->OUTCLR.reg = regs->OUTSET.reg = regs->OUTTGL.reg = regs->OUT.reg;
+    regs->IN.reg = host_port_in(group);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// TC, COUNT16 mode
+typedef struct {
+  uint16_t count;
+  uint8_t flags;
+  uint8_t inten;
+} HOST_TC_Type;
+
+static HOST_TC_Type host_tcs[TC_INST_NUM];
+
+static void host_tc_tick(uint8_t index)
+{
+  TcCount16 *regs = &host_regs->tc[index].COUNT16;
+  HOST_TC_Type *tc = &host_tcs[index];
+
+  if (!regs->CTRLA.bit.ENABLE || regs->CTRLA.bit.MODE != TC_CTRLA_MODE_COUNT16_Val) {
+    return;
+  }
+  uint16_t top = regs->CTRLA.bit.WAVEGEN == TC_CTRLA_WAVEGEN_MFRQ_Val ? regs->CC[0].reg : 0xFFFF;
+  if (tc->count == top) {
+    tc->count = 0;
+    tc->flags |= TC_INTFLAG_OVF;
+  } else {
+    tc->count++;
+  }
+  if (tc->count == regs->CC[0].reg) {
+    tc->flags |= TC_INTFLAG_MC(1);
+  }
+  if (tc->count == regs->CC[1].reg) {
+    tc->flags |= TC_INTFLAG_MC(2);
+  }
+}
+
+// Event of the event system
+static void host_tc_event(uint8_t index)
+{
+  TcCount16 *regs = &host_regs->tc[index].COUNT16;
+  if (regs->EVCTRL.bit.TCEI && regs->EVCTRL.bit.EVACT == TC_EVCTRL_EVACT_RETRIGGER_Val) {
+    host_tcs[index].count = 0;
+  }
+}
+
+static void host_tc_write(uint8_t index, uint32_t offset)
+{
+  TcCount16 *regs = &host_regs->tc[index].COUNT16;
+  HOST_TC_Type *tc = &host_tcs[index];
+
+  if (HOST_REGISTER(TcCount16, COUNT, offset)) {
+    tc->count = regs->COUNT.reg;
+  } else if (HOST_REGISTER(TcCount16, INTFLAG, offset)) {
+    tc->flags &= ~regs->INTFLAG.reg;
+  } else if (HOST_REGISTER(TcCount16, INTENCLR, offset)) {
+    tc->inten &= ~regs->INTENCLR.reg;
+  } else if (HOST_REGISTER(TcCount16, INTENSET, offset)) {
+    tc->inten |= regs->INTENSET.reg;
+  }
+}
+
+static void host_tc_present(uint8_t index)
+{
+  TcCount16 *regs = &host_regs->tc[index].COUNT16;
+  HOST_TC_Type *tc = &host_tcs[index];
+
+  regs->COUNT.reg = tc->count;
+  regs->INTFLAG.reg = tc->flags;
+  regs->INTENCLR.reg = regs->INTENSET.reg = tc->inten;
+}
+
+//-----------------------------------------------------------------------------
+// SERCOM, USART mode
+typedef struct {
+  uint8_t flags;            // TXC and RXS, RXC and DRE follow the buffers
+  uint8_t inten;
+  uint8_t rx_full;
+  uint8_t rx_data;
+  uint16_t rx_status;       // Status of the byte in rx_data
+  uint8_t tx_full;
+  uint8_t tx_data;
+  uint16_t baud;
+  uint8_t bit_us;
+  HOST_UART_TX_Type tx;
+  HOST_UART_RX_Type rx;
+} HOST_SERCOM_Type;
+
+static HOST_SERCOM_Type host_sercoms[SERCOM_INST_NUM];
+
+static uint8_t host_sercom_enabled(uint8_t index)
+{
+  SercomUsart *regs = &host_regs->sercom[index].USART;
+  return regs->CTRLA.bit.ENABLE && regs->CTRLA.bit.MODE == SERCOM_USART_CTRLA_MODE_USART_INT_CLK_Val;
+}
+
+static uint8_t host_sercom_flags(uint8_t index)
+{
+  HOST_SERCOM_Type *sercom = &host_sercoms[index];
+  return sercom->flags
+    | (sercom->rx_full ? SERCOM_USART_INTFLAG_RXC : 0)
+    | (sercom->tx_full ? 0 : SERCOM_USART_INTFLAG_DRE);
+}
+
+// Bit time of the arithmetic baud rate generator with 16x oversampling
+static uint8_t host_sercom_bit_us(uint16_t baud)
+{
+  uint64_t clocks = (uint64_t)F_CPU * (65536 - baud);
+  uint64_t bit_us = (16ull * 65536 * 1000000 + clocks / 2) / clocks;
+  return bit_us > 255 ? 255 : bit_us ? bit_us : 1;
+}
+
+static void host_sercom_tick(uint8_t index, uint8_t level)
+{
+  SercomUsart *regs = &host_regs->sercom[index].USART;
+  HOST_SERCOM_Type *sercom = &host_sercoms[index];
+  uint8_t data, framing_error;
+
+  if (!host_sercom_enabled(index)) {
+    return;
+  }
+  if (regs->BAUD.reg != sercom->baud || !sercom->bit_us) {
+    sercom->baud = regs->BAUD.reg;
+    sercom->bit_us = host_sercom_bit_us(sercom->baud);
+    sercom->rx.bit_us = sercom->bit_us;
+  }
+
+  // Transmitter, the next byte follows the stop bit directly
+  if (!regs->CTRLB.bit.TXEN) {
+    host_uart_tx_reset(&sercom->tx);
+    sercom->tx_full = 0;
+  } else {
+    if (host_uart_tx_tick(&sercom->tx) && !sercom->tx_full) {
+      sercom->flags |= SERCOM_USART_INTFLAG_TXC;
+    }
+    if (host_uart_tx_idle(&sercom->tx) && sercom->tx_full) {
+      uint8_t data = regs->CTRLA.bit.DORD ? sercom->tx_data : host_reverse(sercom->tx_data);
+      host_uart_tx_start(&sercom->tx, data, sercom->bit_us);
+      sercom->tx_full = 0;
+    }
+  }
+
+  // Receiver, disabling it flushes the buffer
+  if (!regs->CTRLB.bit.RXEN) {
+    host_uart_rx_reset(&sercom->rx, level);
+    sercom->rx_full = 0;
+  } else if (host_uart_rx_tick(&sercom->rx, level, &data, &framing_error)) {
+    sercom->rx_status = (sercom->rx_full ? SERCOM_USART_STATUS_BUFOVF : 0)
+      | (framing_error ? SERCOM_USART_STATUS_FERR : 0);
+    sercom->rx_data = regs->CTRLA.bit.DORD ? data : host_reverse(data);
+    sercom->rx_full = 1;
+  }
+}
+
+// A write to DATA while DRE is clear is lost, as on the device
+static void host_sercom_write(uint8_t index, uint32_t offset)
+{
+  SercomUsart *regs = &host_regs->sercom[index].USART;
+  HOST_SERCOM_Type *sercom = &host_sercoms[index];
+
+  if (HOST_REGISTER(SercomUsart, INTFLAG, offset)) {
+    sercom->flags &= ~(regs->INTFLAG.reg & (SERCOM_USART_INTFLAG_TXC | SERCOM_USART_INTFLAG_RXS));
+  } else if (HOST_REGISTER(SercomUsart, STATUS, offset)) {
+    sercom->rx_status &= ~(regs->STATUS.reg & SERCOM_USART_STATUS_MASK);
+  } else if (HOST_REGISTER(SercomUsart, DATA, offset)) {
+    if (!sercom->tx_full) {
+      sercom->tx_data = regs->DATA.reg;
+      sercom->tx_full = 1;
+    }
+  } else if (HOST_REGISTER(SercomUsart, INTENCLR, offset)) {
+    sercom->inten &= ~regs->INTENCLR.reg;
+  } else if (HOST_REGISTER(SercomUsart, INTENSET, offset)) {
+    sercom->inten |= regs->INTENSET.reg;
+  }
+}
+
+static void host_sercom_present(uint8_t index)
+{
+  SercomUsart *regs = &host_regs->sercom[index].USART;
+  HOST_SERCOM_Type *sercom = &host_sercoms[index];
+
+  regs->INTFLAG.reg = host_sercom_flags(index);
+  regs->STATUS.reg = sercom->rx_status;
+  regs->DATA.reg = sercom->rx_data;
+  regs->INTENCLR.reg = regs->INTENSET.reg = sercom->inten;
+}
+
+//-----------------------------------------------------------------------------
+// EIC, the pin of EXTINT n is a pin n or n + 16 with peripheral function A
+#define HOST_EIC_LINES 16
+#define HOST_EIC_NO_PIN 0xFF
+
+typedef struct {
+  uint32_t flags;
+  uint32_t inten;
+  uint32_t watch;           // Lines with a sense configuration
+  uint8_t pin[HOST_EIC_LINES];
+  uint8_t level[HOST_EIC_LINES];
+} HOST_EIC_Type;
+
+static HOST_EIC_Type host_eic;
+
+static uint8_t host_pin_level(uint8_t pin)
+{
+  return (host_port_in(pin / 32) >> (pin % 32)) & 0x01;
+}
+
+static uint8_t host_eic_sense(uint8_t line)
+{
+  return (host_regs->eic.CONFIG[line / 8].reg >> (4 * (line % 8))) & EIC_CONFIG_SENSE0_Msk;
+}
+
+// Follow changes in the configuration of the EIC and the pins
+static void host_eic_update_pins(void)
+{
+  uint32_t watch = 0;
+  for (uint8_t line = 0; line < HOST_EIC_LINES; line++) {
+    host_eic.pin[line] = HOST_EIC_NO_PIN;
+    if (host_eic_sense(line) != EIC_CONFIG_SENSE0_NONE_Val) {
+      watch |= 0x01ul << line;
+    }
+  }
+  for (uint8_t pin = 0; watch && pin < 64; pin++) {
+    PortGroup *group = &host_regs->port.Group[pin / 32];
+    uint8_t pmux = group->PMUX[(pin % 32) >> 1].reg;
+    uint8_t function = pin & 0x01 ? pmux >> PORT_PMUX_PMUXO_Pos : pmux & PORT_PMUX_PMUXE_Msk;
+    uint8_t line = pin % HOST_EIC_LINES;
+    if ((watch & (0x01ul << line)) && group->PINCFG[pin % 32].bit.PMUXEN && function == PORT_PMUX_PMUXE_A_Val) {
+      host_eic.pin[line] = pin;
+    }
+  }
+  // Start from the current level on lines that were not watched
+  for (uint8_t line = 0; line < HOST_EIC_LINES; line++) {
+    uint32_t mask = 0x01ul << line;
+    if ((watch & mask) && !(host_eic.watch & mask) && host_eic.pin[line] != HOST_EIC_NO_PIN) {
+      host_eic.level[line] = host_pin_level(host_eic.pin[line]);
+    }
+  }
+  host_eic.watch = watch;
+}
+
+static void host_event(uint8_t generator);
+
+static void host_eic_tick(void)
+{
+  if (!host_regs->eic.CTRL.bit.ENABLE) {
+    return;
+  }
+  for (uint32_t watch = host_eic.watch; watch; watch &= watch - 1) {
+    uint8_t line = __builtin_ctz(watch);
+    if (host_eic.pin[line] == HOST_EIC_NO_PIN) {
+      continue;
+    }
+    uint8_t level = host_pin_level(host_eic.pin[line]);
+    uint8_t previous = host_eic.level[line];
+    uint8_t detect = 0;
+    host_eic.level[line] = level;
+    switch (host_eic_sense(line)) {
+      case EIC_CONFIG_SENSE0_RISE_Val: detect = !previous && level; break;
+      case EIC_CONFIG_SENSE0_FALL_Val: detect = previous && !level; break;
+      case EIC_CONFIG_SENSE0_BOTH_Val: detect = previous != level; break;
+      case EIC_CONFIG_SENSE0_HIGH_Val: detect = level; break;
+      case EIC_CONFIG_SENSE0_LOW_Val:  detect = !level; break;
+    }
+    if (detect) {
+      host_eic.flags |= 0x01ul << line;
+      if (host_regs->eic.EVCTRL.reg & (0x01ul << line)) {
+        host_event(EVSYS_ID_GEN_EIC_EXTINT_0 + line);
+      }
+    }
+  }
+}
+
+static void host_eic_write(uint32_t offset)
+{
+  Eic *regs = &host_regs->eic;
+
+  if (HOST_REGISTER(Eic, INTFLAG, offset)) {
+    host_eic.flags &= ~regs->INTFLAG.reg;
+  } else if (HOST_REGISTER(Eic, INTENCLR, offset)) {
+    host_eic.inten &= ~regs->INTENCLR.reg;
+  } else if (HOST_REGISTER(Eic, INTENSET, offset)) {
+    host_eic.inten |= regs->INTENSET.reg;
+  }
+}
+
+static void host_eic_present(void)
+{
+  Eic *regs = &host_regs->eic;
+
+  regs->INTFLAG.reg = host_eic.flags;
+  regs->INTENCLR.reg = regs->INTENSET.reg = host_eic.inten;
+}
+
+//-----------------------------------------------------------------------------
+// EVSYS, asynchronous paths from generators to users
+#define HOST_EVSYS_CHANNELS 8
+#define HOST_EVSYS_USERS 32
+
+static uint8_t host_evsys_generator[HOST_EVSYS_CHANNELS];
+static uint8_t host_evsys_user[HOST_EVSYS_USERS];  // Channel + 1, 0 if none
+
+static void host_event(uint8_t generator)
+{
+  for (uint8_t channel = 0; channel < HOST_EVSYS_CHANNELS; channel++) {
+    if (host_evsys_generator[channel] != generator) {
+      continue;
+    }
+    for (uint8_t user = EVSYS_ID_USER_TC0_EVU; user <= EVSYS_ID_USER_TC7_EVU; user++) {
+      if (host_evsys_user[user] == channel + 1) {
+        host_tc_event(user - EVSYS_ID_USER_TC0_EVU);
+      }
+    }
+  }
+}
+
+static void host_evsys_write(uint32_t offset)
+{
+  Evsys *regs = &host_regs->evsys;
+
+  if (HOST_REGISTER(Evsys, USER, offset)) {
+    host_evsys_user[regs->USER.bit.USER % HOST_EVSYS_USERS] = regs->USER.bit.CHANNEL;
+  } else if (HOST_REGISTER(Evsys, CHANNEL, offset)) {
+    host_evsys_generator[regs->CHANNEL.bit.CHANNEL] = regs->CHANNEL.bit.EVGEN;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// NVMCTRL, commands complete at once. Page writes land in the image, so
+// only the row erase needs work.
+static void host_nvmctrl_write(uint32_t offset)
+{
+  Nvmctrl *regs = &host_regs->nvmctrl;
+  uint32_t ctrla = regs->CTRLA.reg;
+
+  if (HOST_REGISTER(Nvmctrl, STATUS, offset)) {
+    // Written ones clear the error flags, the security bit stays
+    regs->STATUS.reg = 0;
+  } else if (HOST_REGISTER(Nvmctrl, CTRLA, offset)
+      && (ctrla & NVMCTRL_CTRLA_CMDEX_Msk) == NVMCTRL_CTRLA_CMDEX_KEY) {
+    // ADDR holds the address in 16-bit words
+    uint32_t address = (regs->ADDR.reg * 2) & ~(NVMCTRL_ROW_SIZE - 1ul);
+    regs->CTRLA.reg = 0;
+    if ((ctrla & NVMCTRL_CTRLA_CMD_Msk) == NVMCTRL_CTRLA_CMD_ER) {
+      if (address >= HOST_FLASH_ADDR && address < HOST_FLASH_ADDR + HOST_FLASH_SIZE) {
+        memset((void *)(uintptr_t)address, 0xFF, NVMCTRL_ROW_SIZE);
+      } else {
+        regs->STATUS.reg |= NVMCTRL_STATUS_PROGE;
+      }
+    }
+  }
+}
+
+// Map size bytes at address, returns 0 if something is mapped there
+static uint8_t host_map_fixed(uintptr_t address, size_t size)
+{
+  void *mapped = mmap((void *)address, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (mapped == (void *)address) {
+    return 1;
+  }
+  // Kernels without MAP_FIXED_NOREPLACE take the address as a hint
+  if (mapped != MAP_FAILED) {
+    munmap(mapped, size);
+  }
+  return 0;
+}
+
+// Erased flash and a user row for an EEPROM of 2048 bytes (fuse value 3).
+// The image takes the first free slot from HOST_FLASH_BASE, so models
+// loaded more than once (host/bus) each get their own. The first model
+// maps the user row, the others share it.
+static void host_nvmctrl_init(void)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t slot = (HOST_FLASH_SIZE + page - 1) & ~(page - 1);
+
+  if (host_map_fixed(HOST_USER_ROW, NVMCTRL_ROW_SIZE)) {
+    memset((void *)HOST_USER_ROW, 0xFF, NVMCTRL_ROW_SIZE);
+    *(volatile uint32_t *)NVMCTRL_USER = (uint32_t)~NVMCTRL_FUSES_EEPROM_SIZE_Msk | NVMCTRL_FUSES_EEPROM_SIZE(3);
+  }
+
+  host_flash_addr = 0;
+  for (uintptr_t address = HOST_FLASH_BASE; address + slot <= HOST_FLASH_LIMIT; address += slot) {
+    if (host_map_fixed(address, HOST_FLASH_SIZE)) {
+      host_flash_addr = address;
+      break;
+    }
+  }
+  if (!host_flash_addr) {
+    fprintf(stderr, "host: no free slot for the flash image below 0x%08lx\n", (unsigned long)HOST_FLASH_LIMIT);
+    exit(1);
+  }
+  memset((void *)HOST_FLASH_ADDR, 0xFF, HOST_FLASH_SIZE);
+
+  host_regs->nvmctrl.PARAM.reg =
+    NVMCTRL_PARAM_PSZ(3)
+    | NVMCTRL_PARAM_NVMP((HOST_FLASH_ADDR + HOST_FLASH_SIZE) / FLASH_PAGE_SIZE);
+  host_regs->nvmctrl.INTFLAG.reg = NVMCTRL_INTFLAG_READY;
+}
+
+//-----------------------------------------------------------------------------
+uint8_t host_line_drive(void)
+{
+  if (host_now < host_line.break_until || !host_uart_tx_level(&host_line.peer_tx)) {
+    return 0;
+  }
+  if (host_line.sercom >= 0) {
+    if (!host_uart_tx_level(&host_sercoms[host_line.sercom].tx)
+        || (host_regs->port.Group[host_line.group].OUT.reg & host_line.tx_pin)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void host_line_tick(void)
+{
+  uint8_t level = host_line.bus ? *host_line.bus : host_line_drive();
+  uint8_t data, framing_error;
+
+  if (level != host_line.level) {
+    if (level) {
+      host_line.high_since = host_now;
+    } else {
+      host_stats.line_low++;
+    }
+    host_line.level = level;
+  }
+
+  if (host_line.monitor && host_uart_rx_tick(&host_line.monitor_rx, level, &data, &framing_error)) {
+    host_line.monitor(data, framing_error);
+  }
+
+  // Peer: the bytes of a message back to back, after a quiet line. On a
+  // collision it stops and sends the message again.
+  HOST_UART_TX_Type *tx = &host_line.peer_tx;
+  if (host_uart_tx_level(tx) && !level && (host_line.index || !host_uart_tx_idle(tx))) {
+    host_uart_tx_reset(tx);
+    host_line.index = 0;
+    host_stats.peer_collision++;
+    return;
+  }
+  host_uart_tx_tick(tx);
+  if (!host_uart_tx_idle(tx) || host_line.head == host_line.tail) {
+    return;
+  }
+  HOST_LINE_MESSAGE_Type *message = &host_line.queue[host_line.head];
+  if (host_line.index == message->length) {
+    host_line.head = (host_line.head + 1) % HOST_LINE_QUEUE_Size;
+    host_line.index = 0;
+  } else if (host_line.index || (level && host_now - host_line.high_since >= HOST_LINE_PEER_GAP)) {
+    host_uart_tx_start(tx, message->data[host_line.index++], HOST_LINE_BIT_US);
+  }
+}
+
+void host_line_attach(Sercom *sercom, PortGroup *group, uint8_t tx_pin, uint32_t in_pins)
+{
+  host_line.sercom = sercom - host_peripherals->sercom;
+  host_line.group = group - host_peripherals->port.Group;
+  host_line.tx_pin = 0x01ul << tx_pin;
+  host_line.in_pins = in_pins;
+}
+
+void host_line_connect(const uint8_t *bus)
+{
+  host_line.bus = bus;
+}
+
+uint8_t host_line_send(const uint8_t *data, uint8_t length)
+{
+  uint8_t tail = (host_line.tail + 1) % HOST_LINE_QUEUE_Size;
+  if (tail == host_line.head || length > HOST_LINE_MESSAGE_Size) {
+    return 0;
+  }
+  memcpy(host_line.queue[host_line.tail].data, data, length);
+  host_line.queue[host_line.tail].length = length;
+  host_line.tail = tail;
+  return 1;
+}
+
+void host_line_break(uint32_t us)
+{
+  host_line.break_until = host_now + us;
+}
+
+void host_line_monitor(HOST_LINE_MONITOR_Type monitor)
+{
+  host_line.monitor = monitor;
+}
+
+uint8_t host_line_level(void)
+{
+  return host_line.level;
+}
+
+//-----------------------------------------------------------------------------
+// Registers as the code should see them
+static void host_present(void)
+{
+  for (uint8_t index = 0; index < TC_INST_NUM; index++) {
+    host_tc_present(index);
+  }
+  for (uint8_t index = 0; index < SERCOM_INST_NUM; index++) {
+    host_sercom_present(index);
+  }
+  host_eic_present();
+  host_port_present();
+}
+
+// Apply a write of the code at offset in the peripherals
+static void host_write(uint32_t offset)
+{
+  uint32_t start;
+
+  if (HOST_REGISTER(HOST_PERIPHERALS_Type, eic, offset)) {
+    host_eic_write(offset - offsetof(HOST_PERIPHERALS_Type, eic));
+  } else if (HOST_REGISTER(HOST_PERIPHERALS_Type, evsys, offset)) {
+    host_evsys_write(offset - offsetof(HOST_PERIPHERALS_Type, evsys));
+  } else if (HOST_REGISTER(HOST_PERIPHERALS_Type, nvmctrl, offset)) {
+    host_nvmctrl_write(offset - offsetof(HOST_PERIPHERALS_Type, nvmctrl));
+  } else if (HOST_REGISTER(HOST_PERIPHERALS_Type, port, offset)) {
+    start = offset - offsetof(HOST_PERIPHERALS_Type, port);
+    host_port_write(start / sizeof(PortGroup), start % sizeof(PortGroup));
+  } else if (HOST_REGISTER(HOST_PERIPHERALS_Type, sercom, offset)) {
+    start = offset - offsetof(HOST_PERIPHERALS_Type, sercom);
+    host_sercom_write(start / sizeof(Sercom), start % sizeof(Sercom));
+  } else if (HOST_REGISTER(HOST_PERIPHERALS_Type, tc, offset)) {
+    start = offset - offsetof(HOST_PERIPHERALS_Type, tc);
+    host_tc_write(start / sizeof(Tc), start % sizeof(Tc));
+  }
+  // Pins and sense configuration of the EIC may have changed
+  host_eic_update_pins();
+  host_present();
+}
+
+//-----------------------------------------------------------------------------
+// A write to a register faults. The registers are made writable for one
+// instruction, after which the model applies the write.
+// Signals that are not for this model go to the handler installed before
+// it, which is another copy of the model in host/bus.
+// While counting, every instruction traps. The handlers run with the trap
+// flag cleared, so the model itself is not counted.
+#define HOST_EFLAGS_TF 0x100
+
+#define HOST_COUNT_OFF      0
+#define HOST_COUNT_ON       1
+#define HOST_COUNT_STOPPING 2
+
+static uint32_t host_write_offset;
+static uint8_t host_stepping = 0;
+static volatile uint8_t host_counting = HOST_COUNT_OFF;
+static uint64_t host_instructions = 0;
+static HOST_COUNT_HOOK_Type host_count_hook_ = NULL;
+static struct sigaction host_fault_next;
+static struct sigaction host_step_next;
+
+static void host_chain(const struct sigaction *next, int number, siginfo_t *info, void *context)
+{
+  if ((next->sa_flags & SA_SIGINFO) && next->sa_sigaction) {
+    next->sa_sigaction(number, info, context);
+  } else if (!(next->sa_flags & SA_SIGINFO) && next->sa_handler != SIG_DFL && next->sa_handler != SIG_IGN) {
+    next->sa_handler(number);
+  } else {
+    // Nobody expects it, take the default action when the handler returns
+    signal(number, SIG_DFL);
+    raise(number);
+  }
+}
+
+static void host_fault(int number, siginfo_t *info, void *context)
+{
+  ucontext_t *uc = context;
+  uintptr_t address = (uintptr_t)info->si_addr;
+  uintptr_t base = (uintptr_t)host_peripherals;
+
+  if (address < base || address >= base + host_regs_size) {
+    host_chain(&host_fault_next, number, info, context);
+    return;
+  }
+  host_write_offset = address - base;
+  host_stepping = 1;
+  mprotect(host_peripherals, host_regs_size, PROT_READ | PROT_WRITE);
+  uc->uc_mcontext.gregs[REG_EFL] |= HOST_EFLAGS_TF;
+}
+
+static void host_step(int number, siginfo_t *info, void *context)
+{
+  ucontext_t *uc = context;
+
+  if (!host_stepping && host_counting == HOST_COUNT_OFF) {
+    host_chain(&host_step_next, number, info, context);
+    return;
+  }
+  if (host_stepping) {
+    host_stepping = 0;
+    mprotect(host_peripherals, host_regs_size, PROT_READ);
+    host_write(host_write_offset);
+  }
+  if (host_counting == HOST_COUNT_ON) {
+    host_instructions++;
+    if (host_count_hook_) {
+      host_count_hook_(uc->uc_mcontext.gregs[REG_RIP]);
+    }
+    return;
+  }
+  host_counting = HOST_COUNT_OFF;
+  uc->uc_mcontext.gregs[REG_EFL] &= ~HOST_EFLAGS_TF;
+}
+
+void host_count_hook(HOST_COUNT_HOOK_Type hook)
+{
+  host_count_hook_ = hook;
+}
+
+void host_count_start(void)
+{
+  host_instructions = 0;
+  host_counting = HOST_COUNT_ON;
+  // The trap follows the instruction after popf
+  __asm__ volatile ("pushfq; orq %0, (%%rsp); popfq" : : "i"(HOST_EFLAGS_TF) : "memory", "cc");
+}
+
+uint64_t host_count_stop(void)
+{
+  // The next trap clears the flag
+  host_counting = HOST_COUNT_STOPPING;
+  return host_instructions;
+}
+
+static void host_map_registers(void)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  struct sigaction action;
+  int fd = memfd_create("samd20", 0);
+
+  host_regs_size = (sizeof(HOST_PERIPHERALS_Type) + page - 1) & ~(page - 1);
+  if (fd < 0 || ftruncate(fd, host_regs_size)) {
+    perror("host: registers");
+    exit(1);
+  }
+  host_regs = mmap(NULL, host_regs_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  host_peripherals = mmap(NULL, host_regs_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (host_regs == MAP_FAILED || host_peripherals == MAP_FAILED) {
+    perror("host: registers");
+    exit(1);
+  }
+  close(fd);
+
+  // On the alternate stack, if the program set one, so a program can
+  // measure the stack of the code without the handlers (host/bench)
+  memset(&action, 0, sizeof(action));
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  action.sa_sigaction = host_fault;
+  sigaction(SIGSEGV, &action, &host_fault_next);
+  action.sa_sigaction = host_step;
+  sigaction(SIGTRAP, &action, &host_step_next);
+}
+
+//-----------------------------------------------------------------------------
+// Flags of the peripheral behind an interrupt line that are enabled
+static uint32_t host_irq_flags(uint8_t irqn)
+{
+  if (irqn == EIC_IRQn) {
+    return host_eic.flags & host_eic.inten;
+  }
+  if (irqn >= SERCOM0_IRQn && irqn < SERCOM0_IRQn + SERCOM_INST_NUM) {
+    uint8_t index = irqn - SERCOM0_IRQn;
+    return host_sercom_enabled(index) ? host_sercom_flags(index) & host_sercoms[index].inten : 0;
+  }
+  if (irqn >= TC0_IRQn && irqn < TC0_IRQn + TC_INST_NUM) {
+    HOST_TC_Type *tc = &host_tcs[irqn - TC0_IRQn];
+    return tc->flags & tc->inten;
+  }
+  return 0;
+}
+
+static uint32_t host_irq_lines(void)
+{
+  uint32_t lines = host_nvic_pending;
+  for (uint32_t enabled = host_nvic_enabled & ~lines; enabled; enabled &= enabled - 1) {
+    uint8_t irqn = __builtin_ctz(enabled);
+    if (host_irq_flags(irqn)) {
+      lines |= 0x01ul << irqn;
+    }
+  }
+  return lines & host_nvic_enabled;
+}
+
+// Run the pending handlers, lowest interrupt number first. Reads do not
+// trap, a USART handler called with RXC set is taken to read DATA.
+static void host_dispatch(void)
+{
+  uint32_t lines;
+  uint8_t taken = 0;
+
+  while (!host_primask && (lines = host_irq_lines())) {
+    if (taken++ == HOST_IRQ_LIMIT) {
+      host_stats.irq_limit++;
+      return;
+    }
+    uint8_t irqn = __builtin_ctz(lines);
+    if (!host_vectors[irqn]) {
+      fprintf(stderr, "host: no handler for interrupt %d\n", irqn);
+      exit(1);
+    }
+    host_nvic_pending &= ~(0x01ul << irqn);
+    host_present();
+    uint32_t flags = host_irq_flags(irqn);
+    host_vectors[irqn]();
+    if (irqn >= SERCOM0_IRQn && irqn < SERCOM0_IRQn + SERCOM_INST_NUM && (flags & SERCOM_USART_INTFLAG_RXC)) {
+      host_sercoms[irqn - SERCOM0_IRQn].rx_full = 0;
+    }
+    host_stats.irq[irqn]++;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Scheduled callbacks
+typedef struct {
+  uint64_t at;
+  HOST_CALLBACK_Type callback;
+  void *context;
+} HOST_EVENT_Type;
+
+static HOST_EVENT_Type host_events[HOST_EVENTS_Size];
+static uint8_t host_events_used = 0;
+static uint64_t host_events_next = UINT64_MAX;
+
+void host_schedule(uint32_t delay_us, HOST_CALLBACK_Type callback, void *context)
+{
+  if (host_events_used == HOST_EVENTS_Size) {
+    fprintf(stderr, "host: more than %d scheduled callbacks\n", HOST_EVENTS_Size);
+    exit(1);
+  }
+  HOST_EVENT_Type *event = &host_events[host_events_used++];
+  event->at = host_now + delay_us;
+  event->callback = callback;
+  event->context = context;
+  if (event->at < host_events_next) {
+    host_events_next = event->at;
+  }
+}
+
+static void host_events_run(void)
+{
+  for (uint8_t index = 0; index < host_events_used;) {
+    HOST_EVENT_Type event = host_events[index];
+    if (event.at > host_now) {
+      index++;
+      continue;
+    }
+    host_events[index] = host_events[--host_events_used];
+    // Callbacks run as the main loop does
+    host_present();
+    event.callback(event.context);
+  }
+  host_events_next = UINT64_MAX;
+  for (uint8_t index = 0; index < host_events_used; index++) {
+    if (host_events[index].at < host_events_next) {
+      host_events_next = host_events[index].at;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void host_tick(void)
+{
+  if (host_now >= host_events_next) {
+    host_events_run();
+  }
+  for (uint8_t index = 0; index < TC_INST_NUM; index++) {
+    host_tc_tick(index);
+  }
+  host_line_tick();
+  for (uint8_t index = 0; index < SERCOM_INST_NUM; index++) {
+    host_sercom_tick(index, index == host_line.sercom ? host_line.level : 1);
+  }
+  host_eic_tick();
+}
+
+//-----------------------------------------------------------------------------
+void host_init(void)
+{
+  host_map_registers();
+  host_nvmctrl_init();
+
+  for (uint8_t index = 0; index < SERCOM_INST_NUM; index++) {
+    host_uart_tx_reset(&host_sercoms[index].tx);
+    host_uart_rx_reset(&host_sercoms[index].rx, 1);
+  }
+  for (uint8_t line = 0; line < HOST_EIC_LINES; line++) {
+    host_eic.pin[line] = HOST_EIC_NO_PIN;
+  }
+
+  host_line.sercom = -1;
+  host_line.level = 1;
+  host_uart_tx_reset(&host_line.peer_tx);
+  host_uart_rx_reset(&host_line.monitor_rx, 1);
+  host_line.monitor_rx.bit_us = HOST_LINE_BIT_US;
+
+  host_present();
+}
+
+//-----------------------------------------------------------------------------
+uint64_t host_time(void)
+{
+  return host_now;
+}
+
+//-----------------------------------------------------------------------------
+void host_run(uint32_t us)
+{
+  host_dispatch();
+  while (us--) {
+    host_now++;
+    host_tick();
+    host_dispatch();
+  }
+  host_present();
+}
@@ -0,0 +1,139 @@
+/**
+ * @file samd20_host.h
+ * @brief Software model of the SAMD20 peripherals for the host build
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * `make host` builds the Loconet, domotica, components and utils code for
+ * the workstation, with the peripherals in host memory (see
+ * host/include/samd20.h) and this model behind them.
+ *
+ * Time is virtual and counts microseconds. host_run advances it. In each
+ * microsecond the timers count, the Loconet line and the USARTs shift,
+ * the EIC looks for flanks, and pending interrupts run to completion, in
+ * the order of their interrupt number. The code between host_run calls
+ * (the main loop) takes no time and is never interrupted.
+ *
+ * Registers are memory that the code sees read-only. A write faults, the
+ * model lets the instruction complete and applies the write as the
+ * peripheral does: SET, CLR and TGL registers change the register behind
+ * them, flags are cleared by writing a one, a write to DATA of a USART
+ * queues a byte. Reads do not trap, the model writes the registers the
+ * code reads before it runs. A USART handler called with RXC set is taken
+ * to read DATA. Trapping single steps the write, so the host build runs on
+ * x86-64 Linux.
+ *
+ * Modelled are the USART mode of the SERCOMs, the COUNT16 mode of the TCs
+ * counting at 1 MHz (as utils/clock.h sets them up), the EIC with events,
+ * the event system from the EIC to a TC retrigger, the PORT pins and the
+ * row erase of the NVMCTRL. Page writes land in the flash image directly.
+ * The fuses and other peripherals are memory without behaviour.
+ *
+ * The Loconet line is a wired-AND of the USART attached to it, its TX pin
+ * when driven high (the break of loconet_irq_collision) and a peer. The
+ * peer sends the messages queued with host_line_send, each after the line
+ * was quiet for the carrier detect and master delay. When the line is low
+ * while it sends a one, it stops and sends the message again.
+ *
+ * Between host_count_start and host_count_stop every instruction of the
+ * host traps and is counted, which makes a repeatable measure of the work
+ * of the code (host/wcet). The model is not counted.
+ *
+ * A line shared by several models (host/bus) is driven from outside: each
+ * microsecond the owner of the line sets the level given to
+ * host_line_connect to the wired-AND of host_line_drive of all models.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _HOST_SAMD20_HOST_H_
+#define _HOST_SAMD20_HOST_H_
+
+#include <stdint.h>
+#include "samd20.h"
+
+//-----------------------------------------------------------------------------
+// Handlers that may run in one microsecond before the model moves on
+#ifndef HOST_IRQ_LIMIT
+#define HOST_IRQ_LIMIT 16
+#endif
+
+// Callbacks waiting for their time
+#ifndef HOST_EVENTS_Size
+#define HOST_EVENTS_Size 16
+#endif
+
+// Messages waiting to be sent by the peer, and their maximum length
+#ifndef HOST_LINE_QUEUE_Size
+#define HOST_LINE_QUEUE_Size 16
+#endif
+#ifndef HOST_LINE_MESSAGE_Size
+#define HOST_LINE_MESSAGE_Size 32
+#endif
+
+// Bit time of the peer and the monitor
+#define HOST_LINE_BIT_US 60
+
+// Quiet line before the peer sends: carrier detect and master delay
+#define HOST_LINE_PEER_GAP (1200 + 360)
+
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint32_t irq[PERIPH_COUNT_IRQn];  // Handlers run, per interrupt line
+  uint32_t irq_limit;               // Times HOST_IRQ_LIMIT was reached
+  uint32_t line_low;                // Falling flanks of the line
+  uint32_t peer_collision;          // Messages of the peer that collided
+} HOST_STATS_Type;
+
+extern HOST_STATS_Type host_stats;
+
+//-----------------------------------------------------------------------------
+// Map the flash image and reset the peripherals, before any other call
+extern void host_init(void);
+
+// Virtual time in microseconds since host_init
+extern uint64_t host_time(void);
+
+// Advance the virtual time, running interrupts as they become pending
+extern void host_run(uint32_t us);
+
+// Call callback with context after delay_us, as if from the main loop
+typedef void (*HOST_CALLBACK_Type)(void *context);
+extern void host_schedule(uint32_t delay_us, HOST_CALLBACK_Type callback, void *context);
+
+//-----------------------------------------------------------------------------
+// Attach the USART of sercom to the line. The OUT bit of tx_pin of group
+// pulls the line low, the in_pins of group follow the line.
+extern void host_line_attach(Sercom *sercom, PortGroup *group, uint8_t tx_pin, uint32_t in_pins);
+
+// Queue a message for the peer, returns 0 if the queue is full
+extern uint8_t host_line_send(const uint8_t *data, uint8_t length);
+
+// The peer pulls the line low for us
+extern void host_line_break(uint32_t us);
+
+// Called with each byte on the line, and 1 if its stop bit was low
+typedef void (*HOST_LINE_MONITOR_Type)(uint8_t data, uint8_t framing_error);
+extern void host_line_monitor(HOST_LINE_MONITOR_Type monitor);
+
+// Current level of the line, 1 is idle
+extern uint8_t host_line_level(void);
+
+// Level this model drives for the next microsecond, 0 if it pulls the line
+// low through the USART, the TX pin, the peer or a break
+extern uint8_t host_line_drive(void);
+
+// Take the line level from *bus instead of host_line_drive
+extern void host_line_connect(const uint8_t *bus);
+
+//-----------------------------------------------------------------------------
+// Count the instructions the host executes from host_count_start up to
+// host_count_stop, which returns the count. The hook, if any, is called
+// with the address of every instruction counted.
+typedef void (*HOST_COUNT_HOOK_Type)(uintptr_t address);
+extern void host_count_hook(HOST_COUNT_HOOK_Type hook);
+extern void host_count_start(void);
+extern uint64_t host_count_stop(void);
+
+#endif // _HOST_SAMD20_HOST_H_
@@ -0,0 +1,551 @@
+/**
+ * @file wcet.c
+ * @brief Worst case instruction counts of the Loconet receive path
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Searches for received bytes that make the device of src/main.c do the
+ * most work per byte, and checks the worst found against a budget:
+ *
+ *   build/host/wcet [inputs] [seed]
+ *
+ * runs the hand made inputs and the given number of fuzzed inputs, 500
+ * by default, prints the worst case of each path and fails if it exceeds
+ * host/wcet/budget.
+ *
+ * Work is counted in instructions of the host build (host_count_start),
+ * so it is repeatable, but it is not the instruction count of the device.
+ * Two paths are counted:
+ *
+ * - rx: loconet_rx_buffer_push, the receive interrupt, for each byte
+ * - dispatch: loconet_rx_process of each complete message, the transaction
+ *   subscribers and handlers it calls, domotica included, per byte of the
+ *   message
+ *
+ * The fuzzer keeps inputs that reach new edges in the code of the program
+ * (libc is not followed) or a new worst case, and mutates those: bit
+ * flips, bytes at boundaries (length bytes of 0, 1 and 2, opcodes),
+ * inserts, deletes, repeats, splices, and fixed checksums so messages get
+ * past the checksum. The device keeps its state between inputs, like
+ * programming mode and the EEPROM, and runs its main loop for the time of
+ * the input on the wire after each of them.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "samd20.h"
+#include "samd20_host.h"
+#include "hal_gpio.h"
+#include "loconet/loconet.h"
+#include "loconet/loconet_cv.h"
+#include "loconet/loconet_rx.h"
+#include "loconet/loconet_tx.h"
+#include "utils/eeprom.h"
+
+#include "components/fast_clock.h"
+
+#include "domotica/domotica.h"
+
+#ifndef WCET_BUDGET
+#define WCET_BUDGET "host/wcet/budget"
+#endif
+
+//-----------------------------------------------------------------------------
+LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*/, 3/*rx_pad*/, A/*fl_port*/, 13/*fl_pin*/, 13/*fl_int*/, 1/*fl_tmr*/);
+
+FAST_CLOCK_BUILD(2)
+
+//-----------------------------------------------------------------------------
+void irq_handler_eic(void);
+void irq_handler_eic(void) {
+  if (loconet_handle_eic()) {
+    return;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off);
+void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off)
+{
+  (void) mask_on;
+  (void) mask_off;
+}
+
+//-----------------------------------------------------------------------------
+// A byte on the wire
+#define WCET_BYTE_US (10 * HOST_LINE_BIT_US)
+
+// Longest input, inputs kept for mutation and edges followed
+#define WCET_INPUT_Size  256
+#define WCET_CORPUS_Size 512
+#define WCET_MAP_Size    65536
+
+#define WCET_PATH_RX       0
+#define WCET_PATH_DISPATCH 1
+#define WCET_PATH_Size     2
+
+static const char *const wcet_path_names[WCET_PATH_Size] = { "rx", "dispatch" };
+
+typedef struct {
+  uint8_t data[WCET_INPUT_Size];
+  uint16_t length;
+} WCET_INPUT_Type;
+
+typedef struct {
+  uint64_t call;            // Most instructions of one call
+  double byte;              // Most instructions per received byte
+} WCET_COST_Type;
+
+typedef struct {
+  WCET_COST_Type cost;
+  WCET_INPUT_Type input;    // Input with the most per byte
+} WCET_WORST_Type;
+
+static WCET_INPUT_Type wcet_corpus[WCET_CORPUS_Size];
+static uint16_t wcet_corpus_count = 0;
+static WCET_WORST_Type wcet_worst[WCET_PATH_Size];
+static uint64_t wcet_budget[WCET_PATH_Size];
+
+static uint32_t wcet_random_state = 1;
+static uint64_t wcet_overhead = 0;
+
+// Bytes of the message being received, from its opcode
+static uint16_t wcet_received = 0;
+
+//-----------------------------------------------------------------------------
+// Edges between instructions in the code of the program
+extern const char __executable_start[];
+extern const char etext[];
+
+static uint8_t wcet_map[WCET_MAP_Size];
+static uintptr_t wcet_previous = 0;
+static uint32_t wcet_edges = 0;
+static uint32_t wcet_new_edges = 0;
+
+static void wcet_hook(uintptr_t address)
+{
+  if (address < (uintptr_t)__executable_start || address >= (uintptr_t)etext) {
+    return;
+  }
+  address -= (uintptr_t)__executable_start;
+  uint32_t index = (address ^ wcet_previous) & (WCET_MAP_Size - 1);
+  if (!wcet_map[index]) {
+    wcet_map[index] = 1;
+    wcet_new_edges++;
+  }
+  wcet_previous = address >> 1;
+}
+
+//-----------------------------------------------------------------------------
+// Xorshift32, as loconet_tx_random
+static uint32_t wcet_random(void)
+{
+  uint32_t x = wcet_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  wcet_random_state = x;
+  return x;
+}
+
+// Length of the message from its first bytes, 0 if unknown
+static uint8_t wcet_expected(const uint8_t *data, uint16_t length)
+{
+  switch (data[0] & 0x60) {
+    case 0x00: return 2;
+    case 0x20: return 4;
+    case 0x40: return 6;
+  }
+  return length > 1 ? data[1] : 0;
+}
+
+// Give the messages of the input a valid checksum
+static void wcet_fix_checksums(WCET_INPUT_Type *input)
+{
+  for (uint16_t index = 0; index < input->length; index++) {
+    if (!(input->data[index] & 0x80)) {
+      continue;
+    }
+    uint8_t expected = wcet_expected(&input->data[index], input->length - index);
+    if (expected < 2 || index + expected > input->length) {
+      continue;
+    }
+    uint8_t checksum = 0xFF;
+    uint8_t count = 0;
+    while (count < expected - 1 && !(count && (input->data[index + count] & 0x80))) {
+      checksum ^= input->data[index + count++];
+    }
+    if (count == expected - 1) {
+      input->data[index + count] = checksum;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Run the main loop of the device up to the virtual time
+static void wcet_until(uint64_t at)
+{
+  while (host_time() < at) {
+    uint64_t left = at - host_time();
+    loconet_loop();
+    fast_clock_loop();
+    domotica_loop();
+    host_run(left < 10 ? left : 10);
+  }
+}
+
+static uint64_t wcet_count_stop(void)
+{
+  uint64_t count = host_count_stop();
+  return count > wcet_overhead ? count - wcet_overhead : 0;
+}
+
+// Feed the input to the device, returns 1 if it reached a new edge or a
+// new worst case
+static uint8_t wcet_run(const WCET_INPUT_Type *input)
+{
+  WCET_COST_Type cost[WCET_PATH_Size];
+  uint8_t kept = 0;
+
+  memset(cost, 0, sizeof(cost));
+  wcet_new_edges = 0;
+  for (uint16_t index = 0; index < input->length; index++) {
+    uint8_t byte = input->data[index];
+    wcet_received = (byte & 0x80) ? 1 : wcet_received + 1;
+
+    host_count_start();
+    loconet_rx_buffer_push(byte);
+    uint64_t count = wcet_count_stop();
+    if (count > cost[WCET_PATH_RX].call) {
+      cost[WCET_PATH_RX].call = count;
+      cost[WCET_PATH_RX].byte = count;
+    }
+
+    // The main loop handles a message as soon as it is complete
+    uint8_t processed;
+    do {
+      host_count_start();
+      processed = loconet_rx_process();
+      count = wcet_count_stop();
+      if (processed && count > cost[WCET_PATH_DISPATCH].call) {
+        cost[WCET_PATH_DISPATCH].call = count;
+      }
+      if (processed && (double)count / wcet_received > cost[WCET_PATH_DISPATCH].byte) {
+        cost[WCET_PATH_DISPATCH].byte = (double)count / wcet_received;
+      }
+    } while (processed);
+  }
+  wcet_until(host_time() + input->length * WCET_BYTE_US);
+
+  for (uint8_t path = 0; path < WCET_PATH_Size; path++) {
+    WCET_WORST_Type *worst = &wcet_worst[path];
+    if (cost[path].call > worst->cost.call) {
+      worst->cost.call = cost[path].call;
+      kept = 1;
+    }
+    if (cost[path].byte > worst->cost.byte) {
+      worst->cost.byte = cost[path].byte;
+      worst->input = *input;
+      kept = 1;
+    }
+  }
+  wcet_edges += wcet_new_edges;
+  return kept || wcet_new_edges;
+}
+
+static void wcet_keep(const WCET_INPUT_Type *input, uint16_t seeds)
+{
+  if (wcet_corpus_count < WCET_CORPUS_Size) {
+    wcet_corpus[wcet_corpus_count++] = *input;
+  } else {
+    // Hand made inputs stay
+    wcet_corpus[seeds + wcet_random() % (WCET_CORPUS_Size - seeds)] = *input;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void wcet_mutate(WCET_INPUT_Type *input)
+{
+  static const uint8_t interesting[] = {
+    0x00, 0x01, 0x02, 0x03, 0x0E, 0x0F, 0x10, 0x7F, 0x80, 0x81, 0xB0, 0xB2, 0xE5, 0xE7, 0xED, 0xEF, 0xFF
+  };
+  uint16_t position = input->length ? wcet_random() % input->length : 0;
+  uint16_t length;
+
+  switch (wcet_random() % 8) {
+    case 0: // Flip a bit
+      input->data[position] ^= 0x01 << (wcet_random() % 8);
+      break;
+    case 1: // A byte at a boundary
+      input->data[position] = interesting[wcet_random() % sizeof(interesting)];
+      break;
+    case 2: // Insert a byte
+      if (input->length < WCET_INPUT_Size) {
+        memmove(&input->data[position + 1], &input->data[position], input->length - position);
+        input->data[position] = wcet_random();
+        input->length++;
+      }
+      break;
+    case 3: // Delete bytes
+      length = 1 + wcet_random() % 4;
+      if (input->length > length) {
+        length = position + length > input->length ? input->length - position : length;
+        memmove(&input->data[position], &input->data[position + length], input->length - position - length);
+        input->length -= length;
+      }
+      break;
+    case 4: // Repeat the bytes from position to the end
+      length = input->length - position;
+      while (length && input->length + length <= WCET_INPUT_Size) {
+        memcpy(&input->data[input->length], &input->data[position], length);
+        input->length += length;
+      }
+      break;
+    case 5: { // Splice with another input
+      const WCET_INPUT_Type *other = &wcet_corpus[wcet_random() % wcet_corpus_count];
+      length = other->length - (other->length ? wcet_random() % other->length : 0);
+      if (position + length > WCET_INPUT_Size) {
+        length = WCET_INPUT_Size - position;
+      }
+      memcpy(&input->data[position], &other->data[other->length - length], length);
+      input->length = position + length;
+      break;
+    }
+    default: // Valid checksums
+      wcet_fix_checksums(input);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Hand made inputs. Messages are given without their checksum byte, which
+// is filled in.
+static void wcet_seed_add(WCET_INPUT_Type *input, const uint8_t *data, uint8_t length)
+{
+  for (uint8_t index = 0; index < length && input->length < WCET_INPUT_Size; index++) {
+    input->data[input->length++] = data[index];
+  }
+}
+
+static void wcet_seed_message(WCET_INPUT_Type *input, const uint8_t *data, uint8_t length)
+{
+  uint8_t checksum = 0xFF;
+  wcet_seed_add(input, data, length);
+  for (uint8_t index = 0; index < length; index++) {
+    checksum ^= data[index];
+  }
+  wcet_seed_add(input, &checksum, 1);
+}
+
+// LNCV request of a KPU to this device class
+static void wcet_seed_lncv(WCET_INPUT_Type *input, uint8_t request, uint16_t number, uint16_t value, uint8_t flags)
+{
+  uint8_t data[14] = {
+    0xE5, 0x0F, LOCONET_CV_SRC_KPU, LOCONET_CV_DST_UB_KPU & 0xFF, LOCONET_CV_DST_UB_KPU >> 8,
+    request, 0, LOCONET_CV_DEVICE_CLASS & 0xFF, LOCONET_CV_DEVICE_CLASS >> 8,
+    number & 0xFF, number >> 8, value & 0xFF, value >> 8, flags
+  };
+  for (uint8_t index = 0; index < 7; index++) {
+    if (data[7 + index] & 0x80) {
+      data[6] |= 0x01 << index;
+      data[7 + index] &= 0x7F;
+    }
+  }
+  wcet_seed_message(input, data, sizeof(data));
+}
+
+static uint16_t wcet_seeds(void)
+{
+  WCET_INPUT_Type input;
+  uint8_t data[WCET_INPUT_Size];
+
+  // Data bytes only, then random bytes
+  memset(&input, 0, sizeof(input));
+  for (uint8_t index = 0; index < 64; index++) {
+    input.data[input.length++] = wcet_random() & 0x7F;
+  }
+  wcet_keep(&input, 0);
+  memset(&input, 0, sizeof(input));
+  for (uint8_t index = 0; index < 64; index++) {
+    input.data[input.length++] = wcet_random();
+  }
+  wcet_keep(&input, 0);
+
+  // Stray opcodes, every message cut short by the next
+  memset(&input, 0, sizeof(input));
+  for (uint8_t index = 0; index < 32; index++) {
+    wcet_seed_add(&input, (const uint8_t[]){ 0xB2, 0x01 }, 2);
+    wcet_seed_add(&input, (const uint8_t[]){ 0xE5, 0x0F, 0x01 }, 3);
+  }
+  wcet_keep(&input, 0);
+
+  // Length bytes of 0, 1, 2 and the shortest valid length
+  for (uint8_t length = 0; length < 4; length++) {
+    memset(&input, 0, sizeof(input));
+    data[0] = 0xE5;
+    data[1] = length;
+    wcet_seed_message(&input, data, length < 3 ? 2 : length - 1);
+    wcet_seed_add(&input, (const uint8_t[]){ 0x00, 0x7F, 0x00 }, 3);
+    wcet_keep(&input, 0);
+  }
+
+  // Messages of the maximum length, back to back
+  memset(&input, 0, sizeof(input));
+  for (uint8_t opcode = 0xE5; opcode != 0xF1; opcode += 0x0A) {
+    data[0] = opcode;
+    data[1] = 0x7F;
+    for (uint8_t index = 2; index < 0x7E; index++) {
+      data[index] = wcet_random() & 0x7F;
+    }
+    wcet_seed_message(&input, data, 0x7E);
+  }
+  wcet_keep(&input, 0);
+
+  // Programming session: on, a write, reads of a stored LNCV and of a
+  // counter, off
+  memset(&input, 0, sizeof(input));
+  wcet_seed_lncv(&input, LOCONET_CV_REQ_CFGREQUEST, 0, LOCONET_CV_INITIAL_ADDRESS, LOCONET_CV_FLG_PROG_ON);
+  wcet_seed_lncv(&input, LOCONET_CV_REQ_CFGWRITE, 14, 100, 0);
+  wcet_seed_lncv(&input, LOCONET_CV_REQ_CFGREAD, 2, 0, 0);
+  wcet_seed_lncv(&input, LOCONET_CV_REQ_CFGREAD, LOCONET_CV_STATS_START + LOCONET_CV_STATS_UTILIZATION, 0, 0);
+  wcet_seed_lncv(&input, LOCONET_CV_REQ_CFGREQUEST, 0, LOCONET_CV_INITIAL_ADDRESS, LOCONET_CV_FLG_PROG_OFF);
+  wcet_keep(&input, 0);
+
+  // Layout traffic the handlers act on: a switch request for the first
+  // output, a sensor report, the fast clock, a busy line
+  memset(&input, 0, sizeof(input));
+  wcet_seed_message(&input, (const uint8_t[]){ 0xB0, (LOCONET_CV_INITIAL_ADDRESS - 1) & 0x7F, 0x30 }, 3);
+  wcet_seed_message(&input, (const uint8_t[]){ 0xB2, 0x01, 0x50 }, 3);
+  wcet_seed_message(&input, (const uint8_t[]){ 0xE7, 0x0E, 0x7B, 1, 0, 0, 0x7F, 0, 0x7F, 1, 1, 0x12, 0x34 }, 13);
+  wcet_seed_message(&input, (const uint8_t[]){ 0x81 }, 1);
+  wcet_keep(&input, 0);
+
+  return wcet_corpus_count;
+}
+
+//-----------------------------------------------------------------------------
+static void wcet_read_budget(const char *path)
+{
+  char line[128];
+  char name[32];
+  unsigned long long value;
+  FILE *file = fopen(path, "r");
+
+  if (!file) {
+    fprintf(stderr, "wcet: %s: cannot open\n", path);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#' || sscanf(line, "%31s %llu", name, &value) != 2) {
+      continue;
+    }
+    for (uint8_t index = 0; index < WCET_PATH_Size; index++) {
+      if (!strcmp(name, wcet_path_names[index])) {
+        wcet_budget[index] = value;
+      }
+    }
+  }
+  fclose(file);
+  for (uint8_t index = 0; index < WCET_PATH_Size; index++) {
+    if (!wcet_budget[index]) {
+      fprintf(stderr, "wcet: %s: no budget for %s\n", path, wcet_path_names[index]);
+      exit(1);
+    }
+  }
+}
+
+static void eeprom_init(void)
+{
+  // The flash image starts erased
+  if (eeprom_emulator_init() != STATUS_OK) {
+    eeprom_emulator_erase_memory();
+    if (eeprom_emulator_init() != STATUS_OK) {
+      fprintf(stderr, "eeprom emulator failed\n");
+      exit(1);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  uint32_t inputs = argc > 1 ? strtoul(argv[1], NULL, 0) : 500;
+  wcet_random_state = argc > 2 && strtoul(argv[2], NULL, 0) ? strtoul(argv[2], NULL, 0) : 1;
+  clock_t started = clock();
+
+  wcet_read_budget(WCET_BUDGET);
+
+  host_init();
+  host_line_attach(SERCOM2, &PORT->Group[0], 14, (0x01ul << 15) | (0x01ul << 13));
+  __enable_irq();
+
+  eeprom_init();
+
+  // Set up the device as src/main.c
+  loconet_cv_init();
+  loconet_config.bit.ADDRESS = loconet_cv_get(0);
+  loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_config.bit.RETRY_LIMIT = loconet_cv_get(3);
+  loconet_config.bit.BACKOFF = loconet_cv_get(4);
+  loconet_init();
+  fast_clock_init();
+  fast_clock_set_slave();
+  domotica_init();
+
+  // Instructions of counting nothing
+  wcet_overhead = UINT64_MAX;
+  for (uint8_t count = 0; count < 16; count++) {
+    host_count_start();
+    uint64_t overhead = host_count_stop();
+    if (overhead < wcet_overhead) {
+      wcet_overhead = overhead;
+    }
+  }
+  host_count_hook(wcet_hook);
+
+  uint16_t seeds = wcet_seeds();
+  for (uint16_t index = 0; index < seeds; index++) {
+    wcet_run(&wcet_corpus[index]);
+  }
+  for (uint32_t count = 0; count < inputs; count++) {
+    WCET_INPUT_Type input = wcet_corpus[wcet_random() % wcet_corpus_count];
+    for (uint8_t mutations = 1 + wcet_random() % 4; mutations; mutations--) {
+      wcet_mutate(&input);
+    }
+    if (input.length && wcet_run(&input)) {
+      wcet_keep(&input, seeds);
+    }
+  }
+
+  uint8_t failed = 0;
+  printf("wcet:     %u hand made and %u fuzzed inputs, %u kept, %u edges, wall %.3f s\n",
+    seeds, inputs, wcet_corpus_count, wcet_edges, (double)(clock() - started) / CLOCKS_PER_SEC);
+  printf("path      per call  per byte  budget\n");
+  for (uint8_t path = 0; path < WCET_PATH_Size; path++) {
+    WCET_WORST_Type *worst = &wcet_worst[path];
+    printf("%-9s %8lu  %8.1f  %6lu\n", wcet_path_names[path], (unsigned long)worst->cost.call,
+      worst->cost.byte, (unsigned long)wcet_budget[path]);
+    failed |= worst->cost.byte > wcet_budget[path];
+  }
+  for (uint8_t path = 0; path < WCET_PATH_Size; path++) {
+    WCET_WORST_Type *worst = &wcet_worst[path];
+    printf("worst %s:", wcet_path_names[path]);
+    for (uint16_t index = 0; index < worst->input.length; index++) {
+      printf(" %02X", worst->input.data[index]);
+    }
+    printf("\n");
+  }
+
+  if (failed) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
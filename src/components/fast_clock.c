@@ -40,8 +40,8 @@ FAST_CLOCK_STATUS_Type fast_clock_status = {0, 0, 0, 0, 1, 0};
 uint16_t fast_clock_current_intermessage_delay = 0;
 
 // ----------------------------------------------------------------------------
-// The clock is defined on div8, i.e. 1 us. By setting this delay to 50.000,
-// there is a tick every 50ms.
+// The timer ticks every 1 us at any F_CPU (see utils/clock.h). By setting
+// this delay to 50.000, there is a tick every 50ms.
 #define FAST_CLOCK_TIMER_DELAY 50000
 Tc *fast_clock_timer;
 
@@ -51,23 +51,23 @@ void fast_clock_init_timer(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_
 {
   fast_clock_timer = timer;
 
-  // Enable clock for fast clock, without prescaler
+  // Enable clock for fast clock, from the timer clock generator
   PM->APBCMASK.reg |= pm_tmr_mask;
   GCLK->CLKCTRL.reg =
     GCLK_CLKCTRL_ID(gclock_tmr_id)
     | GCLK_CLKCTRL_CLKEN
-    | GCLK_CLKCTRL_GEN(0);
+    | GCLK_CLKCTRL_GEN(CLOCK_TIMER_GCLK);
 
   /* CTRLA register:
    *   PRESCSYNC: 0x02  RESYNC
    *   RUNSTDBY:        Ignored
-   *   PRESCALER: 0x03  DIV8, each tick is be 1 us
+   *   PRESCALER:       Chosen for F_CPU, each tick is 1 us
    *   WAVEGEN:   0x01  MFRQ, zero counter on match
    *   MODE:      0x00  16 bits timer
    */
   fast_clock_timer->COUNT16.CTRLA.reg =
     TC_CTRLA_PRESCSYNC_RESYNC
-    | TC_CTRLA_PRESCALER_DIV8
+    | CLOCK_TIMER_PRESCALER
     | TC_CTRLA_WAVEGEN_MFRQ
     | TC_CTRLA_MODE_COUNT16;
 
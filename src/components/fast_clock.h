@@ -55,6 +55,7 @@
 #include <stdint.h>
 #include "loconet/loconet_tx_messages.h"
 #include "utils/logger.h"
+#include "utils/profile.h"
 
 typedef struct {
   uint8_t second;
@@ -121,9 +122,11 @@ extern void fast_clock_init_timer(Tc*, uint32_t, uint32_t, uint32_t);
   void irq_handler_tc##timer(void);                                           \
   void irq_handler_tc##timer(void)                                            \
   {                                                                           \
+    PROFILE_BEGIN(IRQ_FAST_CLOCK);                                            \
     /* Reset clock interrupt flag */                                          \
     TC##timer->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(1);                        \
-    fast_clock_irq();                                                        \
+    fast_clock_irq();                                                         \
+    PROFILE_END(IRQ_FAST_CLOCK);                                              \
   }                                                                           \
 
 // ------------------------------------------------------------------
@@ -13,7 +13,11 @@
 // ----------------------------------------------------------------------------
 void loconet_cv_written_event(uint16_t lncv_number, uint16_t value)
 {
-  if (lncv_number < DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START) {
+  if (lncv_number == 0) {
+    // Our switch addresses moved along with the address
+    domotica_rx_update_switch_interest();
+  }
+  else if (lncv_number < DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START) {
     // do nothing. No values are set her
   }
   // By def, we have lncv_number >= DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START
@@ -45,7 +49,11 @@ void loconet_cv_written_event(uint16_t lncv_number, uint16_t value)
 // ----------------------------------------------------------------------------
 uint8_t loconet_cv_write_allowed(uint16_t lncv_number, uint16_t value)
 {
-  if ( lncv_number > 3 && lncv_number < DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START) {
+  if (lncv_number <= 4) {
+    // Checked by the Loconet library
+    return LOCONET_CV_ACK_OK;
+  }
+  else if (lncv_number < DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START) {
     return LOCONET_CV_ACK_ERROR_INVALID_VALUE;
   }
   // By def we have lncv_number >= DOMOTICA_LNCV_OUTPUT_BRIGHTNESS_START
@@ -85,7 +85,7 @@ void fast_clock_handle_update(FAST_CLOCK_TIME_Type time){
 
   for(uint8_t index = 0 ; index < DOMOTICA_FASTCLOCK_SIZE ; index++)
   {
-    if (timestamps[index].timestamp >= 2400)
+    if (timestamps[index].lncv == 0 || timestamps[index].timestamp >= 2400)
     {
       continue;
     }
@@ -21,6 +21,38 @@ static INPUT_ADDRESS_Type b2_addresses[DOMOTICA_RX_INPUT_ADDRESS_SIZE];
 void domotica_rx_init(void)
 {
   b2_addresses[0].address = 0;
+
+  domotica_rx_update_switch_interest();
+}
+
+// ------------------------------------------------------------------
+// Only switch requests for our own addresses are handled, see
+// loconet_rx_sw_req for how the address is decoded
+void domotica_rx_update_switch_interest(void)
+{
+  loconet_rx_interest_clear(LOCONET_RX_INTEREST_SWITCH);
+  for(uint8_t index = 0 ; index < 16 ; index++)
+  {
+    loconet_rx_interest_add(LOCONET_RX_INTEREST_SWITCH, (loconet_config.bit.ADDRESS + index - 1) >> 1);
+  }
+  loconet_rx_interest_enable(LOCONET_RX_INTEREST_SWITCH);
+}
+
+// ------------------------------------------------------------------
+// Rebuild the interest filter of the loconet library from the addresses
+// we listen to, so other messages are dropped before they are processed
+static void domotica_rx_update_interest(void)
+{
+  loconet_rx_interest_clear(LOCONET_RX_INTEREST_SENSOR);
+  for(uint8_t index = 0 ; index < DOMOTICA_RX_INPUT_ADDRESS_SIZE ; index++)
+  {
+    if (b2_addresses[index].address > 0)
+    {
+      // Addresses start at 1, the filter at 0
+      loconet_rx_interest_add(LOCONET_RX_INTEREST_SENSOR, b2_addresses[index].address - 1);
+    }
+  }
+  loconet_rx_interest_enable(LOCONET_RX_INTEREST_SENSOR);
 }
 
 // ------------------------------------------------------------------
@@ -35,6 +67,7 @@ void domotica_rx_set_input_address(uint16_t lncv, uint16_t address)
   {
     b2_addresses[index].address = address;
     b2_addresses[index].lncv = lncv;
+    domotica_rx_update_interest();
   }
 }
 
@@ -48,6 +81,7 @@ void domotica_rx_remove_input_address(uint16_t lncv)
   {
     b2_addresses[index].address = 0;
     b2_addresses[index].lncv = 0;
+    domotica_rx_update_interest();
   }
 }
 
@@ -23,6 +23,11 @@
 // Initialize the RX library
 extern void domotica_rx_init(void);
 
+// ------------------------------------------------------------------
+// Rebuild the interest filter of switch requests from
+// loconet_config.bit.ADDRESS, after it changed
+extern void domotica_rx_update_switch_interest(void);
+
 // ------------------------------------------------------------------
 // Add a B2 address to listen to.
 extern void domotica_rx_set_input_address(uint16_t lncv, uint16_t address);
@@ -9,6 +9,7 @@
  * @author Jan Martijn van der Werf <janmartijn@slashdev.nl>
  */
 #include "loconet.h"
+#include "utils/interrupt_nvic.h"
 
 //-----------------------------------------------------------------------------
 // Prototypes
@@ -17,13 +18,25 @@
 // Peripherals to use for communication
 Sercom *loconet_sercom;
 Tc *loconet_flank_timer;
+Tc *loconet_timebase_timer;
 PortGroup *loconet_tx_port;
 uint32_t loconet_tx_pin;
 
+// External interrupt of the flank pin if flanks are routed through the
+// event system, 0 if each flank interrupts
+static uint32_t loconet_flank_events = 0;
+
+//-----------------------------------------------------------------------------
+#define LOCONET_DELAY_CARRIER_DETECT 1200 /* 20x bit time (60ux) */
+#define LOCONET_DELAY_MASTER_DELAY    360 /*  6x bit time (60us) */
+#define LOCONET_DELAY_LINE_BREAK      900 /* 15x bit time (60us) */
+#define LOCONET_DELAY_PRIORITY_DELAY   60 /*  1x bit time (60ux) */
+
 //-----------------------------------------------------------------------------
 // Global variables
 LOCONET_CONFIG_Type loconet_config = { 0 };
 LOCONET_STATUS_Type loconet_status = { 0 };
+LOCONET_STATS_Type loconet_stats = { 0 };
 
 //-----------------------------------------------------------------------------
 // Initialize USART for loconet
@@ -70,8 +83,7 @@ void loconet_init_usart(Sercom *sercom, uint32_t pm_mask, uint32_t gclock_id, ui
     | SERCOM_USART_CTRLB_TXEN
     | SERCOM_USART_CTRLB_CHSIZE(0);
 
-  uint64_t br = (uint64_t)65536 * (F_CPU - 16 * 16666) / F_CPU;
-  loconet_sercom->USART.BAUD.reg = (uint16_t)br;
+  loconet_sercom->USART.BAUD.reg = (uint16_t)LOCONET_BAUD_VALUE;
 
   /* INTERRUPTS register
    *   RXS:       0x00  No interrupt on Rx start
@@ -109,38 +121,107 @@ void loconet_init_flank_detection(uint8_t fl_int)
 }
 
 //-----------------------------------------------------------------------------
-// Initialize flank timer
-void loconet_init_flank_timer(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_id, uint32_t nvic_irqn)
+// Set up a timer counting microseconds
+static void loconet_init_timer(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_id)
 {
-  // Save timer
-  loconet_flank_timer = timer;
-
-  // Enable clock for flank timer, without prescaler
+  // Enable clock for the timer, from the timer clock generator
   PM->APBCMASK.reg |= pm_tmr_mask;
   GCLK->CLKCTRL.reg =
     GCLK_CLKCTRL_ID(gclock_tmr_id)
     | GCLK_CLKCTRL_CLKEN
-    | GCLK_CLKCTRL_GEN(0);
+    | GCLK_CLKCTRL_GEN(CLOCK_TIMER_GCLK);
 
   /* CTRLA register:
    *   PRESCSYNC: 0x02  RESYNC
    *   RUNSTDBY:        Ignored
-   *   PRESCALER: 0x03  DIV8, each tick will be 1us
-   *   WAVEGEN:   0x01  MFRQ, zero counter on match
+   *   PRESCALER:       Chosen for F_CPU, each tick will be 1us
+   *   WAVEGEN:   0x00  NFRQ, free running
    *   MODE:      0x00  16 bits timer
    */
-  loconet_flank_timer->COUNT16.CTRLA.reg =
+  timer->COUNT16.CTRLA.reg =
     TC_CTRLA_PRESCSYNC_RESYNC
-    | TC_CTRLA_PRESCALER_DIV8
-    | TC_CTRLA_WAVEGEN_MFRQ
+    | CLOCK_TIMER_PRESCALER
+    | TC_CTRLA_WAVEGEN_NFRQ
     | TC_CTRLA_MODE_COUNT16;
 
+  // Keep COUNT synchronized so it can be read directly (COUNT is at 0x10)
+  timer->COUNT16.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(0x10);
+}
+
+//-----------------------------------------------------------------------------
+// Initialize the timebase of loconet_timestamp
+void loconet_init_timebase(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_id, uint32_t nvic_irqn)
+{
+  // Save timer
+  loconet_timebase_timer = timer;
+  loconet_init_timer(timer, pm_tmr_mask, gclock_tmr_id);
+
+  // Interrupt on overflow, to extend the timebase to 32 bits
+  timer->COUNT16.INTENSET.reg = TC_INTENSET_OVF;
+  NVIC_EnableIRQ(nvic_irqn);
+
+  // Start the timer, it keeps running
+  timer->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+}
+
+//-----------------------------------------------------------------------------
+// Initialize flank timer, the free running counter is the timebase as well
+void loconet_init_flank_timer(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_id, uint32_t nvic_irqn)
+{
+  // Save timer, interrupt on match is enabled for each delay
+  loconet_flank_timer = timer;
+  loconet_init_timebase(timer, pm_tmr_mask, gclock_tmr_id, nvic_irqn);
+
+  // Start the flank rise at least once
+  loconet_irq_flank_rise();
+}
+
+//-----------------------------------------------------------------------------
+// Initialize flank detection through the event system. Flanks do not
+// interrupt, the event restarts the flank timer. Only the first flank
+// after a delay expired interrupts, to start over with carrier detect.
+void loconet_init_flank_events(uint8_t fl_int, uint8_t channel, uint8_t generator, uint8_t user)
+{
+  loconet_flank_events = 0x01ul << fl_int;
+
+  // Enable clock for the event system
+  PM->APBCMASK.reg |= PM_APBCMASK_EVSYS;
+
+  // Route the flanks to the flank timer, asynchronous so no clock is needed
+  EVSYS->USER.reg = EVSYS_USER_USER(user) | EVSYS_USER_CHANNEL(channel + 1);
+  EVSYS->CHANNEL.reg =
+    EVSYS_CHANNEL_CHANNEL(channel)
+    | EVSYS_CHANNEL_EVGEN(generator)
+    | EVSYS_CHANNEL_PATH_ASYNCHRONOUS;
+
+  // Generate an event on each flank, before the EIC is enabled
+  EIC->EVCTRL.reg |= EIC_EVCTRL_EXTINTEO(loconet_flank_events);
+  loconet_init_flank_detection(fl_int);
+  EIC->INTENCLR.reg = loconet_flank_events;
+}
+
+//-----------------------------------------------------------------------------
+// Initialize flank timer for flank detection through the event system.
+// The flanks restart the counter, so a separate timer is the timebase.
+void loconet_init_flank_timer_events(Tc *timer, uint32_t pm_tmr_mask, uint32_t gclock_tmr_id, uint32_t nvic_irqn)
+{
+  // Save timer
+  loconet_flank_timer = timer;
+  loconet_init_timer(timer, pm_tmr_mask, gclock_tmr_id);
+
+  // Restart the counter on each flank
+  timer->COUNT16.EVCTRL.reg = TC_EVCTRL_TCEI | TC_EVCTRL_EVACT_RETRIGGER;
+
   /* INTERRUPTS:
-   *   Interrupt on match
+   *   Match 1 is the line break delay after the last flank
+   *   Interrupt on match 0 is enabled for each delay
    */
-  loconet_flank_timer->COUNT16.INTENSET.reg = TC_INTENSET_MC(1);
+  timer->COUNT16.CC[1].reg = LOCONET_DELAY_LINE_BREAK;
+  timer->COUNT16.INTENSET.reg = TC_INTENSET_MC(2);
   NVIC_EnableIRQ(nvic_irqn);
 
+  timer->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+
   // Start the flank rise at least once
   loconet_irq_flank_rise();
 }
@@ -174,25 +255,67 @@ typedef union {
 #define LOCONET_TIMER_STATUS_PRIORITY_DELAY_Pos 3
 #define LOCONET_TIMER_STATUS_PRIORITY_DELAY (0x01ul << LOCONET_TIMER_STATUS_PRIORITY_DELAY_Pos)
 
-#define LOCONET_DELAY_CARRIER_DETECT 1200 /* 20x bit time (60ux) */
-#define LOCONET_DELAY_MASTER_DELAY    360 /*  6x bit time (60us) */
-#define LOCONET_DELAY_LINE_BREAK      900 /* 15x bit time (60us) */
-#define LOCONET_DELAY_PRIORITY_DELAY   60 /*  1x bit time (60ux) */
-
 static LOCONET_TIMER_STATUS_Type loconet_timer_status = { 0 };
 
+// Upper 16 bits of the timebase, counts overflows of the flank timer
+static volatile uint16_t loconet_timestamp_high = 0;
+
+// No flank for the carrier detect delay, and the start of the busy period
+// if there was one
+static uint8_t loconet_line_quiet = 1;
+static uint32_t loconet_line_busy_since = 0;
+
+//-----------------------------------------------------------------------------
+static RAMFUNC void loconet_flank_timer_delay(uint16_t delay_us) {
+  // Set timer match relative to the free running counter
+  loconet_flank_timer->COUNT16.CC[0].reg = loconet_flank_timer->COUNT16.COUNT.reg + delay_us;
+  // Drop a match of a previous delay and enable the match interrupt
+  loconet_flank_timer->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(1);
+  loconet_flank_timer->COUNT16.INTENSET.reg = TC_INTENSET_MC(1);
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC void loconet_irq_timer_overflow(void) {
+  loconet_timestamp_high++;
+}
+
+//-----------------------------------------------------------------------------
+// Microseconds since loconet_init, wraps after about 71 minutes
+RAMFUNC uint32_t loconet_timestamp(void)
+{
+  cpu_irq_enter_critical();
+  uint16_t high = loconet_timestamp_high;
+  uint16_t low = loconet_timebase_timer->COUNT16.COUNT.reg;
+  // The counter wrapped but the overflow interrupt did not run yet
+  if (loconet_timebase_timer->COUNT16.INTFLAG.bit.OVF && low < 0x8000) {
+    high++;
+  }
+  cpu_irq_leave_critical();
+  return ((uint32_t)high << 16) | low;
+}
+
+//-----------------------------------------------------------------------------
+// Interrupt on the next flank, if flanks are routed through the event system
+static RAMFUNC void loconet_flank_listen(void) {
+  if (loconet_flank_events) {
+    // Drop flanks seen while the timer followed them
+    EIC->INTFLAG.reg = loconet_flank_events;
+    EIC->INTENSET.reg = loconet_flank_events;
+  }
+}
+
 //-----------------------------------------------------------------------------
-static void loconet_flank_timer_delay(uint16_t delay_us) {
-  // Set timer counter to 0
-  loconet_flank_timer->COUNT16.COUNT.reg = 0;
-  // Set timer match, 1200us
-  loconet_flank_timer->COUNT16.CC[0].reg = delay_us;
-  // Enable timer
-  loconet_flank_timer->COUNT16.CTRLA.reg |= TC_CTRLA_ENABLE;
+// First flank after the line was quiet
+static RAMFUNC void loconet_line_busy(void) {
+  if (loconet_line_quiet) {
+    loconet_line_quiet = 0;
+    loconet_line_busy_since = loconet_timestamp();
+  }
 }
 
 //-----------------------------------------------------------------------------
-void loconet_irq_flank_rise(void) {
+RAMFUNC void loconet_irq_flank_rise(void) {
+  loconet_line_busy();
   loconet_flank_timer_delay(LOCONET_DELAY_CARRIER_DETECT);
   loconet_timer_status.reg = LOCONET_TIMER_STATUS_CARRIER_DETECT;
   // If flank changes, loconet is not idle anymore
@@ -200,7 +323,8 @@ void loconet_irq_flank_rise(void) {
 }
 
 //-----------------------------------------------------------------------------
-void loconet_irq_flank_fall(void) {
+RAMFUNC void loconet_irq_flank_fall(void) {
+  loconet_line_busy();
   loconet_flank_timer_delay(LOCONET_DELAY_LINE_BREAK);
   loconet_timer_status.reg = LOCONET_TIMER_STATUS_LINE_BREAK;
   // If flank changes, loconet is not idle anymore
@@ -208,9 +332,38 @@ void loconet_irq_flank_fall(void) {
 }
 
 //-----------------------------------------------------------------------------
-void loconet_irq_timer(void) {
+// First flank after a delay expired, with flanks routed through the event
+// system. The event restarted the counter, start over with carrier detect.
+// A line break is detected by loconet_irq_flank_break.
+RAMFUNC void loconet_irq_flank_event(void) {
+  EIC->INTENCLR.reg = loconet_flank_events;
+  loconet_irq_flank_rise();
+}
+
+//-----------------------------------------------------------------------------
+// Line low for the line break delay, with flanks routed through the event
+// system
+RAMFUNC void loconet_irq_flank_break(void) {
+  loconet_flank_timer->COUNT16.INTENCLR.reg = TC_INTENCLR_MC(1);
+  loconet_timer_status.reg = LOCONET_TIMER_STATUS_LINE_BREAK;
+  loconet_status.bit.IDLE = 0;
+  loconet_irq_timer();
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC void loconet_irq_timer(void) {
   // Carrier detect?
   if (loconet_timer_status.bit.CARRIER_DETECT) {
+    // Flanks should interrupt again to restart carrier detect
+    loconet_flank_listen();
+    // The line is in use up to the carrier detect delay ago. With flanks
+    // routed through the event system, the timer started before the
+    // busy period was stamped.
+    uint32_t busy = loconet_timestamp() - loconet_line_busy_since;
+    if (busy > LOCONET_DELAY_CARRIER_DETECT) {
+      loconet_stats.busy += busy - LOCONET_DELAY_CARRIER_DETECT;
+    }
+    loconet_line_quiet = 1;
     if (loconet_config.bit.MASTER) {
       // Master, set as idle directly
       loconet_status.reg |= LOCONET_STATUS_IDLE;
@@ -220,9 +373,11 @@ void loconet_irq_timer(void) {
       loconet_timer_status.reg = LOCONET_TIMER_STATUS_MASTER_DELAY;
     }
   } else if (loconet_timer_status.bit.MASTER_DELAY) {
-    if (loconet_config.bit.PRIORITY) {
+    // Back off extra slots after a collision
+    uint8_t slots = loconet_config.bit.PRIORITY + loconet_tx_backoff();
+    if (slots) {
       // Start priority delay
-      loconet_flank_timer_delay(loconet_config.bit.PRIORITY * LOCONET_DELAY_PRIORITY_DELAY);
+      loconet_flank_timer_delay(slots * LOCONET_DELAY_PRIORITY_DELAY);
       loconet_timer_status.reg = LOCONET_TIMER_STATUS_PRIORITY_DELAY;
     } else {
       loconet_status.reg |= LOCONET_STATUS_IDLE;
@@ -230,6 +385,8 @@ void loconet_irq_timer(void) {
   } else if (loconet_timer_status.bit.PRIORITY_DELAY) {
     loconet_status.reg |= LOCONET_STATUS_IDLE;
   } else if (loconet_timer_status.bit.LINE_BREAK) {
+    // The line goes up again after the break
+    loconet_flank_listen();
     // Remove collision detected flag
     loconet_status.bit.COLLISION_DETECTED = 0;
     // Release TX pin
@@ -239,10 +396,11 @@ void loconet_irq_timer(void) {
   }
 }
 
-static void loconet_irq_collision(void)
+static RAMFUNC void loconet_irq_collision(void)
 {
   // Set collision detected flag
   loconet_status.bit.COLLISION_DETECTED = 1;
+  loconet_stats.collision++;
   // Stop receiving and sending
   loconet_sercom->USART.CTRLB.bit.RXEN = 0;
   loconet_sercom->USART.CTRLB.bit.TXEN = 0;
@@ -252,14 +410,14 @@ static void loconet_irq_collision(void)
     loconet_status.bit.TRANSMIT = 0;
     // Pull Tx pin low
     loconet_tx_port->OUTSET.reg |= loconet_tx_pin;
-    // Reset message to queue
+    // Reset message to queue, or drop it after too many retries
     loconet_tx_reset_current_message_to_queue();
   }
 }
 
 //-----------------------------------------------------------------------------
 // Handle sercom (usart) interrupt
-void loconet_irq_sercom(void)
+RAMFUNC void loconet_irq_sercom(void)
 {
   // Rx complete
   if (loconet_sercom->USART.INTFLAG.bit.RXC) {
@@ -272,6 +430,7 @@ void loconet_irq_sercom(void)
       // Reset flag
       loconet_sercom->USART.STATUS.reg |= SERCOM_USART_STATUS_FERR;
       // Framing error -> Collision detected
+      loconet_stats.framing_error++;
       loconet_irq_collision();
     } else if (loconet_status.bit.TRANSMIT) {
       // Read own bytes to see if we have a collision
@@ -304,9 +463,8 @@ void loconet_irq_sercom(void)
     } else if (loconet_status.bit.TRANSMIT) {
       // Do we have a message and do we have another byte to send?
       if (loconet_tx_finished()) {
-        // Disable TRANSMIT
-        loconet_status.bit.TRANSMIT = 0;
-        // Disable Data Register Empty interrupt
+        // TRANSMIT stays set until TXC, the echo of the last byte is still
+        // to be received and compared. Disable Data Register Empty interrupt
         loconet_sercom->USART.INTENCLR.reg = SERCOM_USART_INTENCLR_DRE;
       } else {
         loconet_sercom->USART.DATA.reg = loconet_tx_next_tx_byte();
@@ -317,7 +475,7 @@ void loconet_irq_sercom(void)
 
 //-----------------------------------------------------------------------------
 // Calculate the checksum of a message
-uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length)
+RAMFUNC uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length)
 {
   uint8_t checksum = 0xFF;
   while (length--) {
@@ -342,4 +500,6 @@ void loconet_loop(void)
   while(loconet_rx_process());
   // Send a message if there is one available
   loconet_tx_process();
+  // Resend or time out requests without a reply
+  loconet_transaction_process();
 }
@@ -30,8 +30,18 @@
  * The data is sent LSB first. Bytes can be sent back-to-back.
  *
  * Flank detection is used to start the delays for carrier detect
- * and break detect. The current code assumes the chip to run with
- * F_CPU 8 MHz.
+ * and break detect. The timers count microseconds at any F_CPU
+ * supported by utils/clock.h, the bit rate is derived from F_CPU.
+ *
+ * With `LOCONET_BUILD_EVSYS` the flanks are routed through the event
+ * system to restart the flank timer, so they do not interrupt. It takes
+ * two more parameters:
+ * - ev_ch:   the event channel to use (e.g. 0)
+ * - tb_tmr:  the TIMER used for the timebase of loconet_timestamp
+ * The event restarts (RETRIGGER) the flank timer at every flank, so it
+ * no longer runs freely and cannot count the timebase. This variant
+ * therefore takes a second TC, tb_tmr, which is not available to the
+ * application. Without EVSYS the flank timer is the timebase as well.
  *
  * Before you can use the logger functions, initialize the logger
  * using `logger_init(baudrate);`.
@@ -70,11 +80,24 @@
 #include "hal_gpio.h"
 #include "loconet_rx.h"
 #include "loconet_tx.h"
+#include "loconet_transaction.h"
+#include "utils/clock.h"
+#include "utils/profile.h"
+#include "utils/ramfunc.h"
 
 //-----------------------------------------------------------------------------
-// Give a warning if F_CPU is not 8MHz
-#if F_CPU != 8000000
-#warn "F_CPU is not 8000000, CD and BREAK timer wont work as expected!"
+// Bit rate of 16.66 KBaud (60 us per bit), the USART runs at F_CPU with
+// 16 times oversampling
+#define LOCONET_BAUD 16666
+#define LOCONET_BAUD_VALUE (65536ull * (F_CPU - 16ull * LOCONET_BAUD) / F_CPU)
+// Bit rate that F_CPU and the BAUD register value give
+#define LOCONET_BAUD_ACTUAL (F_CPU * (65536ull - LOCONET_BAUD_VALUE) / (16 * 65536ull))
+
+#if F_CPU < 16 * LOCONET_BAUD
+#error "F_CPU is too low for the Loconet bit rate"
+#endif
+#if LOCONET_BAUD_ACTUAL * 1000 < LOCONET_BAUD * 985ull || LOCONET_BAUD_ACTUAL * 1000 > LOCONET_BAUD * 1015ull
+#error "F_CPU cannot give the Loconet bit rate within 1.5%"
 #endif
 
 //-----------------------------------------------------------------------------
@@ -83,9 +106,13 @@ typedef union {
     uint16_t ADDRESS:10;
     uint8_t  MASTER:1;
     uint8_t  PRIORITY:4;
-    uint8_t  :1;
+    uint8_t  COALESCE:1;
+    uint8_t  RETRY_LIMIT:4;
+    uint8_t  BACKOFF:4;
+    uint8_t  LOOPBACK:1;
+    uint8_t  :7;
   } bit;
-  uint16_t reg;
+  uint32_t reg;
 } LOCONET_CONFIG_Type;
 
 #define LOCONET_CONFIG_ADDRESS_Pos 0
@@ -96,6 +123,16 @@ typedef union {
 #define LOCONET_CONFIG_PRIORITY_Pos 11
 #define LOCONET_CONFIG_PRIORITY_Mask (0x3FFul << LOCONET_CONFIG_PRIORITY_Pos)
 #define LOCONET_CONFIG_PRIORITY(value) (LOCONET_CONFIG_ADDRESS_Mask & ((value) << LOCONET_CONFIG_PRIORITY_Pos))
+#define LOCONET_CONFIG_COALESCE_Pos 15
+#define LOCONET_CONFIG_COALESCE (0x01ul << LOCONET_CONFIG_COALESCE_Pos)
+#define LOCONET_CONFIG_RETRY_LIMIT_Pos 16
+#define LOCONET_CONFIG_RETRY_LIMIT_Mask (0x0Ful << LOCONET_CONFIG_RETRY_LIMIT_Pos)
+#define LOCONET_CONFIG_RETRY_LIMIT(value) (LOCONET_CONFIG_RETRY_LIMIT_Mask & ((value) << LOCONET_CONFIG_RETRY_LIMIT_Pos))
+#define LOCONET_CONFIG_BACKOFF_Pos 20
+#define LOCONET_CONFIG_BACKOFF_Mask (0x0Ful << LOCONET_CONFIG_BACKOFF_Pos)
+#define LOCONET_CONFIG_BACKOFF(value) (LOCONET_CONFIG_BACKOFF_Mask & ((value) << LOCONET_CONFIG_BACKOFF_Pos))
+#define LOCONET_CONFIG_LOOPBACK_Pos 24
+#define LOCONET_CONFIG_LOOPBACK (0x01ul << LOCONET_CONFIG_LOOPBACK_Pos)
 
 extern LOCONET_CONFIG_Type loconet_config;
 
@@ -117,6 +154,17 @@ typedef union {
 #define LOCONET_STATUS_COLLISION_DETECT_Pos 2
 #define LOCONET_STATUS_COLLISION_DETECT (0x01ul << LOCONET_STATUS_COLLISION_DETECT_Pos)
 
+//-----------------------------------------------------------------------------
+// Counters of the line, they wrap
+typedef struct {
+  uint16_t framing_error;   // Bytes received with a framing error
+  uint16_t collision;       // Collisions detected
+  uint32_t busy;            // Time the line was in use in us, up to the
+                            // last carrier detect
+} LOCONET_STATS_Type;
+
+extern LOCONET_STATS_Type loconet_stats;
+
 extern LOCONET_STATUS_Type loconet_status;
 
 //-----------------------------------------------------------------------------
@@ -125,18 +173,26 @@ extern void loconet_init(void);
 extern void loconet_init_usart(Sercom*, uint32_t, uint32_t, uint8_t, uint32_t);
 extern void loconet_init_flank_detection(uint8_t);
 extern void loconet_init_flank_timer(Tc*, uint32_t, uint32_t, uint32_t);
+extern void loconet_init_timebase(Tc*, uint32_t, uint32_t, uint32_t);
+extern void loconet_init_flank_events(uint8_t, uint8_t, uint8_t, uint8_t);
+extern void loconet_init_flank_timer_events(Tc*, uint32_t, uint32_t, uint32_t);
 extern void loconet_save_tx_pin(PortGroup*, uint32_t);
 
 //-----------------------------------------------------------------------------
 // IRQs for flank rise / fall
-extern void loconet_irq_flank_rise(void);
-extern void loconet_irq_flank_fall(void);
+extern RAMFUNC void loconet_irq_flank_rise(void);
+extern RAMFUNC void loconet_irq_flank_fall(void);
+// IRQs for flanks routed through the event system
+extern RAMFUNC void loconet_irq_flank_event(void);
+extern RAMFUNC void loconet_irq_flank_break(void);
 // IRQ for timeout of timer
-extern void loconet_irq_timer(void);
+extern RAMFUNC void loconet_irq_timer(void);
+// IRQ for overflow of timer
+extern RAMFUNC void loconet_irq_timer_overflow(void);
 // IRQ for sercom
-extern void loconet_irq_sercom(void);
+extern RAMFUNC void loconet_irq_sercom(void);
 
-extern uint8_t loconet_handle_eic(void);
+extern RAMFUNC uint8_t loconet_handle_eic(void);
 
 //-----------------------------------------------------------------------------
 // Loconet loop to be used in the main loop
@@ -145,16 +201,34 @@ extern void loconet_loop(void);
 
 extern void loconet_sercom_enable_dre_irq(void);
 
+//-----------------------------------------------------------------------------
+// Free running timebase in microseconds, based on the flank timer, or on
+// timer tb_tmr with LOCONET_BUILD_EVSYS
+extern RAMFUNC uint32_t loconet_timestamp(void);
+
 //-----------------------------------------------------------------------------
 // Calculate checksum of a message
-extern uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length);
+extern RAMFUNC uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length);
 
-// Macro for loconet_init and irq_handler_sercom<nr>
+// Macro for loconet_init and irq_handler_sercom<nr>, each flank interrupts
 #define LOCONET_BUILD(sercom, tx_port, tx_pin, rx_port, rx_pin, rx_pad, fl_port, fl_pin, fl_int, fl_tmr) \
+  LOCONET_BUILD_BASE(sercom, tx_port, tx_pin, rx_port, rx_pin, rx_pad, fl_port, fl_pin) \
+  LOCONET_BUILD_FLANK_IRQ(fl_int, fl_tmr)
+
+// Macro for loconet_init and irq_handler_sercom<nr>, flanks are routed
+// through event channel ev_ch to the flank timer. The flanks restart the
+// flank timer, so a second timer, tb_tmr, is taken for the timebase.
+#define LOCONET_BUILD_EVSYS(sercom, tx_port, tx_pin, rx_port, rx_pin, rx_pad, fl_port, fl_pin, fl_int, fl_tmr, ev_ch, tb_tmr) \
+  LOCONET_BUILD_BASE(sercom, tx_port, tx_pin, rx_port, rx_pin, rx_pad, fl_port, fl_pin) \
+  LOCONET_BUILD_FLANK_EVSYS(fl_int, fl_tmr, ev_ch, tb_tmr)
+
+//-----------------------------------------------------------------------------
+#define LOCONET_BUILD_BASE(sercom, tx_port, tx_pin, rx_port, rx_pin, rx_pad, fl_port, fl_pin) \
   HAL_GPIO_PIN(LOCONET_TX, tx_port, tx_pin);                                  \
   HAL_GPIO_PIN(LOCONET_RX, rx_port, rx_pin);                                  \
   HAL_GPIO_PIN(LOCONET_FL, fl_port, fl_pin);                                  \
                                                                               \
+  static void loconet_init_flank(void);                                       \
   void loconet_init()                                                         \
   {                                                                           \
     /* Set Tx pin as output */                                                \
@@ -176,6 +250,27 @@ extern uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length);
       rx_pad,                                                                 \
       SERCOM##sercom##_IRQn                                                   \
     );                                                                        \
+    /* Initialize flank detection and flank timer */                          \
+    loconet_init_flank();                                                     \
+    /* Save tx pin */                                                         \
+    loconet_save_tx_pin(                                                      \
+      &PORT->Group[HAL_GPIO_PORT##tx_port],                                   \
+      tx_pin                                                                  \
+    );                                                                        \
+  }                                                                           \
+  /* Handle received bytes */                                                 \
+  RAMFUNC void irq_handler_sercom##sercom(void);                              \
+  RAMFUNC void irq_handler_sercom##sercom(void)                               \
+  {                                                                           \
+    PROFILE_BEGIN(IRQ_LOCONET_USART);                                         \
+    loconet_irq_sercom();                                                     \
+    PROFILE_END(IRQ_LOCONET_USART);                                           \
+  }                                                                           \
+
+//-----------------------------------------------------------------------------
+#define LOCONET_BUILD_FLANK_IRQ(fl_int, fl_tmr)                               \
+  static void loconet_init_flank(void)                                        \
+  {                                                                           \
     /* Initialize flank detection */                                          \
     loconet_init_flank_detection(                                             \
       fl_int                                                                  \
@@ -187,13 +282,8 @@ extern uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length);
       TC##fl_tmr##_GCLK_ID,                                                   \
       TC##fl_tmr##_IRQn                                                       \
     );                                                                        \
-    /* Save tx pin */                                                         \
-    loconet_save_tx_pin(                                                      \
-      &PORT->Group[HAL_GPIO_PORT##tx_port],                                   \
-      tx_pin                                                                  \
-    );                                                                        \
   }                                                                           \
-  uint8_t loconet_handle_eic(void) {                                          \
+  RAMFUNC uint8_t loconet_handle_eic(void) {                                  \
     /* Return if it's not our external pin to watch */                        \
     if (!EIC->INTFLAG.bit.EXTINT##fl_int) {                                   \
       return 0;                                                               \
@@ -209,20 +299,94 @@ extern uint8_t loconet_calc_checksum(uint8_t *data, uint8_t length);
     return 1;                                                                 \
   }                                                                           \
   /* Handle timer interrupt */                                                \
-  void irq_handler_tc##fl_tmr(void);                                          \
-  void irq_handler_tc##fl_tmr(void) {                                         \
-    /* Disable timer */                                                       \
-    TC##fl_tmr->COUNT16.CTRLA.bit.ENABLE = 0;                                 \
-    /* Reset clock interrupt flag */                                          \
-    TC##fl_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(1);                       \
-    /* Handle loconet timer */                                                \
-    loconet_irq_timer();                                                      \
+  RAMFUNC void irq_handler_tc##fl_tmr(void);                                  \
+  RAMFUNC void irq_handler_tc##fl_tmr(void) {                                 \
+    PROFILE_BEGIN(IRQ_LOCONET_TIMER);                                         \
+    /* Extend the timebase on overflow */                                     \
+    if (TC##fl_tmr->COUNT16.INTFLAG.bit.OVF) {                                \
+      TC##fl_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_OVF;                       \
+      loconet_irq_timer_overflow();                                           \
+    }                                                                         \
+    /* The timer keeps running, match only counts if enabled */               \
+    if (TC##fl_tmr->COUNT16.INTFLAG.reg & TC##fl_tmr->COUNT16.INTENSET.reg    \
+        & TC_INTFLAG_MC(1)) {                                                 \
+      /* Disable and reset match interrupt */                                 \
+      TC##fl_tmr->COUNT16.INTENCLR.reg = TC_INTENCLR_MC(1);                   \
+      TC##fl_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(1);                     \
+      /* Handle loconet timer */                                              \
+      loconet_irq_timer();                                                    \
+    }                                                                         \
+    PROFILE_END(IRQ_LOCONET_TIMER);                                           \
   }                                                                           \
-  /* Handle received bytes */                                                 \
-  void irq_handler_sercom##sercom(void);                                      \
-  void irq_handler_sercom##sercom(void)                                       \
+
+//-----------------------------------------------------------------------------
+#define LOCONET_BUILD_FLANK_EVSYS(fl_int, fl_tmr, ev_ch, tb_tmr)              \
+  static void loconet_init_flank(void)                                        \
   {                                                                           \
-    loconet_irq_sercom();                                                     \
+    /* Initialize flank detection, routed to the flank timer */               \
+    loconet_init_flank_events(                                                \
+      fl_int,                                                                 \
+      ev_ch,                                                                  \
+      EVSYS_ID_GEN_EIC_EXTINT_##fl_int,                                       \
+      EVSYS_ID_USER_TC##fl_tmr##_EVU                                          \
+    );                                                                        \
+    /* Initialize timebase */                                                 \
+    loconet_init_timebase(                                                    \
+      TC##tb_tmr,                                                             \
+      PM_APBCMASK_TC##tb_tmr,                                                 \
+      TC##tb_tmr##_GCLK_ID,                                                   \
+      TC##tb_tmr##_IRQn                                                       \
+    );                                                                        \
+    /* Initialize flank timer */                                              \
+    loconet_init_flank_timer_events(                                          \
+      TC##fl_tmr,                                                             \
+      PM_APBCMASK_TC##fl_tmr,                                                 \
+      TC##fl_tmr##_GCLK_ID,                                                   \
+      TC##fl_tmr##_IRQn                                                       \
+    );                                                                        \
+  }                                                                           \
+  RAMFUNC uint8_t loconet_handle_eic(void) {                                  \
+    /* Flanks set the flag, they only count while the interrupt is enabled */ \
+    if (!(EIC->INTFLAG.reg & EIC->INTENSET.reg & EIC_INTFLAG_EXTINT##fl_int)) { \
+      return 0;                                                               \
+    }                                                                         \
+    /* Reset flag */                                                          \
+    EIC->INTFLAG.reg = EIC_INTFLAG_EXTINT##fl_int;                            \
+    loconet_irq_flank_event();                                                \
+    return 1;                                                                 \
+  }                                                                           \
+  /* Handle timer interrupt */                                                \
+  RAMFUNC void irq_handler_tc##fl_tmr(void);                                  \
+  RAMFUNC void irq_handler_tc##fl_tmr(void) {                                 \
+    PROFILE_BEGIN(IRQ_LOCONET_TIMER);                                         \
+    /* Match 0 only counts if enabled */                                      \
+    if (TC##fl_tmr->COUNT16.INTFLAG.reg & TC##fl_tmr->COUNT16.INTENSET.reg    \
+        & TC_INTFLAG_MC(1)) {                                                 \
+      /* Disable and reset match interrupt */                                 \
+      TC##fl_tmr->COUNT16.INTENCLR.reg = TC_INTENCLR_MC(1);                   \
+      TC##fl_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(1);                     \
+      /* Handle loconet timer */                                              \
+      loconet_irq_timer();                                                    \
+    }                                                                         \
+    /* Match 1: no flank for the line break delay, a break if the line is low */ \
+    if (TC##fl_tmr->COUNT16.INTFLAG.reg & TC_INTFLAG_MC(2)) {                 \
+      TC##fl_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_MC(2);                     \
+      if (!HAL_GPIO_LOCONET_FL_read()) {                                      \
+        loconet_irq_flank_break();                                            \
+      }                                                                       \
+    }                                                                         \
+    PROFILE_END(IRQ_LOCONET_TIMER);                                           \
+  }                                                                           \
+  /* Handle timebase interrupt */                                             \
+  RAMFUNC void irq_handler_tc##tb_tmr(void);                                  \
+  RAMFUNC void irq_handler_tc##tb_tmr(void) {                                 \
+    PROFILE_BEGIN(IRQ_LOCONET_BASE);                                          \
+    /* Extend the timebase on overflow */                                     \
+    if (TC##tb_tmr->COUNT16.INTFLAG.bit.OVF) {                                \
+      TC##tb_tmr->COUNT16.INTFLAG.reg = TC_INTFLAG_OVF;                       \
+      loconet_irq_timer_overflow();                                           \
+    }                                                                         \
+    PROFILE_END(IRQ_LOCONET_BASE);                                            \
   }                                                                           \
 
 #endif // _LOCONET_LOCONET_H_
@@ -14,6 +14,12 @@
 uint16_t lncv_address;
 bool loconet_cv_programming;
 
+// Last sample of the line utilization
+static uint32_t loconet_cv_stats_time = 0;
+static uint32_t loconet_cv_stats_busy = 0;
+static uint16_t loconet_cv_stats_busy_ms = 0;
+static uint16_t loconet_cv_stats_idle_ms = 0;
+
 //-----------------------------------------------------------------------------
 void loconet_cv_prog_off_event_dummy(void);
 void loconet_cv_prog_off_event_dummy(void)
@@ -46,13 +52,74 @@ void loconet_cv_written_event_dummy(uint16_t lncv_number, uint16_t value)
 __attribute__ ((weak, alias ("loconet_cv_written_event_dummy"))) \
   void loconet_cv_written_event(uint16_t, uint16_t);
 
+//-----------------------------------------------------------------------------
+static inline bool loconet_cv_is_stats(uint16_t lncv_number)
+{
+  return lncv_number >= LOCONET_CV_STATS_START && lncv_number < LOCONET_CV_STATS_START + LOCONET_CV_STATS_Size;
+}
+
+//-----------------------------------------------------------------------------
+// Utilization of the line since the previous sample, in 0.1%
+static uint16_t loconet_cv_stats_sample(void)
+{
+  uint32_t now = loconet_timestamp();
+  uint32_t busy = loconet_stats.busy;
+  uint32_t total_ms = (now - loconet_cv_stats_time) / 1000;
+  uint32_t busy_ms = (busy - loconet_cv_stats_busy) / 1000;
+  loconet_cv_stats_time = now;
+  loconet_cv_stats_busy = busy;
+
+  // The busy time is counted up to the last carrier detect
+  if (busy_ms > total_ms) {
+    busy_ms = total_ms;
+  }
+  loconet_cv_stats_busy_ms = busy_ms > 0xFFFF ? 0xFFFF : busy_ms;
+  loconet_cv_stats_idle_ms = total_ms - busy_ms > 0xFFFF ? 0xFFFF : total_ms - busy_ms;
+  return total_ms ? busy_ms * 1000 / total_ms : 0;
+}
+
+//-----------------------------------------------------------------------------
+static uint16_t loconet_cv_stats_get(uint16_t index)
+{
+  switch (index) {
+    case LOCONET_CV_STATS_RECEIVED:
+      return loconet_rx_stats.received;
+    case LOCONET_CV_STATS_BAD_CHECKSUM:
+      return loconet_rx_stats.bad_checksum;
+    case LOCONET_CV_STATS_SKIPPED:
+      return loconet_rx_stats.skipped;
+    case LOCONET_CV_STATS_FRAMING:
+      return loconet_stats.framing_error;
+    case LOCONET_CV_STATS_COLLISION:
+      return loconet_stats.collision;
+    case LOCONET_CV_STATS_RETRIED:
+      return loconet_tx_stats.retried;
+    case LOCONET_CV_STATS_DROPPED:
+      return loconet_tx_stats.dropped;
+    case LOCONET_CV_STATS_OVERFLOW:
+      return loconet_rx_stats.overflow;
+    case LOCONET_CV_STATS_QUEUE_HIGH:
+      return loconet_tx_stats.queue_high_water;
+    case LOCONET_CV_STATS_UTILIZATION:
+      return loconet_cv_stats_sample();
+    case LOCONET_CV_STATS_BUSY:
+      return loconet_cv_stats_busy_ms;
+    case LOCONET_CV_STATS_IDLE:
+      return loconet_cv_stats_idle_ms;
+  }
+  return 0xFFFF;
+}
+
 //-----------------------------------------------------------------------------
 static void loconet_cv_response(LOCONET_CV_MSG_Type *msg)
 {
-  uint8_t resp_data[13];
-  resp_data[0] = 15; // Length
+  // Build the response in place in the transmit queue
+  uint8_t *resp_data = loconet_tx_reserve(sizeof(LOCONET_CV_MSG_Type));
+  if (!resp_data) {
+    return;
+  }
 
-  LOCONET_CV_MSG_Type *resp = (LOCONET_CV_MSG_Type*)&resp_data[1];
+  LOCONET_CV_MSG_Type *resp = (LOCONET_CV_MSG_Type*)resp_data;
   resp->source = LOCONET_CV_SRC_MODULE;
   switch (msg->source) {
     case LOCONET_CV_SRC_KPU:
@@ -70,14 +137,14 @@ static void loconet_cv_response(LOCONET_CV_MSG_Type *msg)
   // Calculate Most Significant Bits
   resp->most_significant_bits = 0;
   for (uint8_t index = 0; index < 7; index++) {
-    if (resp_data[6+index] & 0x80) {
+    if (resp_data[5+index] & 0x80) {
       resp->most_significant_bits |= 0x01 << index;
-      resp_data[6+index] &= 0x7F;
+      resp_data[5+index] &= 0x7F;
     }
   }
 
   // Send message
-  loconet_tx_queue_n(0xE5, 1, resp_data, 13);
+  loconet_tx_commit(resp_data, 0xE5, 1);
 }
 
 //-----------------------------------------------------------------------------
@@ -105,7 +172,7 @@ static void loconet_cv_prog_off(LOCONET_CV_MSG_Type *msg)
 //-----------------------------------------------------------------------------
 static void loconet_cv_prog_read(LOCONET_CV_MSG_Type *msg, uint8_t opcode)
 {
-  if (msg->lncv_number >= LOCONET_CV_NUMBERS) {
+  if (msg->lncv_number >= LOCONET_CV_NUMBERS && !loconet_cv_is_stats(msg->lncv_number)) {
     loconet_tx_long_ack(opcode, LOCONET_CV_ACK_ERROR_OUTOFRANGE);
     return;
   }
@@ -144,6 +211,9 @@ void loconet_cv_process(LOCONET_CV_MSG_Type *msg, uint8_t opcode)
 //-----------------------------------------------------------------------------
 uint16_t loconet_cv_get(uint16_t lncv_number)
 {
+  if (loconet_cv_is_stats(lncv_number)) {
+    return loconet_cv_stats_get(lncv_number - LOCONET_CV_STATS_START);
+  }
   if (lncv_number >= LOCONET_CV_NUMBERS) {
     return 0xFFFF;
   }
@@ -158,16 +228,81 @@ uint16_t loconet_cv_get(uint16_t lncv_number)
     return LOCONET_CV_INITIAL_ADDRESS;
   } else if (lncv_number == 2 && page_data[1] != LOCONET_CV_DEVICE_CLASS) {
     return LOCONET_CV_INITIAL_PRIORITY;
+  } else if (lncv_number == 3 && page_data[1] != LOCONET_CV_DEVICE_CLASS) {
+    return LOCONET_CV_INITIAL_RETRY_LIMIT;
+  } else if (lncv_number == 4 && page_data[1] != LOCONET_CV_DEVICE_CLASS) {
+    return LOCONET_CV_INITIAL_BACKOFF;
   } else {
     return page_data[lncv_number % LOCONET_CV_PER_PAGE];
   }
 }
 
+//-----------------------------------------------------------------------------
+// Bring the first page up to LOCONET_CV_VERSION, returns true if it changed.
+// Modules configured before the version was kept have 0 or an erased 0xFFFF
+// in its place, that is version 0.
+static bool loconet_cv_migrate(uint16_t *page_data)
+{
+  uint16_t version = page_data[LOCONET_CV_VERSION_LNCV];
+  if (version == 0xFFFF) {
+    version = 0;
+  }
+  if (version >= LOCONET_CV_VERSION) {
+    return false;
+  }
+
+  if (version < 1) {
+    page_data[3] = LOCONET_CV_INITIAL_RETRY_LIMIT;
+    page_data[4] = LOCONET_CV_INITIAL_BACKOFF;
+  }
+  page_data[LOCONET_CV_VERSION_LNCV] = LOCONET_CV_VERSION;
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+// Range of the LNCVs kept in loconet_config
+static uint8_t loconet_cv_config_allowed(uint16_t lncv_number, uint16_t value)
+{
+  switch (lncv_number) {
+    case 2:
+      // Priority, slots waited before sending
+      return (value <= 15) ? LOCONET_CV_ACK_OK : LOCONET_CV_ACK_ERROR_OUTOFRANGE;
+    case 3:
+      // Retry limit after a collision
+      return (value <= 15) ? LOCONET_CV_ACK_OK : LOCONET_CV_ACK_ERROR_OUTOFRANGE;
+    case 4:
+      // Backoff exponent after a collision
+      return (value <= LOCONET_TX_BACKOFF_MAX) ? LOCONET_CV_ACK_OK : LOCONET_CV_ACK_ERROR_OUTOFRANGE;
+    default:
+      return LOCONET_CV_ACK_OK;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Take a written LNCV into loconet_config
+static void loconet_cv_config_apply(uint16_t lncv_number, uint16_t value)
+{
+  switch (lncv_number) {
+    case 0:
+      loconet_config.bit.ADDRESS = value;
+      break;
+    case 2:
+      loconet_config.bit.PRIORITY = value;
+      break;
+    case 3:
+      loconet_config.bit.RETRY_LIMIT = value;
+      break;
+    case 4:
+      loconet_config.bit.BACKOFF = value;
+      break;
+  }
+}
+
 //-----------------------------------------------------------------------------
 uint8_t loconet_cv_set(uint16_t lncv_number, uint16_t lncv_value)
 {
-  // Do not allow to write to number 1
-  if (lncv_number == 1) {
+  // Do not allow to write to number 1, the version and the counters
+  if (lncv_number == 1 || lncv_number == LOCONET_CV_VERSION_LNCV || loconet_cv_is_stats(lncv_number)) {
     return LOCONET_CV_ACK_ERROR_READONLY;
   // Do not allow to write out of bounds
   } else if (lncv_number >= LOCONET_CV_NUMBERS) {
@@ -175,7 +310,10 @@ uint8_t loconet_cv_set(uint16_t lncv_number, uint16_t lncv_value)
   }
 
   // Is this write allowed?
-  uint8_t ack = loconet_cv_write_allowed(lncv_number, lncv_value);
+  uint8_t ack = loconet_cv_config_allowed(lncv_number, lncv_value);
+  if (ack == LOCONET_CV_ACK_OK) {
+    ack = loconet_cv_write_allowed(lncv_number, lncv_value);
+  }
 
   uint8_t page = lncv_number / LOCONET_CV_PER_PAGE;
   uint8_t index = lncv_number % LOCONET_CV_PER_PAGE;
@@ -187,6 +325,11 @@ uint8_t loconet_cv_set(uint16_t lncv_number, uint16_t lncv_value)
   if (ack == LOCONET_CV_ACK_OK && lncv_value != page_data[index]) {
     page_data[index] = lncv_value;
     if (lncv_number == 0) {
+      // The first configuration keeps the initial values of the others
+      if (page_data[1] != LOCONET_CV_DEVICE_CLASS) {
+        page_data[LOCONET_CV_VERSION_LNCV] = 0;
+        loconet_cv_migrate(page_data);
+      }
       // Set magic value to detect we have configured the address.
       page_data[1] = LOCONET_CV_DEVICE_CLASS;
       // Change lncv_address
@@ -194,6 +337,7 @@ uint8_t loconet_cv_set(uint16_t lncv_number, uint16_t lncv_value)
     }
     eeprom_emulator_write_page(page, (uint8_t *)page_data);
     eeprom_emulator_commit_page_buffer();
+    loconet_cv_config_apply(lncv_number, lncv_value);
     loconet_cv_written_event(lncv_number, lncv_value);
   }
 
@@ -209,6 +353,14 @@ enum status_code loconet_cv_init(void)
     return STATUS_ERR_NOT_INITIALIZED;
   }
 
+  // LNCVs added since the module was configured get their initial value
+  uint16_t page_data[LOCONET_CV_PAGE_SIZE];
+  eeprom_emulator_read_page(0, (uint8_t *)page_data);
+  if (page_data[1] == LOCONET_CV_DEVICE_CLASS && loconet_cv_migrate(page_data)) {
+    eeprom_emulator_write_page(0, (uint8_t *)page_data);
+    eeprom_emulator_commit_page_buffer();
+  }
+
   // Get address from Eeprom
   lncv_address = loconet_cv_get(0);
 
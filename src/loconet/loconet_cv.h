@@ -26,6 +26,39 @@
 #define LOCONET_CV_DEVICE_CLASS     0x4BA // We listen to 1210
 #define LOCONET_CV_INITIAL_ADDRESS  0x03  // Initial address we listen to
 #define LOCONET_CV_INITIAL_PRIORITY 0x05  // Initial priority for sending
+#define LOCONET_CV_INITIAL_RETRY_LIMIT 0x08 // Initial retries after a collision
+#define LOCONET_CV_INITIAL_BACKOFF  0x04  // Initial backoff exponent
+
+// Version of the stored LNCVs, in read-only LNCV 5. A module configured by
+// an older version gets the initial value of the LNCVs added since then in
+// loconet_cv_init. Version 1 added LNCV 3 and 4.
+#define LOCONET_CV_VERSION_LNCV     5
+#define LOCONET_CV_VERSION          1
+
+// Read-only LNCVs with the counters of the Loconet layer, from
+// LOCONET_CV_STATS_START. Counters wrap at 65536.
+#ifndef LOCONET_CV_STATS_START
+#define LOCONET_CV_STATS_START      1000
+#endif
+#define LOCONET_CV_STATS_RECEIVED     0 // Messages received
+#define LOCONET_CV_STATS_BAD_CHECKSUM 1 // Messages with a wrong checksum
+#define LOCONET_CV_STATS_SKIPPED      2 // Data bytes outside of a message
+#define LOCONET_CV_STATS_FRAMING      3 // Framing errors
+#define LOCONET_CV_STATS_COLLISION    4 // Collisions
+#define LOCONET_CV_STATS_RETRIED      5 // Messages retried after a collision
+#define LOCONET_CV_STATS_DROPPED      6 // Messages dropped after collisions
+#define LOCONET_CV_STATS_OVERFLOW     7 // Messages lost to a full ringbuffer
+#define LOCONET_CV_STATS_QUEUE_HIGH   8 // Maximum number of queued messages
+// Reading the utilization starts a new sample, busy and idle are of the
+// sample taken by the last read of the utilization
+#define LOCONET_CV_STATS_UTILIZATION  9 // Line in use since previous sample, 0.1%
+#define LOCONET_CV_STATS_BUSY        10 // Line in use in the sample, ms
+#define LOCONET_CV_STATS_IDLE        11 // Line not in use in the sample, ms
+#define LOCONET_CV_STATS_Size        12
+
+#if LOCONET_CV_STATS_START < LOCONET_CV_NUMBERS
+#error "LOCONET_CV_STATS_START should be after the stored LNCVs"
+#endif
 
 #define LOCONET_CV_SRC_MASTER       0x00
 #define LOCONET_CV_SRC_KPU          0x01 // KPU is, e.g., an IntelliBox
@@ -21,32 +21,394 @@ void loconet_rx_dummy_n(uint8_t*, uint8_t);
 //-----------------------------------------------------------------------------
 // Define LOCONET_RX_RINGBUFFER_Size if it's not defined
 #ifndef LOCONET_RX_RINGBUFFER_Size
-#define LOCONET_RX_RINGBUFFER_Size 64
+#define LOCONET_RX_RINGBUFFER_Size 128
 #endif
 
+// Indexes wrap with a mask, the Cortex-M0+ has no divide instruction
+#if (LOCONET_RX_RINGBUFFER_Size & (LOCONET_RX_RINGBUFFER_Size - 1)) || LOCONET_RX_RINGBUFFER_Size > 256
+#error "LOCONET_RX_RINGBUFFER_Size should be a power of two, at most 256"
+#endif
+
+#define LOCONET_RX_RINGBUFFER_Mask (LOCONET_RX_RINGBUFFER_Size - 1)
+
+// Single producer (sercom interrupt), single consumer (main loop). The
+// interrupt assembles a message after the writer and only moves the writer
+// when the message is complete and its checksum is valid, so the reader
+// only sees complete messages.
+// Messages never wrap around the end of the buffer, so handlers get a
+// pointer into the buffer. A message which does not fit before the end
+// is placed at the start, a byte without the opcode flag is left where it
+// would have started to tell the reader to continue at the start.
+// Each message is followed by its receive timestamp.
+// As a message does not wrap, it has to fit before or after the reader.
+// Messages of up to LOCONET_RX_RINGBUFFER_Size / 2 - 4 bytes (60 bytes for
+// the default) always fit in an empty buffer, longer ones only if the
+// reader is close to the start or the end.
 typedef struct {
   uint8_t buffer[LOCONET_RX_RINGBUFFER_Size];
   volatile uint8_t writer;
   volatile uint8_t reader;
+  // Message being received
+  uint8_t pending;          // Index for the next byte of the message
+  uint8_t received;         // Bytes received, 0 if no message is started
+  uint8_t length;           // Expected bytes, 0 if the length is not known yet
+  uint8_t checksum;         // Running checksum, 0 for a valid message
+  uint32_t timestamp;       // Start of the message
 } LOCONET_RX_RINGBUFFER_Type;
 
-static LOCONET_RX_RINGBUFFER_Type loconet_rx_ringbuffer = { { 0 }, 0, 0};
+static LOCONET_RX_RINGBUFFER_Type loconet_rx_ringbuffer = { { 0 }, 0, 0, 0, 0, 0, 0, 0 };
+
+// Bytes of the timestamp after each message
+#define LOCONET_RX_TIMESTAMP_Size sizeof(uint32_t)
+
+// The opcode byte is received 9.5 bit times (60us) after its start bit
+#define LOCONET_RX_OPCODE_DELAY 570
+
+// Timestamp of the message being processed
+static uint32_t loconet_rx_message_timestamp = 0;
+
+LOCONET_RX_STATS_Type loconet_rx_stats = { 0 };
+
+//-----------------------------------------------------------------------------
+#if (LOCONET_RX_INTEREST_Size & (LOCONET_RX_INTEREST_Size - 1)) || LOCONET_RX_INTEREST_Size < 8 || LOCONET_RX_INTEREST_Size > 4096
+#error "LOCONET_RX_INTEREST_Size should be a power of two, between 8 and 4096"
+#endif
+
+typedef struct {
+  volatile uint8_t enabled;
+  volatile uint8_t subscribers;   // Subscriptions to opcodes of the space
+  volatile uint8_t replies;       // Transactions wait for a reply in the space
+  uint8_t bits[LOCONET_RX_INTEREST_Size / 8];
+} LOCONET_RX_INTEREST_Type;
+
+static LOCONET_RX_INTEREST_Type loconet_rx_interest[2];
+
+// Address space of the messages of an opcode
+static RAMFUNC uint8_t loconet_rx_interest_space(uint8_t opcode)
+{
+  switch (opcode) {
+    case 0xB2:
+      return LOCONET_RX_INTEREST_SENSOR;
+    case 0xB0:
+    case 0xB1:
+    case 0xBC:
+    case 0xBD:
+      return LOCONET_RX_INTEREST_SWITCH;
+  }
+  return LOCONET_RX_INTEREST_NONE;
+}
+
+//-----------------------------------------------------------------------------
+#if LOCONET_RX_SUBSCRIBER_Size > 15
+#error "LOCONET_RX_SUBSCRIBER_Size should be at most 15"
+#endif
+
+// Subscriptions of an opcode form a list. Links are 4 bits, index + 1 of
+// the next subscription or 0 at the end of the list.
+typedef struct {
+  LOCONET_RX_CALLBACK_Type callback;  // 0 if the subscription is free
+  void *context;
+  uint8_t opcode;
+  uint8_t mask;
+  uint8_t value;
+  uint8_t next;
+} LOCONET_RX_SUBSCRIBER_Type;
+
+static LOCONET_RX_SUBSCRIBER_Type loconet_rx_subscribers[LOCONET_RX_SUBSCRIBER_Size];
+
+// First subscription of each opcode, two opcodes per byte
+static uint8_t loconet_rx_subscriber_heads[64] = { 0 };
+
+//-----------------------------------------------------------------------------
+static uint8_t loconet_rx_subscriber_head(uint8_t opcode)
+{
+  uint8_t heads = loconet_rx_subscriber_heads[(opcode & 0x7F) >> 1];
+  return (opcode & 0x01) ? heads >> 4 : heads & 0x0F;
+}
+
+static void loconet_rx_subscriber_set_head(uint8_t opcode, uint8_t head)
+{
+  uint8_t *heads = &loconet_rx_subscriber_heads[(opcode & 0x7F) >> 1];
+  if (opcode & 0x01) {
+    *heads = (*heads & 0x0F) | (head << 4);
+  } else {
+    *heads = (*heads & 0xF0) | head;
+  }
+}
+
+//-----------------------------------------------------------------------------
+enum status_code loconet_rx_subscribe(uint8_t opcode, uint8_t mask, uint8_t value, LOCONET_RX_CALLBACK_Type callback, void *context)
+{
+  if (!(opcode & 0x80) || !callback) {
+    return STATUS_ERR_INVALID_ARG;
+  }
+
+  // Find a free subscription
+  uint8_t index = 0;
+  for (; index < LOCONET_RX_SUBSCRIBER_Size && loconet_rx_subscribers[index].callback; index++);
+  if (index == LOCONET_RX_SUBSCRIBER_Size) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+
+  LOCONET_RX_SUBSCRIBER_Type *subscriber = &loconet_rx_subscribers[index];
+  subscriber->callback = callback;
+  subscriber->context = context;
+  subscriber->opcode = opcode;
+  subscriber->mask = mask;
+  subscriber->value = value & mask;
+  subscriber->next = 0;
+
+  // Subscribers get every address, stop filtering
+  uint8_t space = loconet_rx_interest_space(opcode);
+  if (space != LOCONET_RX_INTEREST_NONE) {
+    loconet_rx_interest[space].subscribers++;
+  }
+
+  // Append to the list of the opcode
+  uint8_t link = loconet_rx_subscriber_head(opcode);
+  if (!link) {
+    loconet_rx_subscriber_set_head(opcode, index + 1);
+  } else {
+    while (loconet_rx_subscribers[link - 1].next) {
+      link = loconet_rx_subscribers[link - 1].next;
+    }
+    loconet_rx_subscribers[link - 1].next = index + 1;
+  }
+  return STATUS_OK;
+}
+
+//-----------------------------------------------------------------------------
+void loconet_rx_unsubscribe(uint8_t opcode, LOCONET_RX_CALLBACK_Type callback, void *context)
+{
+  uint8_t previous = 0;
+  uint8_t link = loconet_rx_subscriber_head(opcode);
+
+  while (link) {
+    LOCONET_RX_SUBSCRIBER_Type *subscriber = &loconet_rx_subscribers[link - 1];
+    if (subscriber->callback == callback && subscriber->context == context) {
+      // Unlink, the next link is kept for a dispatch in progress
+      if (previous) {
+        loconet_rx_subscribers[previous - 1].next = subscriber->next;
+      } else {
+        loconet_rx_subscriber_set_head(opcode, subscriber->next);
+      }
+      subscriber->callback = 0;
+
+      uint8_t space = loconet_rx_interest_space(opcode);
+      if (space != LOCONET_RX_INTEREST_NONE) {
+        loconet_rx_interest[space].subscribers--;
+      }
+      return;
+    }
+    previous = link;
+    link = subscriber->next;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Pass a message to the subscribers of its opcode
+static void loconet_rx_dispatch(uint8_t *message, uint8_t length)
+{
+  // First data byte, after the length byte of variable length messages
+  uint8_t first = ((message[0] & 0x60) == 0x60) ? message[2] : message[1];
+  uint8_t link = loconet_rx_subscriber_head(message[0]);
+
+  while (link) {
+    LOCONET_RX_SUBSCRIBER_Type *subscriber = &loconet_rx_subscribers[link - 1];
+    link = subscriber->next;
+    // A callback may unsubscribe and subscribe again, the next slot can be
+    // reused for another opcode by the time we get there
+    if (subscriber->callback && subscriber->opcode == message[0]
+        && (first & subscriber->mask) == subscriber->value) {
+      subscriber->callback(message, length, subscriber->context);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Length of a message from its opcode, 0 if the length byte tells
+static RAMFUNC uint8_t loconet_rx_message_length(uint8_t opcode)
+{
+  switch (opcode & 0x60) {
+    case 0x00:
+      return 2;
+    case 0x20:
+      return 4;
+    case 0x40:
+      return 6;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+void loconet_rx_interest_clear(uint8_t space)
+{
+  loconet_rx_interest[space].enabled = 0;
+  memset(loconet_rx_interest[space].bits, 0, sizeof(loconet_rx_interest[space].bits));
+}
+
+void loconet_rx_interest_add(uint8_t space, uint16_t address)
+{
+  address &= LOCONET_RX_INTEREST_Size - 1;
+  loconet_rx_interest[space].bits[address >> 3] |= 1 << (address & 0x07);
+}
+
+void loconet_rx_interest_enable(uint8_t space)
+{
+  // Bits are set before the interrupt uses them
+  __DMB();
+  loconet_rx_interest[space].enabled = 1;
+}
+
+void loconet_rx_interest_replies(const uint32_t *opcodes)
+{
+  uint8_t sensor = 0;
+  uint8_t switches = 0;
+
+  for (uint8_t opcode = 0x80; opcode; opcode++) {
+    if (opcodes[(opcode & 0x7F) >> 5] & (0x01ul << (opcode & 0x1F))) {
+      uint8_t space = loconet_rx_interest_space(opcode);
+      sensor |= (space == LOCONET_RX_INTEREST_SENSOR);
+      switches |= (space == LOCONET_RX_INTEREST_SWITCH);
+    }
+  }
+  loconet_rx_interest[LOCONET_RX_INTEREST_SENSOR].replies = sensor;
+  loconet_rx_interest[LOCONET_RX_INTEREST_SWITCH].replies = switches;
+}
+
+//-----------------------------------------------------------------------------
+// Returns 0 if the message is for an address nobody is interested in
+static RAMFUNC uint8_t loconet_rx_interested(uint8_t *message)
+{
+  uint8_t space = loconet_rx_interest_space(message[0]);
+  if (space == LOCONET_RX_INTEREST_NONE) {
+    return 1;
+  }
+
+  LOCONET_RX_INTEREST_Type *interest = &loconet_rx_interest[space];
+  if (!interest->enabled || interest->subscribers || interest->replies) {
+    return 1;
+  }
+
+  uint16_t address = message[1] | ((message[2] & 0x0F) << 7);
+  if (space == LOCONET_RX_INTEREST_SENSOR) {
+    address = (address << 1) | ((message[2] >> 5) & 0x01);
+  }
+  address &= LOCONET_RX_INTEREST_Size - 1;
+  return interest->bits[address >> 3] & (1 << (address & 0x07));
+}
 
 //-----------------------------------------------------------------------------
-void loconet_rx_buffer_push(uint8_t byte)
+// Drop the message being received for lack of space. If the buffer is
+// empty, waiting for the main loop would not have helped: the message is
+// too long for the space before or after the reader.
+static RAMFUNC void loconet_rx_drop(void)
 {
-  // Get index + 1 of buffer head
-  uint8_t index = (loconet_rx_ringbuffer.writer + 1) % LOCONET_RX_RINGBUFFER_Size;
+  loconet_rx_ringbuffer.received = 0;
+  if (loconet_rx_ringbuffer.reader == loconet_rx_ringbuffer.writer) {
+    loconet_rx_stats.oversized++;
+  } else {
+    loconet_rx_stats.overflow++;
+  }
+}
 
-  // If the buffer is full, wait until the reader empties
-  // a slot in the buffer to write to.
-  while (index == loconet_rx_ringbuffer.reader) {
-    continue;
+//-----------------------------------------------------------------------------
+RAMFUNC void loconet_rx_buffer_push(uint8_t byte)
+{
+  if (byte & 0x80) {
+    // An opcode starts a new message, an unfinished message is dropped
+    // (could happen due to collisions)
+    loconet_rx_ringbuffer.pending = loconet_rx_ringbuffer.writer;
+    loconet_rx_ringbuffer.received = 0;
+    loconet_rx_ringbuffer.length = loconet_rx_message_length(byte);
+    loconet_rx_ringbuffer.checksum = 0xFF;
+    loconet_rx_ringbuffer.timestamp = loconet_timestamp() - LOCONET_RX_OPCODE_DELAY;
+  } else if (!loconet_rx_ringbuffer.received) {
+    // Not part of a message, skip it
+    loconet_rx_stats.skipped++;
+    return;
+  } else if (!loconet_rx_ringbuffer.length) {
+    // Length byte of a variable length message
+    if (byte < 3) {
+      loconet_rx_ringbuffer.received = 0;
+      loconet_rx_stats.bad_length++;
+      return;
+    }
+    loconet_rx_ringbuffer.length = byte;
+  }
+
+  // Move the message to the start of the buffer if it does not fit before
+  // the end with its timestamp, as soon as its length is known.
+  uint8_t received = loconet_rx_ringbuffer.received;
+  uint8_t start = (loconet_rx_ringbuffer.pending - received) & LOCONET_RX_RINGBUFFER_Mask;
+  uint8_t stored = loconet_rx_ringbuffer.length + LOCONET_RX_TIMESTAMP_Size;
+  if (loconet_rx_ringbuffer.length && start + stored > LOCONET_RX_RINGBUFFER_Size) {
+    // The start of the buffer should be free: the reader is between the
+    // start of the buffer and the message, and after the moved bytes.
+    uint8_t reader = loconet_rx_ringbuffer.reader;
+    if (reader > start || reader <= received) {
+      loconet_rx_drop();
+      return;
+    }
+    for (uint8_t index = 0; index < received; index++) {
+      loconet_rx_ringbuffer.buffer[index] = loconet_rx_ringbuffer.buffer[start + index];
+    }
+    loconet_rx_ringbuffer.buffer[start] = 0x00;
+    loconet_rx_ringbuffer.pending = received;
+  }
+
+  // If the buffer is full, drop the message. Never wait for the main loop,
+  // it cannot run while we are in the interrupt.
+  uint8_t pending = loconet_rx_ringbuffer.pending;
+  uint8_t index = (pending + 1) & LOCONET_RX_RINGBUFFER_Mask;
+  if (index == loconet_rx_ringbuffer.reader) {
+    loconet_rx_drop();
+    return;
   }
 
   // Write the byte
-  loconet_rx_ringbuffer.buffer[loconet_rx_ringbuffer.writer] = byte;
+  loconet_rx_ringbuffer.buffer[pending] = byte;
+  loconet_rx_ringbuffer.pending = index;
+  loconet_rx_ringbuffer.checksum ^= byte;
+  if (++loconet_rx_ringbuffer.received != loconet_rx_ringbuffer.length) {
+    return;
+  }
+
+  // Message is complete
+  loconet_rx_ringbuffer.received = 0;
+  if (loconet_rx_ringbuffer.checksum) {
+    loconet_rx_stats.bad_checksum++;
+    return;
+  }
+
+  // Drop messages nobody is interested in, leaves the writer as it is
+  if (!loconet_rx_interested(&loconet_rx_ringbuffer.buffer[(index - loconet_rx_ringbuffer.length) & LOCONET_RX_RINGBUFFER_Mask])) {
+    loconet_rx_stats.filtered++;
+    return;
+  }
+
+  // Store the timestamp after the message, it fits before the end
+  uint8_t *timestamp = (uint8_t *)&loconet_rx_ringbuffer.timestamp;
+  for (uint8_t count = 0; count < LOCONET_RX_TIMESTAMP_Size; count++) {
+    pending = index;
+    index = (pending + 1) & LOCONET_RX_RINGBUFFER_Mask;
+    if (index == loconet_rx_ringbuffer.reader) {
+      loconet_rx_drop();
+      return;
+    }
+    loconet_rx_ringbuffer.buffer[pending] = timestamp[count];
+  }
+
+  // Publish the message after its bytes are written
+  __DMB();
   loconet_rx_ringbuffer.writer = index;
+  loconet_rx_stats.received++;
+
+  // Keep track of the maximum fill level
+  uint8_t used = (index - loconet_rx_ringbuffer.reader) & LOCONET_RX_RINGBUFFER_Mask;
+  if (used > loconet_rx_stats.high_water) {
+    loconet_rx_stats.high_water = used;
+  }
 }
 
 //-----------------------------------------------------------------------------
@@ -317,84 +679,18 @@ typedef union {
   uint8_t byte;
 } LOCONET_OPCODE_BYTE_Type;
 
-#define LOCONET_OPCODE_FLAG_Pos 7
-#define LOCONET_OPCODE_FLAG (0x01ul << LOCONET_OPCODE_FLAG_Pos)
-
 //-----------------------------------------------------------------------------
-uint8_t loconet_rx_process(void)
+// Pass a complete message to the transactions, subscribers and handlers
+static void loconet_rx_handle(uint8_t *data, uint8_t message_size)
 {
-  // Get values from ringbuffer
-  uint8_t *buffer = loconet_rx_ringbuffer.buffer;
-  uint8_t reader = loconet_rx_ringbuffer.reader;
-  uint8_t writer = loconet_rx_ringbuffer.writer;
-
-  // Expect an opcode byte from ringbuffer
   LOCONET_OPCODE_BYTE_Type opcode;
-  opcode.byte = buffer[reader];
+  opcode.byte = data[0];
 
-  // If the reader is "ahead" of the writer in the ringbuffer,
-  // add the size of the ringbuffer to the writer for its
-  // fictive index.
-  if (reader > writer) {
-    writer += LOCONET_RX_RINGBUFFER_Size;
-  }
+  // Offer the message to the transactions waiting for a reply
+  loconet_transaction_rx(data, message_size);
 
-  if (writer <= reader + 1) {
-    // We want at least two bytes before we try to read the message
-    return 0;
-  }
-
-  // If it's not an OPCODE byte, skip it
-  if (!(opcode.byte & LOCONET_OPCODE_FLAG)) {
-    loconet_rx_ringbuffer.reader = (reader + 1) % LOCONET_RX_RINGBUFFER_Size;
-    return 0;
-  }
-
-  // New message
-  uint8_t message_size = 0;
-  switch (opcode.bits.OPCODE) {
-    case 0x04:
-      message_size = 2;
-      break;
-    case 0x05:
-      message_size = 4;
-      break;
-    case 0x06:
-      message_size = 6;
-      break;
-    case 0x07:
-      message_size = buffer[(reader + 1) % LOCONET_RX_RINGBUFFER_Size];
-      break;
-  }
-
-  // Check if the buffer contains no new opcodes (could happen due to colissions)
-  uint8_t index_of_writer_or_eom = writer < (reader + message_size) ? writer : reader + message_size;
-  for (uint8_t index = reader + 1; index < index_of_writer_or_eom; index++) {
-    if (buffer[index % LOCONET_RX_RINGBUFFER_Size] & LOCONET_OPCODE_FLAG) {
-      loconet_rx_ringbuffer.reader = index % LOCONET_RX_RINGBUFFER_Size;
-      return 1; // Read the new message right away
-    }
-  }
-
-  // Check if we have all the bytes for this message
-  if (writer < reader + message_size) {
-    return 0;
-  }
-
-  // Get bytes for passing (and build checksum)
-  uint8_t data[message_size];
-  uint8_t *p_data = data;
-  uint8_t eom_index = reader + message_size;
-
-  for (uint8_t index = reader; index < eom_index; index++) {
-    *p_data++ = buffer[index % LOCONET_RX_RINGBUFFER_Size];
-  }
-
-  // Verify checksum (skip message if failed)
-  if (loconet_calc_checksum(data, message_size)) {
-    loconet_rx_ringbuffer.reader = (reader + message_size) % LOCONET_RX_RINGBUFFER_Size;
-    return 0;
-  }
+  // Subscribers of the opcode
+  loconet_rx_dispatch(data, message_size);
 
   // Handle message
   switch(opcode.bits.OPCODE) {
@@ -411,14 +707,67 @@ uint8_t loconet_rx_process(void)
       (*ln_messages_n[opcode.bits.NUMBER])(&data[2], message_size - 3);
       break;
   }
+}
 
-  // Advance reader
-  loconet_rx_ringbuffer.reader = (reader + message_size) % LOCONET_RX_RINGBUFFER_Size;
+//-----------------------------------------------------------------------------
+uint8_t loconet_rx_process(void)
+{
+  // Get values from ringbuffer
+  uint8_t *buffer = loconet_rx_ringbuffer.buffer;
+  uint8_t reader = loconet_rx_ringbuffer.reader;
+
+  // The ringbuffer only contains complete and valid messages
+  if (reader == loconet_rx_ringbuffer.writer) {
+    return 0;
+  }
+  // Read the message after the writer that published it
+  __DMB();
+
+  // The message continues at the start of the buffer
+  if (!(buffer[reader] & 0x80)) {
+    reader = 0;
+  }
+
+  // Handlers get the message in place, the interrupt does not write it
+  // until the reader is advanced after the handlers return.
+  uint8_t *data = &buffer[reader];
+  uint8_t message_size = loconet_rx_message_length(data[0]);
+  if (!message_size) {
+    message_size = data[1];
+  }
+
+  // Timestamp follows the message
+  memcpy(&loconet_rx_message_timestamp, &data[message_size], LOCONET_RX_TIMESTAMP_Size);
+
+  loconet_rx_handle(data, message_size);
+
+  // Advance reader, releases the message
+  loconet_rx_ringbuffer.reader = (reader + message_size + LOCONET_RX_TIMESTAMP_Size) & LOCONET_RX_RINGBUFFER_Mask;
 
   // Return that we have processed a message
   return 1;
 }
 
+//-----------------------------------------------------------------------------
+void loconet_rx_loopback(uint8_t *message, uint8_t length)
+{
+  if (!loconet_rx_interested(message)) {
+    return;
+  }
+
+  // Handlers may change the message, keep the one to be sent intact
+  uint8_t data[LOCONET_TX_MESSAGE_Size];
+  memcpy(data, message, length);
+  loconet_rx_message_timestamp = loconet_timestamp();
+  loconet_rx_handle(data, length);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t loconet_rx_timestamp(void)
+{
+  return loconet_rx_message_timestamp;
+}
+
 //-----------------------------------------------------------------------------
 // Dummy handlers
 void loconet_rx_dummy_0(void)
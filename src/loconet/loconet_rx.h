@@ -16,9 +16,83 @@
 
 #include <stdint.h>
 #include "loconet.h"
+#include "utils/ramfunc.h"
 #include "loconet_cv.h"
 
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint16_t overflow;        // Messages dropped due to a full ringbuffer
+  uint16_t bad_checksum;    // Messages dropped due to a wrong checksum
+  uint8_t high_water;       // Maximum number of bytes in the ringbuffer
+  uint16_t filtered;        // Messages dropped by the interest filter
+  uint16_t received;        // Messages placed in the ringbuffer, wraps
+  uint16_t skipped;         // Data bytes outside of a message
+  uint16_t oversized;       // Messages dropped although the ringbuffer was empty
+  uint16_t bad_length;      // Variable length messages with a length byte below 3
+} LOCONET_RX_STATS_Type;
+
+extern LOCONET_RX_STATS_Type loconet_rx_stats;
+
+//-----------------------------------------------------------------------------
+// Maximum number of subscriptions, at most 15
+#ifndef LOCONET_RX_SUBSCRIBER_Size
+#define LOCONET_RX_SUBSCRIBER_Size 8
+#endif
+
+// Called with the complete message, from opcode up to and including the
+// checksum. The message is only valid until the callback returns.
+typedef void (*LOCONET_RX_CALLBACK_Type)(uint8_t *message, uint8_t length, void *context);
+
+// Subscribe to messages with the given opcode. Only messages for which
+// (first data byte & mask) == value are passed, use mask 0 for all
+// messages. The first data byte follows the opcode, or the length byte of
+// variable length messages. Subscribers are called in order of
+// subscription, before the loconet_rx_* handlers. Returns
+// STATUS_ERR_NO_MEMORY if all subscriptions are in use.
+extern enum status_code loconet_rx_subscribe(uint8_t opcode, uint8_t mask, uint8_t value, LOCONET_RX_CALLBACK_Type callback, void *context);
+
+// Remove the subscription with the given opcode, callback and context
+extern void loconet_rx_unsubscribe(uint8_t opcode, LOCONET_RX_CALLBACK_Type callback, void *context);
+
+//-----------------------------------------------------------------------------
+// Interest filter. Sensor (0xB2) and switch (0xB0, 0xB1, 0xBC, 0xBD)
+// messages for addresses nobody is interested in are dropped in the
+// receive interrupt, before they take space in the ringbuffer. Addresses
+// are as on the wire, counting from 0: sensors 0 - 4095 (the I bit is the
+// lowest bit), switches 0 - 2047. Addresses are hashed into a bitmap of
+// LOCONET_RX_INTEREST_Size bits per address space, so an unrelated
+// address may pass as well. 4096 bits make the bitmap exact.
+// The addresses are those of the loconet_rx_* handlers. Subscriptions
+// and transactions take messages of any address, so a space is not
+// filtered while one of its opcodes is subscribed to, or is the reply
+// opcode of an outstanding transaction.
+#ifndef LOCONET_RX_INTEREST_Size
+#define LOCONET_RX_INTEREST_Size 256
+#endif
+
+#define LOCONET_RX_INTEREST_SENSOR 0
+#define LOCONET_RX_INTEREST_SWITCH 1
+#define LOCONET_RX_INTEREST_NONE   0xFF
+
+// Stop filtering the address space and forget its addresses
+extern void loconet_rx_interest_clear(uint8_t space);
+// Add an address of interest
+extern void loconet_rx_interest_add(uint8_t space, uint16_t address);
+// Start filtering the address space with the added addresses
+extern void loconet_rx_interest_enable(uint8_t space);
+// Reply opcodes the transactions wait for, a bitmap of 0x80 - 0xFF as
+// kept by loconet_transaction.c
+extern void loconet_rx_interest_replies(const uint32_t *opcodes);
+
 extern uint8_t loconet_rx_process(void);
-extern void loconet_rx_buffer_push(uint8_t);
+
+// Handle a message sent by this module as if it was received, used by
+// loconet_tx_process if loconet_config.bit.LOOPBACK is set
+extern void loconet_rx_loopback(uint8_t *message, uint8_t length);
+
+// Time (loconet_timestamp) of the start bit of the message being handled,
+// for use in handlers and subscribers
+extern uint32_t loconet_rx_timestamp(void);
+extern RAMFUNC void loconet_rx_buffer_push(uint8_t);
 
 #endif // _LOCONET_LOCONET_RX_H_
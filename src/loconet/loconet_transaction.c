@@ -0,0 +1,229 @@
+/**
+ * @file loconet_transaction.c
+ * @brief Loconet request/response transactions
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ * @author Jan Martijn van der Werf <janmartijn@slashdev.nl>
+ */
+
+#include "loconet.h"
+#include "loconet_transaction.h"
+
+//-----------------------------------------------------------------------------
+typedef enum {
+  LOCONET_TRANSACTION_FREE = 0,
+  LOCONET_TRANSACTION_SEND,     // Request should be (re)sent
+  LOCONET_TRANSACTION_QUEUED,   // Request is in the transmit queue
+  LOCONET_TRANSACTION_WAITING,  // Request is sent, waiting for the reply
+} LOCONET_TRANSACTION_STATE_Type;
+
+typedef struct {
+  LOCONET_TRANSACTION_Type transaction;
+  uint32_t deadline;
+  uint8_t state;
+  // The transmit callback of the request is still to come
+  uint8_t queued;
+  uint8_t request[LOCONET_TRANSACTION_REQUEST_Size];
+  uint8_t request_length;
+} LOCONET_TRANSACTION_ENTRY_Type;
+
+static LOCONET_TRANSACTION_ENTRY_Type loconet_transactions[LOCONET_TRANSACTION_Size];
+
+// Bitmap of reply opcodes (0x80 - 0xFF) of the outstanding transactions
+static uint32_t loconet_transaction_opcodes[4] = { 0 };
+
+//-----------------------------------------------------------------------------
+static void loconet_transaction_update_opcodes(void)
+{
+  memset(loconet_transaction_opcodes, 0, sizeof(loconet_transaction_opcodes));
+  for (uint8_t index = 0; index < LOCONET_TRANSACTION_Size; index++) {
+    LOCONET_TRANSACTION_ENTRY_Type *entry = &loconet_transactions[index];
+    if (entry->state != LOCONET_TRANSACTION_FREE) {
+      uint8_t opcode = entry->transaction.reply_opcode & 0x7F;
+      loconet_transaction_opcodes[opcode >> 5] |= 0x01ul << (opcode & 0x1F);
+    }
+  }
+  // Replies are not filtered by address
+  loconet_rx_interest_replies(loconet_transaction_opcodes);
+}
+
+//-----------------------------------------------------------------------------
+// Finish a transaction and report the result
+static void loconet_transaction_finish(LOCONET_TRANSACTION_ENTRY_Type *entry, enum status_code status, uint8_t *reply, uint8_t length)
+{
+  entry->state = LOCONET_TRANSACTION_FREE;
+  loconet_transaction_update_opcodes();
+  if (entry->transaction.callback) {
+    entry->transaction.callback(status, reply, length, entry->transaction.context);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Transmit callback of a request
+static void loconet_transaction_sent(uint8_t result, void *context)
+{
+  LOCONET_TRANSACTION_ENTRY_Type *entry = context;
+
+  if (result == LOCONET_TX_RESULT_COLLIDED) {
+    // Still in the transmit queue
+    return;
+  }
+  entry->queued = 0;
+
+  if (entry->state != LOCONET_TRANSACTION_QUEUED) {
+    // Already answered
+    return;
+  }
+  if (result == LOCONET_TX_RESULT_DELIVERED) {
+    // Start waiting for the reply now the request is on the wire
+    entry->deadline = loconet_timestamp() + (uint32_t)entry->transaction.timeout * 1000;
+    entry->state = LOCONET_TRANSACTION_WAITING;
+  } else if (entry->transaction.retries) {
+    // Dropped, counts as an attempt
+    entry->transaction.retries--;
+    entry->state = LOCONET_TRANSACTION_SEND;
+  } else {
+    loconet_transaction_finish(entry, STATUS_ERR_TIMEOUT, 0, 0);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Place the request in the transmit queue
+static void loconet_transaction_send(LOCONET_TRANSACTION_ENTRY_Type *entry)
+{
+  uint8_t opcode = entry->request[0];
+  uint8_t *data = &entry->request[1];
+  uint8_t length = entry->request_length - 1;
+
+  // Skip the length byte, loconet_tx_commit fills it in
+  if ((opcode & 0x60) == 0x60) {
+    data++;
+    length--;
+  }
+
+  // Try again in the next loop if the pool is exhausted
+  uint8_t *payload = loconet_tx_reserve(length);
+  if (!payload) {
+    return;
+  }
+  memcpy(payload, data, length);
+  loconet_tx_on_complete(payload, loconet_transaction_sent, entry);
+  // The request does not fit its opcode and is never sent, the transmit
+  // callback does not come either
+  if (loconet_tx_commit(payload, opcode, entry->transaction.priority) != STATUS_OK) {
+    loconet_transaction_finish(entry, STATUS_ERR_INVALID_ARG, 0, 0);
+    return;
+  }
+  entry->queued = 1;
+  entry->state = LOCONET_TRANSACTION_QUEUED;
+}
+
+//-----------------------------------------------------------------------------
+enum status_code loconet_transaction_start(const LOCONET_TRANSACTION_Type *transaction, uint8_t opcode, uint8_t *data, uint8_t length)
+{
+  if (length + 1u > LOCONET_TRANSACTION_REQUEST_Size || !(opcode & 0x80)) {
+    return STATUS_ERR_INVALID_ARG;
+  }
+  // Bits 5 and 6 of the opcode give the length, as loconet_tx_commit checks
+  // it. Variable length data starts with the length byte.
+  uint8_t size = (opcode >> 5) & 0x03;
+  if (size == 0x03 ? !length : length != 2 * size) {
+    return STATUS_ERR_INVALID_ARG;
+  }
+
+  // Find a free entry, without a pending transmit callback
+  LOCONET_TRANSACTION_ENTRY_Type *entry = 0;
+  for (uint8_t index = 0; index < LOCONET_TRANSACTION_Size; index++) {
+    if (loconet_transactions[index].state == LOCONET_TRANSACTION_FREE && !loconet_transactions[index].queued) {
+      entry = &loconet_transactions[index];
+      break;
+    }
+  }
+  if (!entry) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+
+  // Keep the request for resending
+  entry->transaction = *transaction;
+  entry->request[0] = opcode;
+  memcpy(&entry->request[1], data, length);
+  entry->request_length = length + 1;
+
+  loconet_transaction_send(entry);
+  if (entry->state != LOCONET_TRANSACTION_QUEUED) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+  loconet_transaction_update_opcodes();
+  return STATUS_OK;
+}
+
+//-----------------------------------------------------------------------------
+uint8_t loconet_transaction_match_long_ack(uint8_t *request, uint8_t *reply, uint8_t length)
+{
+  (void)length;
+  return reply[1] == (request[0] & 0x7F);
+}
+
+//-----------------------------------------------------------------------------
+uint8_t loconet_transaction_match_slot(uint8_t *request, uint8_t *reply, uint8_t length)
+{
+  // Slot is the first byte of a slot request and follows the length byte
+  // of the slot data
+  return length > 2 && reply[2] == request[1];
+}
+
+//-----------------------------------------------------------------------------
+void loconet_transaction_rx(uint8_t *message, uint8_t length)
+{
+  uint8_t opcode = message[0] & 0x7F;
+
+  // Nobody waits for this opcode
+  if (!(loconet_transaction_opcodes[opcode >> 5] & (0x01ul << (opcode & 0x1F)))) {
+    return;
+  }
+
+  // A request which went out before this reply may still be waiting for
+  // its transmit callback
+  loconet_tx_process_completed();
+
+  for (uint8_t index = 0; index < LOCONET_TRANSACTION_Size; index++) {
+    LOCONET_TRANSACTION_ENTRY_Type *entry = &loconet_transactions[index];
+    // Only requests on the wire, a queued request or its looped back copy
+    // is not answered yet
+    if (entry->state != LOCONET_TRANSACTION_WAITING) {
+      continue;
+    }
+    if (entry->transaction.reply_opcode != message[0]) {
+      continue;
+    }
+    if (entry->transaction.match && !entry->transaction.match(entry->request, message, length)) {
+      continue;
+    }
+    loconet_transaction_finish(entry, STATUS_OK, message, length);
+    return;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void loconet_transaction_process(void)
+{
+  uint32_t now = loconet_timestamp();
+
+  for (uint8_t index = 0; index < LOCONET_TRANSACTION_Size; index++) {
+    LOCONET_TRANSACTION_ENTRY_Type *entry = &loconet_transactions[index];
+    if (entry->state == LOCONET_TRANSACTION_SEND) {
+      loconet_transaction_send(entry);
+    } else if (entry->state == LOCONET_TRANSACTION_WAITING && (int32_t)(now - entry->deadline) >= 0) {
+      if (entry->transaction.retries) {
+        entry->transaction.retries--;
+        entry->state = LOCONET_TRANSACTION_SEND;
+        loconet_transaction_send(entry);
+      } else {
+        loconet_transaction_finish(entry, STATUS_ERR_TIMEOUT, 0, 0);
+      }
+    }
+  }
+}
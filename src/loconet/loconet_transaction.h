@@ -0,0 +1,80 @@
+/**
+ * @file loconet_transaction.h
+ * @brief Loconet request/response transactions
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * A transaction sends a request and waits for the reply, e.g. a switch
+ * request answered by OPC_LONG_ACK (0xB4) or a slot read answered by
+ * OPC_SL_RD_DATA (0xE7). The wait starts when the request is on the wire.
+ * If no matching reply is received in time, the request is sent again,
+ * up to the given number of retries. The callback is called from the main
+ * loop with STATUS_OK and the reply, or with STATUS_ERR_TIMEOUT.
+ *
+ * Replies are matched in loconet_rx_process, only for opcodes for which
+ * a transaction is waiting, against the outstanding transactions only. A
+ * request matches replies once it is on the wire, so neither its looped
+ * back copy nor a reply to an earlier attempt in the queue answers it.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ * @author Jan Martijn van der Werf <janmartijn@slashdev.nl>
+ */
+
+#ifndef _LOCONET_LOCONET_TRANSACTION_H_
+#define _LOCONET_LOCONET_TRANSACTION_H_
+
+#include <stdint.h>
+#include "utils/status_codes.h"
+
+//-----------------------------------------------------------------------------
+// Number of outstanding transactions
+#ifndef LOCONET_TRANSACTION_Size
+#define LOCONET_TRANSACTION_Size 4
+#endif
+
+// Maximum length of a request, including opcode, excluding checksum
+#ifndef LOCONET_TRANSACTION_REQUEST_Size
+#define LOCONET_TRANSACTION_REQUEST_Size 15
+#endif
+
+//-----------------------------------------------------------------------------
+// Returns nonzero if reply (a complete message) answers request (opcode
+// and data as passed to loconet_transaction_start).
+typedef uint8_t (*LOCONET_TRANSACTION_MATCH_Type)(uint8_t *request, uint8_t *reply, uint8_t length);
+
+// Called with STATUS_OK and the reply, or STATUS_ERR_TIMEOUT and no reply
+typedef void (*LOCONET_TRANSACTION_CALLBACK_Type)(enum status_code status, uint8_t *reply, uint8_t length, void *context);
+
+typedef struct {
+  uint8_t priority;                           // Priority of the request
+  uint8_t reply_opcode;                       // Opcode of the reply
+  uint8_t retries;                            // Resends after a timeout
+  uint16_t timeout;                           // Wait for a reply in ms
+  LOCONET_TRANSACTION_MATCH_Type match;       // 0: any reply_opcode message
+  LOCONET_TRANSACTION_CALLBACK_Type callback;
+  void *context;
+} LOCONET_TRANSACTION_Type;
+
+//-----------------------------------------------------------------------------
+// Send a request, data is passed as for loconet_tx_queue_n. Returns
+// STATUS_ERR_INVALID_ARG if the length does not fit the opcode or the
+// request, STATUS_ERR_NO_MEMORY if the table or the transmit pool is full.
+extern enum status_code loconet_transaction_start(const LOCONET_TRANSACTION_Type *transaction, uint8_t opcode, uint8_t *data, uint8_t length);
+
+//-----------------------------------------------------------------------------
+// Matchers for common replies
+// OPC_LONG_ACK, the acknowledged opcode matches the request
+extern uint8_t loconet_transaction_match_long_ack(uint8_t *request, uint8_t *reply, uint8_t length);
+// OPC_SL_RD_DATA, the slot matches the slot of the request
+extern uint8_t loconet_transaction_match_slot(uint8_t *request, uint8_t *reply, uint8_t length);
+
+//-----------------------------------------------------------------------------
+// Offer a received message to the waiting transactions
+extern void loconet_transaction_rx(uint8_t *message, uint8_t length);
+
+//-----------------------------------------------------------------------------
+// Handle timeouts, called from loconet_loop
+extern void loconet_transaction_process(void);
+
+#endif // _LOCONET_LOCONET_TRANSACTION_H_
@@ -10,68 +10,396 @@
  */
 
 #include "loconet_tx.h"
+#include <stddef.h>
+#include "utils/interrupt_nvic.h"
 
 //-----------------------------------------------------------------------------
 // Loconet message/linked list definition
 typedef struct MESSAGE {
   // Control fields
-  uint8_t priority;
   struct MESSAGE *next;
-  // Message fields
-  uint8_t *data;
+  LOCONET_TX_CALLBACK_Type callback;
+  void *context;
+  uint32_t timestamp;
+  uint8_t priority;
+  uint8_t level;
+  uint8_t retries;
+  uint8_t backoff;          // Extra priority slots before the next attempt
+  uint8_t backoff_round;    // loconet_tx_round when the backoff was drawn
+  uint8_t result;
+  // Message fields. The payload always starts at data[2], so the frame of
+  // a variable length message starts at data[0] and the frame of a fixed
+  // length message at data[1].
+  uint8_t data[LOCONET_TX_MESSAGE_Size];
+  uint8_t data_start;
   uint8_t data_length;
   // Current index we're sending
   uint8_t tx_index;
   uint8_t rx_index;
 } LOCONET_MESSAGE_Type;
 
-static LOCONET_MESSAGE_Type *loconet_tx_queue = 0;
-static LOCONET_MESSAGE_Type *loconet_tx_current = 0;
+//-----------------------------------------------------------------------------
+// The queue is a FIFO per priority level, with a bitmap of the levels which
+// contain messages. A lower level is more important. Enqueue and dequeue
+// are O(1), independent of the number of queued messages.
+typedef struct {
+  LOCONET_MESSAGE_Type *head;
+  LOCONET_MESSAGE_Type *tail;
+} LOCONET_TX_FIFO_Type;
+
+static LOCONET_TX_FIFO_Type loconet_tx_levels[LOCONET_TX_PRIORITY_LEVELS];
+static LOCONET_TX_LEVELS_Type loconet_tx_levels_active = 0;
+static uint16_t loconet_tx_queue_length = 0;
+
+// Aging: every LOCONET_TX_AGING_INTERVAL dequeues, the oldest message of one
+// less important level is moved up one level. The levels take turns, so
+// every waiting message is promoted within a bounded number of dequeues.
+static uint8_t loconet_tx_aging_count = 0;
+static uint8_t loconet_tx_aging_level = 0;
+
+//-----------------------------------------------------------------------------
+// Message pool. Slots which were never used are handed out in order, after
+// that messages are recycled through the free list. Both are O(1).
+static LOCONET_MESSAGE_Type loconet_tx_pool[LOCONET_TX_POOL_Size];
+static LOCONET_MESSAGE_Type *loconet_tx_pool_free = 0;
+static uint8_t loconet_tx_pool_unused = 0;
+
+LOCONET_TX_STATS_Type loconet_tx_stats = { 0 };
+
+//-----------------------------------------------------------------------------
+// Handoff between the application, the scheduler and the sercom interrupt.
+// The scheduler (loconet_tx_process, in the main loop) is the only one which
+// touches the priority levels.
+// - Committed messages are placed in the submit ring, from the main loop or
+//   from an interrupt. Producers only disable interrupts to claim a slot.
+// - The scheduler hands a single message to the interrupt by setting
+//   loconet_tx_current, and only when the interrupt has cleared it.
+// - The interrupt returns delivered and collided messages through the
+//   completion ring, without disabling interrupts.
+// Every message in the submit ring comes from the pool and at most one
+// message is sent at a time, so the rings cannot overflow.
+#define LOCONET_TX_SUBMIT_Size   (LOCONET_TX_POOL_Size + 1)
+#define LOCONET_TX_COMPLETE_Size 3
+
+static LOCONET_MESSAGE_Type *loconet_tx_submit_ring[LOCONET_TX_SUBMIT_Size];
+static volatile uint8_t loconet_tx_submit_head = 0;
+static volatile uint8_t loconet_tx_submit_tail = 0;
+
+static LOCONET_MESSAGE_Type *loconet_tx_complete_ring[LOCONET_TX_COMPLETE_Size];
+static volatile uint8_t loconet_tx_complete_head = 0;
+static volatile uint8_t loconet_tx_complete_tail = 0;
+
+static LOCONET_MESSAGE_Type * volatile loconet_tx_current = 0;
+
+// Start of the transmission of the current message, only one message is
+// sent at a time.
+static uint32_t loconet_tx_current_timestamp = 0;
+
+LOCONET_TX_LATENCY_Type loconet_tx_latency[LOCONET_TX_PRIORITY_LEVELS];
+
+//-----------------------------------------------------------------------------
+// Backoff after a collision. The random generator is seeded with the serial
+// number of the chip, so modules with the same priority do not keep
+// colliding in lockstep.
+#ifndef LOCONET_TX_SERIAL_NUMBER
+#define LOCONET_TX_SERIAL_NUMBER(word) \
+  (*(volatile uint32_t *)((word) ? 0x0080A03Cul + 4 * (word) : 0x0080A00Cul))
+#endif
+
+static uint32_t loconet_tx_random_state = 0;
+
+// Slots of the last collision. The next attempt waits at least those, also
+// when a more important message goes first, so the modules which collided
+// spread out. The collided message keeps its own slots for its attempt,
+// until a message is delivered: the module won the line, the contention
+// is over. loconet_tx_round counts deliveries, it may wrap.
+static uint8_t loconet_tx_collision_slots = 0;
+static uint8_t loconet_tx_round = 0;
+
+// Backoff of the next attempt, published by the scheduler for the master
+// delay interrupt
+static volatile uint8_t loconet_tx_backoff_slots = 0;
+
+//-----------------------------------------------------------------------------
+// Xorshift32 pseudo random generator
+static uint32_t loconet_tx_random(void)
+{
+  uint32_t x = loconet_tx_random_state;
+  if (!x) {
+    x = LOCONET_TX_SERIAL_NUMBER(0) ^ LOCONET_TX_SERIAL_NUMBER(1)
+      ^ LOCONET_TX_SERIAL_NUMBER(2) ^ LOCONET_TX_SERIAL_NUMBER(3);
+    // Zero is the only invalid state
+    if (!x) {
+      x = 0x4BA;
+    }
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  loconet_tx_random_state = x;
+  return x;
+}
 
 //-----------------------------------------------------------------------------
-// Stop transmission and free memory of the message
-void loconet_tx_stop(void)
+// Take a message from the pool, returns 0 if the pool is exhausted
+static LOCONET_MESSAGE_Type *loconet_tx_pool_alloc(void)
+{
+  LOCONET_MESSAGE_Type *message = 0;
+
+  // Messages may be built from an interrupt
+  cpu_irq_enter_critical();
+  if (loconet_tx_pool_free) {
+    message = loconet_tx_pool_free;
+    loconet_tx_pool_free = message->next;
+  } else if (loconet_tx_pool_unused < LOCONET_TX_POOL_Size) {
+    message = &loconet_tx_pool[loconet_tx_pool_unused++];
+  }
+  if (message) {
+    if (++loconet_tx_stats.pool_used > loconet_tx_stats.pool_high_water) {
+      loconet_tx_stats.pool_high_water = loconet_tx_stats.pool_used;
+    }
+  } else {
+    loconet_tx_stats.pool_exhausted++;
+  }
+  cpu_irq_leave_critical();
+
+  return message;
+}
+
+//-----------------------------------------------------------------------------
+// Return a message to the pool
+static void loconet_tx_pool_release(LOCONET_MESSAGE_Type *message)
+{
+  cpu_irq_enter_critical();
+  message->next = loconet_tx_pool_free;
+  loconet_tx_pool_free = message;
+  loconet_tx_stats.pool_used--;
+  cpu_irq_leave_critical();
+}
+
+//-----------------------------------------------------------------------------
+// Hand the current message back to the scheduler, called from the sercom
+// interrupt
+static RAMFUNC void loconet_tx_complete(uint8_t result)
+{
+  LOCONET_MESSAGE_Type *message = loconet_tx_current;
+  uint8_t head = loconet_tx_complete_head;
+
+  message->result = result;
+  loconet_tx_complete_ring[head] = message;
+  // Publish the message before moving the head
+  __DMB();
+  loconet_tx_complete_head = (head == LOCONET_TX_COMPLETE_Size - 1) ? 0 : head + 1;
+  loconet_tx_current = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Stop transmission and return the message to the scheduler
+RAMFUNC void loconet_tx_stop(void)
 {
   loconet_status.bit.TRANSMIT = 0;
   // We might not have a message due to collision detection
   if (loconet_tx_current) {
-    free(loconet_tx_current->data);
-    free(loconet_tx_current);
+    loconet_tx_complete(LOCONET_TX_RESULT_DELIVERED);
   }
 }
 
 //-----------------------------------------------------------------------------
-void loconet_tx_reset_current_message_to_queue(void)
+// Append a message to the tail of the FIFO of its level
+static void loconet_tx_level_push_tail(LOCONET_MESSAGE_Type *message)
 {
-  // Reset transmit and receive index
-  loconet_tx_current->tx_index = 0;
-  loconet_tx_current->rx_index = 0;
-  // Place message back at front of queue
-  loconet_tx_current->next = loconet_tx_current;
-  loconet_tx_queue = loconet_tx_current;
-  loconet_tx_current = 0;
+  LOCONET_TX_FIFO_Type *fifo = &loconet_tx_levels[message->priority];
+  message->next = 0;
+  if (fifo->tail) {
+    fifo->tail->next = message;
+  } else {
+    fifo->head = message;
+  }
+  fifo->tail = message;
+  loconet_tx_levels_active |= (LOCONET_TX_LEVELS_Type)1 << message->priority;
+  if (++loconet_tx_queue_length > loconet_tx_stats.queue_high_water) {
+    loconet_tx_stats.queue_high_water = loconet_tx_queue_length;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Place a message in front of the FIFO of its level
+static void loconet_tx_level_push_head(LOCONET_MESSAGE_Type *message)
+{
+  LOCONET_TX_FIFO_Type *fifo = &loconet_tx_levels[message->priority];
+  message->next = fifo->head;
+  if (!fifo->tail) {
+    fifo->tail = message;
+  }
+  fifo->head = message;
+  loconet_tx_levels_active |= (LOCONET_TX_LEVELS_Type)1 << message->priority;
+  if (++loconet_tx_queue_length > loconet_tx_stats.queue_high_water) {
+    loconet_tx_stats.queue_high_water = loconet_tx_queue_length;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Take the first message of a (non empty) level
+static LOCONET_MESSAGE_Type *loconet_tx_level_pop(uint8_t level)
+{
+  LOCONET_TX_FIFO_Type *fifo = &loconet_tx_levels[level];
+  LOCONET_MESSAGE_Type *message = fifo->head;
+  fifo->head = message->next;
+  if (!fifo->head) {
+    fifo->tail = 0;
+    loconet_tx_levels_active &= ~((LOCONET_TX_LEVELS_Type)1 << level);
+  }
+  message->next = 0;
+  loconet_tx_queue_length--;
+  return message;
+}
+
+//-----------------------------------------------------------------------------
+// Move the oldest message of the next waiting level up by one level. That
+// is the message being sent if it comes from that level: it goes back to the
+// front of its level on a collision, promoting the next one would let that
+// overtake it.
+static void loconet_tx_age(LOCONET_MESSAGE_Type *sending)
+{
+  if (++loconet_tx_aging_count < LOCONET_TX_AGING_INTERVAL) {
+    return;
+  }
+  loconet_tx_aging_count = 0;
+
+  // Level 0 cannot be promoted any further
+  LOCONET_TX_LEVELS_Type waiting = loconet_tx_levels_active & ~(LOCONET_TX_LEVELS_Type)1;
+  if (!waiting) {
+    return;
+  }
+  // Take the first waiting level after the previous one, wrap around if
+  // there is none.
+  LOCONET_TX_LEVELS_Type next = waiting & ~(((LOCONET_TX_LEVELS_Type)2 << loconet_tx_aging_level) - 1);
+  loconet_tx_aging_level = __builtin_ctz(next ? next : waiting);
+
+  if (loconet_tx_aging_level == sending->priority) {
+    sending->priority--;
+    return;
+  }
+  LOCONET_MESSAGE_Type *message = loconet_tx_level_pop(loconet_tx_aging_level);
+  message->priority--;
+  loconet_tx_level_push_tail(message);
+}
+
+//-----------------------------------------------------------------------------
+// Report the result of a message to the application
+static void loconet_tx_notify(LOCONET_MESSAGE_Type *message, uint8_t result)
+{
+  if (message->callback) {
+    message->callback(result, message->context);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Add the latency of a delivered message to its level
+static void loconet_tx_latency_add(LOCONET_MESSAGE_Type *message)
+{
+  LOCONET_TX_LATENCY_Type *latency = &loconet_tx_latency[message->level];
+  uint32_t value = loconet_tx_current_timestamp - message->timestamp;
+
+  if (!latency->count || value < latency->minimum) {
+    latency->minimum = value;
+  }
+  if (value > latency->maximum) {
+    latency->maximum = value;
+  }
+  latency->count++;
+  latency->total += value;
+
+#if LOCONET_TX_LATENCY_BUCKETS
+  // Bucket n starts at 2^(n-1) * 1024 us
+  uint8_t bucket = 0;
+  uint32_t limit = 1024;
+  while (bucket < LOCONET_TX_LATENCY_BUCKETS - 1 && value >= limit) {
+    bucket++;
+    limit <<= 1;
+  }
+  if (latency->histogram[bucket] != 0xFFFF) {
+    latency->histogram[bucket]++;
+  }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+uint32_t loconet_tx_latency_average(uint8_t level)
+{
+  if (level >= LOCONET_TX_PRIORITY_LEVELS || !loconet_tx_latency[level].count) {
+    return 0;
+  }
+  return (uint32_t)(loconet_tx_latency[level].total / loconet_tx_latency[level].count);
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC void loconet_tx_reset_current_message_to_queue(void)
+{
+  if (loconet_tx_current) {
+    loconet_tx_complete(LOCONET_TX_RESULT_COLLIDED);
+  }
 }
 
 //-----------------------------------------------------------------------------
-uint8_t loconet_tx_next_rx_byte(void)
+// Place a collided message back in the queue, or drop it if it collided too
+// often
+static void loconet_tx_retry(LOCONET_MESSAGE_Type *message)
+{
+  uint8_t retries = ++message->retries;
+
+  // Drop the message if it collided too often
+  if (loconet_config.bit.RETRY_LIMIT && retries > loconet_config.bit.RETRY_LIMIT) {
+    loconet_tx_notify(message, LOCONET_TX_RESULT_DROPPED);
+    loconet_tx_pool_release(message);
+    loconet_tx_stats.dropped++;
+    return;
+  }
+
+  // Wait a random number of slots, the range doubles with every retry
+  uint8_t exponent = loconet_config.bit.BACKOFF;
+  if (exponent > LOCONET_TX_BACKOFF_MAX) {
+    exponent = LOCONET_TX_BACKOFF_MAX;
+  }
+  if (exponent > retries) {
+    exponent = retries;
+  }
+  message->backoff = loconet_tx_random() & ((0x01 << exponent) - 1);
+  message->backoff_round = loconet_tx_round;
+  loconet_tx_collision_slots = message->backoff;
+
+  // Place message back at front of its level
+  loconet_tx_level_push_head(message);
+  loconet_tx_stats.retried++;
+  loconet_tx_notify(message, LOCONET_TX_RESULT_COLLIDED);
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC uint8_t loconet_tx_backoff(void)
+{
+  return loconet_tx_backoff_slots;
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC uint8_t loconet_tx_next_rx_byte(void)
 {
   if (!loconet_tx_current) {
     return 0xFF;
   }
-  return loconet_tx_current->data[loconet_tx_current->rx_index++];
+  return loconet_tx_current->data[loconet_tx_current->data_start + loconet_tx_current->rx_index++];
 }
 
 //-----------------------------------------------------------------------------
-uint8_t loconet_tx_next_tx_byte(void)
+RAMFUNC uint8_t loconet_tx_next_tx_byte(void)
 {
   if (!loconet_tx_current) {
     return 0;
   }
-  return loconet_tx_current->data[loconet_tx_current->tx_index++];
+  return loconet_tx_current->data[loconet_tx_current->data_start + loconet_tx_current->tx_index++];
 }
 
 //-----------------------------------------------------------------------------
-uint8_t loconet_tx_finished(void)
+RAMFUNC uint8_t loconet_tx_finished(void)
 {
   // We're done if are the end of sending data
   if (loconet_tx_current && loconet_tx_current->tx_index < loconet_tx_current->data_length) {
@@ -81,14 +409,163 @@ uint8_t loconet_tx_finished(void)
   return 1;
 }
 
+//-----------------------------------------------------------------------------
+uint16_t loconet_tx_queue_size(void)
+{
+  // Include messages which are not yet moved to their level
+  uint8_t head = loconet_tx_submit_head;
+  uint8_t tail = loconet_tx_submit_tail;
+  uint8_t submitted = (head >= tail) ? head - tail : head + LOCONET_TX_SUBMIT_Size - tail;
+  return loconet_tx_queue_length + submitted;
+}
+
+//-----------------------------------------------------------------------------
+// Mask of the bits in the second byte of a state message which are part of
+// the address, returns 0 if the opcode is not a state message.
+static uint8_t loconet_tx_coalesce_mask(uint8_t opcode)
+{
+  switch (opcode) {
+    case 0xB1: // OPC_SW_REP: state in bits 4 and 5
+      return 0x4F;
+    case 0xB2: // OPC_INPUT_REP: bit 5 is part of the address, state in bit 4
+      return 0x6F;
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Replace the state of a waiting message for the same opcode and address,
+// returns 1 if such a message was found.
+static uint8_t loconet_tx_coalesce(uint8_t *frame)
+{
+  uint8_t mask = loconet_tx_coalesce_mask(frame[0]);
+  uint8_t found = 0;
+
+  if (!mask) {
+    return 0;
+  }
+
+  // The message being sent is not in the queue
+  for (uint8_t level = 0; level < LOCONET_TX_PRIORITY_LEVELS && !found; level++) {
+    LOCONET_MESSAGE_Type *message = loconet_tx_levels[level].head;
+    for (; message; message = message->next) {
+      uint8_t *queued = &message->data[message->data_start];
+      if (queued[0] == frame[0]
+          && queued[1] == frame[1]
+          && (queued[2] & mask) == (frame[2] & mask)) {
+        queued[2] = frame[2];
+        queued[3] = frame[3];
+        loconet_tx_stats.coalesced++;
+        found = 1;
+        break;
+      }
+    }
+  }
+
+  return found;
+}
+
+//-----------------------------------------------------------------------------
+// Place a message in the submit ring, may be called from an interrupt
+static void loconet_tx_submit(LOCONET_MESSAGE_Type *message)
+{
+  cpu_irq_enter_critical();
+  uint8_t head = loconet_tx_submit_head;
+  loconet_tx_submit_ring[head] = message;
+  loconet_tx_submit_head = (head == LOCONET_TX_SUBMIT_Size - 1) ? 0 : head + 1;
+  cpu_irq_leave_critical();
+}
+
+//-----------------------------------------------------------------------------
+// Free delivered messages and retry collided messages
+void loconet_tx_process_completed(void)
+{
+  uint8_t tail = loconet_tx_complete_tail;
+
+  while (tail != loconet_tx_complete_head) {
+    // Read the message after the head that published it
+    __DMB();
+    LOCONET_MESSAGE_Type *message = loconet_tx_complete_ring[tail];
+    tail = (tail == LOCONET_TX_COMPLETE_Size - 1) ? 0 : tail + 1;
+    loconet_tx_complete_tail = tail;
+
+    if (message->result == LOCONET_TX_RESULT_COLLIDED) {
+      loconet_tx_retry(message);
+    } else {
+      loconet_tx_latency_add(message);
+      loconet_tx_notify(message, LOCONET_TX_RESULT_DELIVERED);
+      loconet_tx_pool_release(message);
+      loconet_tx_round++;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Move submitted messages to their priority level
+static void loconet_tx_process_submitted(void)
+{
+  uint8_t tail = loconet_tx_submit_tail;
+
+  while (tail != loconet_tx_submit_head) {
+    __DMB();
+    LOCONET_MESSAGE_Type *message = loconet_tx_submit_ring[tail];
+    tail = (tail == LOCONET_TX_SUBMIT_Size - 1) ? 0 : tail + 1;
+    loconet_tx_submit_tail = tail;
+
+    // Handle our own message locally right away. The echo on the bus is
+    // only checked for collisions, so it is not handled a second time.
+    if (loconet_config.bit.LOOPBACK) {
+      loconet_rx_loopback(&message->data[message->data_start], message->data_length);
+    }
+
+    // Replace a waiting state message if requested
+    if (loconet_config.bit.COALESCE && message->data_length == 4
+        && loconet_tx_coalesce(&message->data[message->data_start])) {
+      loconet_tx_notify(message, LOCONET_TX_RESULT_COALESCED);
+      loconet_tx_pool_release(message);
+      continue;
+    }
+
+    // Priorities beyond the last level share the last level
+    if (message->priority >= LOCONET_TX_PRIORITY_LEVELS) {
+      message->priority = LOCONET_TX_PRIORITY_LEVELS - 1;
+    }
+    // Aging changes the priority, keep the level for the latency
+    message->level = message->priority;
+    loconet_tx_level_push_tail(message);
+  }
+}
+
 //-----------------------------------------------------------------------------
 void loconet_tx_process(void)
 {
+  // Collect messages from the interrupt and the application
+  loconet_tx_process_completed();
+  loconet_tx_process_submitted();
+
   // Can we start transmission?
-  if (!loconet_tx_queue) {
+  if (loconet_tx_current) {
+    // The interrupt still holds a message, its backoff stays published
+    return;
+  }
+  // The current message may have completed after collecting. Only the
+  // current message completes, so collect once more: a message which
+  // collided is back in its level before the next one is taken.
+  loconet_tx_process_completed();
+
+  if (!loconet_tx_levels_active) {
     // No message is in the queue
+    loconet_tx_backoff_slots = 0;
     return;
-  } else if (loconet_status.bit.COLLISION_DETECTED) {
+  }
+
+  // Back off for the message to be sent next, or the last collision
+  uint8_t level = __builtin_ctz(loconet_tx_levels_active);
+  LOCONET_MESSAGE_Type *head = loconet_tx_levels[level].head;
+  uint8_t slots = (head->backoff_round == loconet_tx_round) ? head->backoff : 0;
+  loconet_tx_backoff_slots = (slots > loconet_tx_collision_slots) ? slots : loconet_tx_collision_slots;
+
+  if (loconet_status.bit.COLLISION_DETECTED) {
     return;
   } else if (!loconet_status.bit.IDLE) {
     // We're not allowed to transmit, don't try to
@@ -98,122 +575,158 @@ void loconet_tx_process(void)
     return;
   }
 
-  // We have a queue, loconet is idle, so we can start sending
-  loconet_status.reg |= LOCONET_STATUS_TRANSMIT;
+  // Take the most important level
+  LOCONET_MESSAGE_Type *message = loconet_tx_level_pop(level);
+  loconet_tx_age(message);
+  loconet_tx_collision_slots = 0;
+  message->tx_index = 0;
+  message->rx_index = 0;
 
-  // Set which bytes need to be send
-  loconet_tx_current = loconet_tx_queue;
-  loconet_tx_queue = loconet_tx_current->next;
-  loconet_tx_current->next = 0;
+  // Hand the message to the interrupt. The flank interrupts change the
+  // other status bits, so set TRANSMIT with interrupts disabled.
+  loconet_tx_current_timestamp = loconet_timestamp();
+  loconet_tx_current = message;
+  cpu_irq_enter_critical();
+  loconet_status.reg |= LOCONET_STATUS_TRANSMIT;
+  cpu_irq_leave_critical();
 
   // Start sending
   loconet_sercom_enable_dre_irq();
+}
 
-  return;
+//-----------------------------------------------------------------------------
+// Find the message a payload pointer of loconet_tx_reserve belongs to
+static LOCONET_MESSAGE_Type *loconet_tx_payload_message(uint8_t *payload)
+{
+  return (LOCONET_MESSAGE_Type *)(payload - 2 - offsetof(LOCONET_MESSAGE_Type, data));
 }
 
 //-----------------------------------------------------------------------------
-static void loconet_tx_enqueue(LOCONET_MESSAGE_Type *message)
+uint8_t *loconet_tx_reserve(uint8_t length)
 {
-  // If queue is empty, push it
-  if (!loconet_tx_queue) {
-    loconet_tx_queue = message;
-    return;
+  // Opcode, length byte and checksum are added by loconet_tx_commit. Too
+  // long is a fault of the caller, not of the pool, so it is not counted.
+  if (length > LOCONET_TX_MESSAGE_Size - 3) {
+    return 0;
   }
-
-  // Pointers to previous and current node
-  LOCONET_MESSAGE_Type *prev = loconet_tx_queue;
-  LOCONET_MESSAGE_Type *curr = loconet_tx_queue->next;
-
-  // Loop through message which are more important (lower priority)
-  for (; curr && curr->priority < message->priority + 1; prev = curr, curr = curr->next);
-
-  // Loop through messages which have the same priority.
-  // All priority should be lowered by 1, and place the message at the end.
-  for (; curr && curr->priority < message->priority + 2; curr->priority--, prev = curr, curr = curr->next);
-  prev->next = message;
-  message->next = curr;
-
-  // All next messages should have their priorities decreased.
-  // This prevents starvation of messages at the end of the queue
-  for (; curr; curr->priority--, curr = curr->next);
+  // Take a linked list node from the pool
+  LOCONET_MESSAGE_Type *message = loconet_tx_pool_alloc();
+  if (!message) {
+    return 0;
+  }
+  message->next = 0;
+  message->callback = 0;
+  message->retries = 0;
+  message->backoff = 0;
+  message->data_length = length;
+  message->tx_index = 0;
+  message->rx_index = 0;
+  // Return where the payload should be written
+  return &message->data[2];
 }
 
 //-----------------------------------------------------------------------------
-// Build an empty message with the correct length
-static LOCONET_MESSAGE_Type *loconet_build_message(uint8_t length)
+void loconet_tx_abort(uint8_t *payload)
 {
-  // Allocate space for linked list node
-  LOCONET_MESSAGE_Type *message = malloc(sizeof(LOCONET_MESSAGE_Type));
-  memset(message, 0, sizeof(LOCONET_MESSAGE_Type));
-  // Allocate space for message bytes
-  message->data = malloc(sizeof(uint8_t) * length);
-  message->data_length = length;
-  // Return the new message
-  return message;
+  loconet_tx_pool_release(loconet_tx_payload_message(payload));
 }
 
 //-----------------------------------------------------------------------------
-uint16_t loconet_tx_queue_size(void)
+void loconet_tx_on_complete(uint8_t *payload, LOCONET_TX_CALLBACK_Type callback, void *context)
 {
-  uint16_t length = 0;
-  LOCONET_MESSAGE_Type *curr = loconet_tx_queue;
-  for (; curr; length++, curr = curr->next);
-  return length;
+  LOCONET_MESSAGE_Type *message = loconet_tx_payload_message(payload);
+  message->callback = callback;
+  message->context = context;
 }
 
 //-----------------------------------------------------------------------------
-void loconet_tx_queue_2(uint8_t opcode, uint8_t priority)
+enum status_code loconet_tx_commit(uint8_t *payload, uint8_t opcode, uint8_t priority)
 {
-  LOCONET_MESSAGE_Type *message = loconet_build_message(2);
-  // Set priority
+  LOCONET_MESSAGE_Type *message = loconet_tx_payload_message(payload);
+  uint8_t length = message->data_length;
+
+  if (!(opcode & LOCONET_TX_OPCODE_FLAG)) {
+    loconet_tx_abort(payload);
+    return STATUS_ERR_INVALID_ARG;
+  }
+
+  // Bits 5 and 6 of the opcode give the length of the message
+  uint8_t size = (opcode >> 5) & 0x03;
+  if (size == 0x03) {
+    // Variable length: opcode, length byte, payload, checksum
+    message->data_start = 0;
+    message->data_length = length + 3;
+    message->data[1] = message->data_length;
+  } else if (length == 2 * size) {
+    // Fixed length of 2, 4 or 6 bytes: opcode, payload, checksum
+    message->data_start = 1;
+    message->data_length = length + 2;
+  } else {
+    loconet_tx_abort(payload);
+    return STATUS_ERR_INVALID_ARG;
+  }
+
+  // Fill opcode and checksum
+  uint8_t *frame = &message->data[message->data_start];
+  frame[0] = opcode;
+  frame[message->data_length - 1] = loconet_calc_checksum(frame, message->data_length - 1);
+
+  // Set priority and hand the message to the scheduler
   message->priority = priority;
-  // Fill message
-  message->data[0] = opcode;
-  message->data[1] = loconet_calc_checksum(message->data, 1);
-  // Enqueue message
-  loconet_tx_enqueue(message);
+  message->timestamp = loconet_timestamp();
+  loconet_tx_submit(message);
+  return STATUS_OK;
 }
 
-void loconet_tx_queue_4(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b)
+//-----------------------------------------------------------------------------
+enum status_code loconet_tx_queue_2(uint8_t opcode, uint8_t priority)
 {
-  LOCONET_MESSAGE_Type *message = loconet_build_message(4);
-  // Set priority
-  message->priority = priority;
-  // Fill message
-  message->data[0] = opcode;
-  message->data[1] = a;
-  message->data[2] = b;
-  message->data[3] = loconet_calc_checksum(message->data, 3);
-  // Enqueue message
-  loconet_tx_enqueue(message);
+  uint8_t *payload = loconet_tx_reserve(0);
+  if (!payload) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+  return loconet_tx_commit(payload, opcode, priority);
 }
 
-void loconet_tx_queue_6(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b, uint8_t c, uint8_t d)
+enum status_code loconet_tx_queue_4(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b)
 {
-  LOCONET_MESSAGE_Type *message = loconet_build_message(6);
-  // Set priority
-  message->priority = priority;
-  // Fill message
-  message->data[0] = opcode;
-  message->data[1] = a;
-  message->data[2] = b;
-  message->data[3] = c;
-  message->data[4] = d;
-  message->data[5] = loconet_calc_checksum(message->data, 5);
-  // Enqueue message
-  loconet_tx_enqueue(message);
+  uint8_t *payload = loconet_tx_reserve(2);
+  if (!payload) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+  payload[0] = a;
+  payload[1] = b;
+  return loconet_tx_commit(payload, opcode, priority);
 }
 
-void loconet_tx_queue_n(uint8_t opcode, uint8_t priority, uint8_t *data, uint8_t length)
+enum status_code loconet_tx_queue_6(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b, uint8_t c, uint8_t d)
 {
-  LOCONET_MESSAGE_Type *message = loconet_build_message(length + 2);
-  // Set priority
-  message->priority = priority;
-  // Fill message
-  message->data[0] = opcode;
-  for(uint8_t idx = 0; idx < length; message->data[idx+1] = data[idx], idx++);
-  message->data[length+1] = loconet_calc_checksum(message->data, length + 1);
-  // Enqueue message
-  loconet_tx_enqueue(message);
+  uint8_t *payload = loconet_tx_reserve(4);
+  if (!payload) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+  payload[0] = a;
+  payload[1] = b;
+  payload[2] = c;
+  payload[3] = d;
+  return loconet_tx_commit(payload, opcode, priority);
+}
+
+enum status_code loconet_tx_queue_n(uint8_t opcode, uint8_t priority, uint8_t *data, uint8_t length)
+{
+  // For variable length messages the first byte is the length byte, which
+  // is filled in by loconet_tx_commit.
+  if ((opcode & 0x60) == 0x60) {
+    if (!length) {
+      return STATUS_ERR_INVALID_ARG;
+    }
+    data++;
+    length--;
+  }
+  uint8_t *payload = loconet_tx_reserve(length);
+  if (!payload) {
+    return STATUS_ERR_NO_MEMORY;
+  }
+  memcpy(payload, data, length);
+  return loconet_tx_commit(payload, opcode, priority);
 }
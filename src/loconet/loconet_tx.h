@@ -16,40 +16,184 @@
 
 #include <stdint.h>
 #include "loconet.h"
+#include "utils/ramfunc.h"
+#include "utils/status_codes.h"
+
+//-----------------------------------------------------------------------------
+// Messages are taken from a fixed pool instead of the heap. Define
+// LOCONET_TX_POOL_Size for the number of messages which can be queued at
+// once, and LOCONET_TX_MESSAGE_Size for the largest message (including
+// opcode and checksum) which can be sent. The default of 16 bytes fits all
+// messages in loconet_tx_messages.c and the LNCV responses, the Loconet
+// maximum is 127 bytes.
+#ifndef LOCONET_TX_POOL_Size
+#define LOCONET_TX_POOL_Size 16
+#endif
+
+#ifndef LOCONET_TX_MESSAGE_Size
+#define LOCONET_TX_MESSAGE_Size 16
+#endif
+
+#define LOCONET_MESSAGE_MAX_LENGTH 127
+
+#if LOCONET_TX_MESSAGE_Size > LOCONET_MESSAGE_MAX_LENGTH
+#error "LOCONET_TX_MESSAGE_Size is larger than the Loconet maximum message length"
+#elif LOCONET_TX_MESSAGE_Size < 7
+#error "LOCONET_TX_MESSAGE_Size should at least fit a 6 byte message"
+#endif
+
+#define LOCONET_TX_OPCODE_FLAG 0x80
+
+#if LOCONET_TX_POOL_Size > 255
+#error "LOCONET_TX_POOL_Size should fit in 8 bits"
+#endif
+
+//-----------------------------------------------------------------------------
+// Messages are queued per priority level, a lower priority is sent first.
+// Priorities of LOCONET_TX_PRIORITY_LEVELS and above share the last level.
+// To prevent starvation, every LOCONET_TX_AGING_INTERVAL messages sent one
+// waiting message is promoted a level, the waiting levels take turns.
+#ifndef LOCONET_TX_PRIORITY_LEVELS
+#define LOCONET_TX_PRIORITY_LEVELS 16
+#endif
+
+#ifndef LOCONET_TX_AGING_INTERVAL
+#define LOCONET_TX_AGING_INTERVAL 4
+#endif
+
+//-----------------------------------------------------------------------------
+// After a collision a message is retried at most loconet_config.bit.RETRY_LIMIT
+// times (0 retries forever) before it is dropped. Every retry waits a random
+// number of extra priority slots: 0 .. 2^min(retries, BACKOFF) - 1, with
+// BACKOFF limited to LOCONET_TX_BACKOFF_MAX. The slots are kept with the
+// message for its next attempt, until any message is delivered. The first
+// attempt after a collision waits at least as long, whichever message it
+// sends.
+#define LOCONET_TX_BACKOFF_MAX 6
+
+#if LOCONET_TX_PRIORITY_LEVELS <= 16
+typedef uint16_t LOCONET_TX_LEVELS_Type;
+#elif LOCONET_TX_PRIORITY_LEVELS <= 32
+typedef uint32_t LOCONET_TX_LEVELS_Type;
+#else
+#error "LOCONET_TX_PRIORITY_LEVELS should be at most 32"
+#endif
+
+//-----------------------------------------------------------------------------
+typedef struct {
+  uint8_t pool_used;        // Messages taken from the pool
+  uint8_t pool_high_water;  // Maximum of pool_used since start
+  uint16_t pool_exhausted;  // Messages refused due to an empty pool
+  uint16_t coalesced;       // Queued messages replaced by a newer state
+  uint16_t retried;         // Messages placed back after a collision
+  uint16_t dropped;         // Messages dropped after too many collisions
+  uint16_t queue_high_water; // Maximum number of queued messages
+} LOCONET_TX_STATS_Type;
+
+extern LOCONET_TX_STATS_Type loconet_tx_stats;
+
+//-----------------------------------------------------------------------------
+// Latency from loconet_tx_commit until the start of the transmission which
+// delivered the message, per requested priority level. The average is
+// total / count over all delivered messages. With LOCONET_TX_LATENCY_BUCKETS
+// set the latencies go into a histogram per level as well: bucket 0 counts
+// latencies shorter than 1024 us and bucket n of 2^(n-1) up to 2^n times
+// 1024 us, the last bucket all longer ones. A bucket stops at 0xFFFF.
+#ifndef LOCONET_TX_LATENCY_BUCKETS
+#define LOCONET_TX_LATENCY_BUCKETS 0
+#endif
+
+typedef struct {
+  uint32_t minimum;         // Shortest latency in us
+  uint32_t maximum;         // Longest latency in us
+  uint64_t total;           // Sum of latencies in us
+  uint32_t count;           // Delivered messages
+#if LOCONET_TX_LATENCY_BUCKETS
+  uint16_t histogram[LOCONET_TX_LATENCY_BUCKETS]; // Messages per bucket
+#endif
+} LOCONET_TX_LATENCY_Type;
+
+extern LOCONET_TX_LATENCY_Type loconet_tx_latency[LOCONET_TX_PRIORITY_LEVELS];
+
+extern uint32_t loconet_tx_latency_average(uint8_t level);
+
+//-----------------------------------------------------------------------------
+// Completion callback of a message, called from loconet_tx_process in the
+// main loop with one of the results below.
+#define LOCONET_TX_RESULT_DELIVERED 0x00 // Sent without collision
+#define LOCONET_TX_RESULT_COLLIDED  0x01 // Collided, will be retried
+#define LOCONET_TX_RESULT_DROPPED   0x02 // Collided too often, not sent
+#define LOCONET_TX_RESULT_COALESCED 0x03 // Merged into a waiting message
+
+typedef void (*LOCONET_TX_CALLBACK_Type)(uint8_t result, void *context);
 
 //-----------------------------------------------------------------------------
 // Stop sending
-extern void loconet_tx_stop(void);
+extern RAMFUNC void loconet_tx_stop(void);
 
 //-----------------------------------------------------------------------------
-// Reset indexes of the message and place it at the front of the queue
-extern void loconet_tx_reset_current_message_to_queue(void);
+// Return the message after a collision, loconet_tx_process places it back
+// at the front of the queue, or drops it if the retry limit is reached
+extern RAMFUNC void loconet_tx_reset_current_message_to_queue(void);
+
+//-----------------------------------------------------------------------------
+// Number of extra priority slots to wait before the next attempt
+extern RAMFUNC uint8_t loconet_tx_backoff(void);
 
 //-----------------------------------------------------------------------------
 // Give the next byte we expect on the RX line
-extern uint8_t loconet_tx_next_rx_byte(void);
+extern RAMFUNC uint8_t loconet_tx_next_rx_byte(void);
 
 //-----------------------------------------------------------------------------
 // Give the next byte we want to send
-extern uint8_t loconet_tx_next_tx_byte(void);
+extern RAMFUNC uint8_t loconet_tx_next_tx_byte(void);
 
 //-----------------------------------------------------------------------------
 // Are we done sending a message
-extern uint8_t loconet_tx_finished(void);
+extern RAMFUNC uint8_t loconet_tx_finished(void);
 
 //-----------------------------------------------------------------------------
 // Process sending of messages
 extern void loconet_tx_process(void);
 
+//-----------------------------------------------------------------------------
+// Run the completion callbacks of the messages the interrupt is done with.
+// Part of loconet_tx_process, and used to see whether a request went out
+// before its reply is matched.
+extern void loconet_tx_process_completed(void);
+
 //-----------------------------------------------------------------------------
 // Size of queue
 extern uint16_t loconet_tx_queue_size(void);
 
 //-----------------------------------------------------------------------------
-// Enqueue a message
-extern void loconet_tx_queue_2(uint8_t opcode, uint8_t priority);
-extern void loconet_tx_queue_4(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b);
-extern void loconet_tx_queue_6(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b, uint8_t c, uint8_t d);
-extern void loconet_tx_queue_n(uint8_t opcode, uint8_t priority, uint8_t *d, uint8_t l);
+// Build a message in place. loconet_tx_reserve takes a message from the pool
+// and returns a pointer to its payload (the bytes between the opcode, or the
+// length byte of a variable length message, and the checksum), or 0 if the
+// pool is exhausted or length does not fit. Fill the payload and call
+// loconet_tx_commit to queue the message, which fills in the opcode, length
+// byte and checksum. Commit returns STATUS_ERR_INVALID_ARG if the length
+// does not match a fixed length opcode. Use loconet_tx_abort to return a
+// reserved message to the pool without sending it.
+extern uint8_t *loconet_tx_reserve(uint8_t length);
+extern enum status_code loconet_tx_commit(uint8_t *payload, uint8_t opcode, uint8_t priority);
+extern void loconet_tx_abort(uint8_t *payload);
+
+//-----------------------------------------------------------------------------
+// Register a completion callback for a reserved message, call it before
+// loconet_tx_commit. The context is passed to the callback as is.
+extern void loconet_tx_on_complete(uint8_t *payload, LOCONET_TX_CALLBACK_Type callback, void *context);
+
+//-----------------------------------------------------------------------------
+// Enqueue a message. For loconet_tx_queue_n, the data of a variable length
+// message starts with the length byte. If loconet_config.bit.COALESCE is set, a switch or
+// sensor report (0xB1, 0xB2) for an address which already has a report
+// waiting in the queue replaces the state of that message instead of being
+// queued. The waiting message keeps its place in the queue. Returns STATUS_ERR_NO_MEMORY if the pool is exhausted
+// or the message does not fit in a pool slot, STATUS_OK otherwise.
+extern enum status_code loconet_tx_queue_2(uint8_t opcode, uint8_t priority);
+extern enum status_code loconet_tx_queue_4(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b);
+extern enum status_code loconet_tx_queue_6(uint8_t opcode, uint8_t priority, uint8_t  a, uint8_t b, uint8_t c, uint8_t d);
+extern enum status_code loconet_tx_queue_n(uint8_t opcode, uint8_t priority, uint8_t *d, uint8_t l);
 
 #endif // _LOCONET_LOCONET_TX_H_
@@ -39,7 +39,11 @@
 #include "hal_gpio.h"
 #include "loconet/loconet.h"
 #include "loconet/loconet_cv.h"
+#include "utils/clock.h"
 #include "utils/eeprom.h"
+#include "utils/logger.h"
+#include "utils/loop_monitor.h"
+#include "utils/profile.h"
 
 #include "components/fast_clock.h"
 
@@ -57,19 +61,25 @@ LOCONET_BUILD(2/*sercom*/, A/*tx_port*/, 14/*tx_pin*/, A/*rx_port*/, 15/*rx_pin*
 // Initialize the FAST CLOCK, set it to use Timer 2.
 FAST_CLOCK_BUILD(2)
 
+// Logger for the profile (make PROFILE=1), TX on pad 2
+LOGGER_BUILD(3/*sercom*/, A/*tx_port*/, 24/*tx_pin*/, A/*rx_port*/, 25/*rx_pin*/, 3/*rx_pad*/);
+
 //-----------------------------------------------------------------------------
-void irq_handler_eic(void);
-void irq_handler_eic(void) {
+RAMFUNC void irq_handler_eic(void);
+RAMFUNC void irq_handler_eic(void) {
+  PROFILE_BEGIN(IRQ_EIC);
   if (loconet_handle_eic()) {
+    PROFILE_END(IRQ_EIC);
     return;
   }
+  PROFILE_END(IRQ_EIC);
 }
 
 //-----------------------------------------------------------------------------
 static void sys_init(void)
 {
-  // Switch to 8MHz clock (disable prescaler)
-  SYSCTRL->OSC8M.bit.PRESC = 0;
+  // Run at F_CPU, 8 MHz from OSC8M or 48 MHz from the DFLL (CLOCK=48000000)
+  clock_init();
 
   // Enable interrupts
   asm volatile ("cpsie i");
@@ -119,6 +129,8 @@ void domotica_handle_output_change(uint16_t mask_on, uint16_t mask_off)
 int main(void)
 {
   sys_init();
+  profile_init();
+  logger_init(115200);
   eeprom_init();
   // Set LED GPIO as output
   HAL_GPIO_LED_out();
@@ -131,6 +143,8 @@ int main(void)
   // Set loconet basics
   loconet_config.bit.ADDRESS = loconet_cv_get(0);
   loconet_config.bit.PRIORITY = loconet_cv_get(2);
+  loconet_config.bit.RETRY_LIMIT = loconet_cv_get(3);
+  loconet_config.bit.BACKOFF = loconet_cv_get(4);
 
   // Initialize loconet
   loconet_init();
@@ -142,10 +156,35 @@ int main(void)
   // Initialize domotica
   domotica_init();
 
+  // Start the watchdog after the initialization, report a hang of the
+  // previous run
+  loop_monitor_init();
+  if (loop_monitor_get_hung(NULL)) {
+    loop_monitor_dump();
+  }
+
   while (1) {
+    PROFILE_BEGIN(LOOP);
+    loop_monitor_stage(LOOP_MONITOR_LOCONET);
+    PROFILE_BEGIN(LOOP_LOCONET);
     loconet_loop();
+    PROFILE_END(LOOP_LOCONET);
+    loop_monitor_stage(LOOP_MONITOR_FAST_CLOCK);
+    PROFILE_BEGIN(LOOP_FAST_CLOCK);
     fast_clock_loop();
+    PROFILE_END(LOOP_FAST_CLOCK);
+    loop_monitor_stage(LOOP_MONITOR_DOMOTICA);
+    PROFILE_BEGIN(LOOP_DOMOTICA);
     domotica_loop();
+    PROFILE_END(LOOP_DOMOTICA);
+    PROFILE_END(LOOP);
+    loop_monitor_end();
+
+    // Any key on the logger dumps the profile and the loop monitor
+    if (logger_read() >= 0) {
+      profile_dump();
+      loop_monitor_dump();
+    }
   }
   return 0;
 }
@@ -141,7 +141,8 @@ void irq_handler_reset(void)
 {
   unsigned int *src, *dst;
 
-  // Initialize the relocate segment
+  // Initialize the relocate segment, the functions running from SRAM
+  // (.ramfunc) and initialized data
   src = &_etext;
   dst = &_srelocate;
 
@@ -0,0 +1,98 @@
+/**
+ * @file clock.c
+ * @brief Main clock and timer clock setup
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include "clock.h"
+
+//-----------------------------------------------------------------------------
+// Factory calibration in the NVM software calibration area
+#define CLOCK_CALIBRATION (*(uint32_t *)(NVMCTRL_OTP4 + 4))
+#define CLOCK_CALIBRATION_OSC32K ((CLOCK_CALIBRATION >> 6) & 0x7F)
+#define CLOCK_CALIBRATION_DFLL48M_COARSE ((CLOCK_CALIBRATION >> 26) & 0x3F)
+
+#if F_CPU == 48000000
+#define CLOCK_SOURCE GCLK_GENCTRL_SRC_DFLL48M
+#else
+#define CLOCK_SOURCE GCLK_GENCTRL_SRC_OSC8M
+#endif
+
+//-----------------------------------------------------------------------------
+#if F_CPU == 48000000
+static void clock_init_dfll48m(void)
+{
+  // One wait state for the flash above 24 MHz
+  NVMCTRL->CTRLB.bit.RWS = 1;
+
+  // Reference for the DFLL: internal 32 kHz oscillator
+  SYSCTRL->OSC32K.reg =
+    SYSCTRL_OSC32K_CALIB(CLOCK_CALIBRATION_OSC32K)
+    | SYSCTRL_OSC32K_EN32K
+    | SYSCTRL_OSC32K_ENABLE;
+  while (!(SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_OSC32KRDY));
+
+  // Generator 1 feeds the reference to the DFLL
+  GCLK->GENDIV.reg = GCLK_GENDIV_ID(1);
+  GCLK->GENCTRL.reg =
+    GCLK_GENCTRL_ID(1)
+    | GCLK_GENCTRL_SRC_OSC32K
+    | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+  GCLK->CLKCTRL.reg =
+    GCLK_CLKCTRL_ID_DFLL48M
+    | GCLK_CLKCTRL_CLKEN
+    | GCLK_CLKCTRL_GEN(1);
+
+  // Errata: ONDEMAND has to be cleared before the DFLL is configured
+  SYSCTRL->DFLLCTRL.reg = SYSCTRL_DFLLCTRL_ENABLE;
+  while (!(SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_DFLLRDY));
+
+  // Closed loop, 48 MHz is 1464 times the reference (47.97 MHz). Start
+  // from the factory coarse value to lock faster.
+  SYSCTRL->DFLLMUL.reg =
+    SYSCTRL_DFLLMUL_CSTEP(31)
+    | SYSCTRL_DFLLMUL_FSTEP(511)
+    | SYSCTRL_DFLLMUL_MUL(F_CPU / 32768);
+  SYSCTRL->DFLLVAL.reg =
+    SYSCTRL_DFLLVAL_COARSE(CLOCK_CALIBRATION_DFLL48M_COARSE)
+    | SYSCTRL_DFLLVAL_FINE(512);
+  while (!(SYSCTRL->PCLKSR.reg & SYSCTRL_PCLKSR_DFLLRDY));
+  SYSCTRL->DFLLCTRL.reg = SYSCTRL_DFLLCTRL_ENABLE | SYSCTRL_DFLLCTRL_MODE;
+  while ((SYSCTRL->PCLKSR.reg & (SYSCTRL_PCLKSR_DFLLLCKC | SYSCTRL_PCLKSR_DFLLLCKF))
+      != (SYSCTRL_PCLKSR_DFLLLCKC | SYSCTRL_PCLKSR_DFLLLCKF));
+
+  // Run the main clock from the DFLL
+  GCLK->GENCTRL.reg =
+    GCLK_GENCTRL_ID(0)
+    | GCLK_GENCTRL_SRC_DFLL48M
+    | GCLK_GENCTRL_IDC
+    | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+void clock_init(void)
+{
+#if F_CPU == 48000000
+  clock_init_dfll48m();
+#else
+  // Divide the 8 MHz oscillator down to F_CPU
+  SYSCTRL->OSC8M.bit.PRESC = __builtin_ctz(8000000 / F_CPU);
+#endif
+
+#if CLOCK_TIMER_GCLK != 0
+  // Divide the main clock source down to 1 MHz for the timers
+  GCLK->GENDIV.reg = GCLK_GENDIV_ID(CLOCK_TIMER_GCLK) | GCLK_GENDIV_DIV(CLOCK_TIMER_DIV);
+  GCLK->GENCTRL.reg =
+    GCLK_GENCTRL_ID(CLOCK_TIMER_GCLK)
+    | CLOCK_SOURCE
+    | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+#endif
+}
@@ -0,0 +1,64 @@
+/**
+ * @file clock.h
+ * @brief Main clock and timer clock setup
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * The main clock runs at F_CPU (set with CLOCK in the Makefile):
+ * - 1, 2, 4 or 8 MHz from the internal 8 MHz oscillator (OSC8M)
+ * - 48 MHz from the DFLL, locked to the internal 32 kHz oscillator
+ *
+ * The timers used for Loconet and the fast clock count microseconds at
+ * any F_CPU. Their generic clock and prescaler are chosen here: the TC
+ * prescaler divides F_CPU down to 1 MHz if possible, otherwise a generic
+ * clock generator (CLOCK_TIMER_GCLK_GEN, default 3) does.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _UTILS_CLOCK_H_
+#define _UTILS_CLOCK_H_
+
+#include "samd20.h"
+
+//-----------------------------------------------------------------------------
+#if F_CPU != 48000000 && F_CPU != 8000000 && F_CPU != 4000000 && F_CPU != 2000000 && F_CPU != 1000000
+#error "F_CPU should be 1, 2, 4 or 8 MHz (OSC8M), or 48 MHz (DFLL)"
+#endif
+
+// Timers tick every microsecond
+#define CLOCK_TIMER_Hz 1000000
+#define CLOCK_TIMER_DIV (F_CPU / CLOCK_TIMER_Hz)
+
+// Generic clock generator for the timers, if F_CPU cannot be divided by
+// the TC prescaler
+#ifndef CLOCK_TIMER_GCLK_GEN
+#define CLOCK_TIMER_GCLK_GEN 3
+#endif
+
+#if CLOCK_TIMER_DIV == 1
+#define CLOCK_TIMER_GCLK 0
+#define CLOCK_TIMER_PRESCALER TC_CTRLA_PRESCALER_DIV1
+#elif CLOCK_TIMER_DIV == 2
+#define CLOCK_TIMER_GCLK 0
+#define CLOCK_TIMER_PRESCALER TC_CTRLA_PRESCALER_DIV2
+#elif CLOCK_TIMER_DIV == 4
+#define CLOCK_TIMER_GCLK 0
+#define CLOCK_TIMER_PRESCALER TC_CTRLA_PRESCALER_DIV4
+#elif CLOCK_TIMER_DIV == 8
+#define CLOCK_TIMER_GCLK 0
+#define CLOCK_TIMER_PRESCALER TC_CTRLA_PRESCALER_DIV8
+#else
+#define CLOCK_TIMER_GCLK CLOCK_TIMER_GCLK_GEN
+#define CLOCK_TIMER_PRESCALER TC_CTRLA_PRESCALER_DIV1
+#if CLOCK_TIMER_GCLK_GEN < 3 || CLOCK_TIMER_DIV > 255
+#error "CLOCK_TIMER_GCLK_GEN should be 3 or higher, and divide F_CPU to 1 MHz"
+#endif
+#endif
+
+//-----------------------------------------------------------------------------
+// Set up the main clock and the generic clock of the timers
+extern void clock_init(void);
+
+#endif // _UTILS_CLOCK_H_
@@ -49,7 +49,7 @@
 static volatile uint8_t cpu_irq_critical_section_counter;
 static volatile bool    cpu_irq_prev_interrupt_state;
 
-void cpu_irq_enter_critical(void)
+RAMFUNC void cpu_irq_enter_critical(void)
 {
   if (cpu_irq_critical_section_counter == 0) {
     if (cpu_irq_is_enabled()) {
@@ -65,7 +65,7 @@ void cpu_irq_enter_critical(void)
   cpu_irq_critical_section_counter++;
 }
 
-void cpu_irq_leave_critical(void)
+RAMFUNC void cpu_irq_leave_critical(void)
 {
   cpu_irq_critical_section_counter--;
 
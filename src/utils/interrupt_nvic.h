@@ -51,6 +51,7 @@
 #include "core_cmFunc.h"
 #include "core_cmInstr.h"
 #include "samd20.h"
+#include "utils/ramfunc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,8 +72,9 @@ typedef uint32_t irqflags_t;
 
 #define cpu_irq_is_enabled()    (__get_PRIMASK() == 0)
 
-extern void cpu_irq_enter_critical(void);
-extern void cpu_irq_leave_critical(void);
+// Also used from interrupt handlers that run from SRAM
+extern RAMFUNC void cpu_irq_enter_critical(void);
+extern RAMFUNC void cpu_irq_leave_critical(void);
 
 #ifdef __cplusplus
 }
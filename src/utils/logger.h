@@ -19,7 +19,8 @@
  *     (e.g. 1, see datasheet)
  *
  *  Before you can use the logger functions, initialize the logger
- *  using `logger_init(baudrate);`.
+ *  using `logger_init(baudrate);`. `logger_read()` returns a received
+ *  character, or -1 if there is none.
  *
  * @author Ferdi van der Werf <ferdi@slashdev.nl>
  */
@@ -42,6 +43,14 @@
     SERCOM##sercom->USART.DATA.reg = c; \
   } \
   \
+  int16_t logger_usart_read(void) \
+  { \
+    if (!(SERCOM##sercom->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_RXC)) { \
+      return -1; \
+    } \
+    return SERCOM##sercom->USART.DATA.reg; \
+  } \
+  \
   static inline void logger_init(uint32_t baud) \
   { \
     /* Set TX as output */ \
@@ -90,7 +99,9 @@ extern const char logger_ok[];
 extern const char logger_error[];
 
 extern void logger_usart_queue(char c);
+extern int16_t logger_usart_read(void);
 #define logger_char(x) logger_usart_queue(x)
+#define logger_read() logger_usart_read()
 extern void logger_string(char *string);
 extern void logger_cstring(const char *string);
 extern void logger_number_(uint32_t value, uint8_t base, uint8_t padding);
@@ -107,8 +118,10 @@ extern void logger_number_(uint32_t value, uint8_t base, uint8_t padding);
 
 #define LOGGER_BUILD(...)
 #define logger_usart_queue(...) do {} while (0)
+#define logger_usart_read(...) (-1)
 #define logger_init(...) do {} while (0)
 #define logger_char(...) do {} while (0)
+#define logger_read(...) (-1)
 #define logger_string(...) do {} while (0)
 #define logger_cstring(...) do {} while (0)
 #define logger_number_(...) do {} while (0)
@@ -0,0 +1,259 @@
+/**
+ * @file loop_monitor.c
+ * @brief Latency of the main loop, stalls and watchdog hangs
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include "loop_monitor.h"
+
+// Do we want to monitor the main loop?
+#ifdef UTILS_LOOP_MONITOR
+
+#include <stddef.h>
+#include "samd20.h"
+#include "utils/logger.h"
+
+//-----------------------------------------------------------------------------
+#define LOOP_MONITOR_STALL (LOOP_MONITOR_STALL_US * TIMESTAMP_PER_US)
+
+#define LOOP_MONITOR_STAGE_NAME(id, name) name,
+static const char *const loop_monitor_names[LOOP_MONITOR_STAGES_Size] = {
+  LOOP_MONITOR_STAGES(LOOP_MONITOR_STAGE_NAME)
+};
+#undef LOOP_MONITOR_STAGE_NAME
+
+LOOP_MONITOR_STATS_Type loop_monitor_stats;
+
+// Stage the loop is in, read by the early warning interrupt
+static volatile uint8_t loop_monitor_current = LOOP_MONITOR_IDLE;
+static volatile uint32_t loop_monitor_stage_begin = 0;
+static uint32_t loop_monitor_pass_begin = 0;
+
+static LOOP_MONITOR_HUNG_Type loop_monitor_hung;
+static bool loop_monitor_has_hung = false;
+
+//-----------------------------------------------------------------------------
+#ifdef LOOP_MONITOR_WATCHDOG
+// Written by the early warning, the magic and check tell a record from
+// the random contents of SRAM after power on
+#define LOOP_MONITOR_MAGIC 0x4C4D5748
+
+typedef struct {
+  uint32_t magic;
+  uint32_t stage;
+  uint32_t elapsed;
+  uint32_t check;
+} LOOP_MONITOR_RECORD_Type;
+
+// The host has no reset to survive
+#ifdef __arm__
+#define LOOP_MONITOR_NOINIT __attribute__((section(".noinit")))
+#else
+#define LOOP_MONITOR_NOINIT
+#endif
+
+static LOOP_MONITOR_RECORD_Type loop_monitor_record LOOP_MONITOR_NOINIT;
+
+static void loop_monitor_read_record(void)
+{
+  LOOP_MONITOR_RECORD_Type *record = &loop_monitor_record;
+
+  if ((PM->RCAUSE.reg & PM_RCAUSE_WDT)
+      && record->magic == LOOP_MONITOR_MAGIC
+      && record->check == ~(record->stage ^ record->elapsed)
+      && record->stage < LOOP_MONITOR_STAGES_Size) {
+    loop_monitor_hung.stage = record->stage;
+    loop_monitor_hung.elapsed = record->elapsed;
+    loop_monitor_has_hung = true;
+  }
+  record->magic = 0;
+}
+
+static void loop_monitor_watchdog_init(void)
+{
+  // GCLK_WDT at 1024 Hz, the 32 kHz ultra low power oscillator divided
+  // by 2^(4+1) on generator 2
+  GCLK->GENDIV.reg = GCLK_GENDIV_ID(2) | GCLK_GENDIV_DIV(4);
+  GCLK->GENCTRL.reg =
+    GCLK_GENCTRL_ID(2)
+    | GCLK_GENCTRL_SRC_OSCULP32K
+    | GCLK_GENCTRL_DIVSEL
+    | GCLK_GENCTRL_GENEN;
+  while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY);
+  GCLK->CLKCTRL.reg =
+    GCLK_CLKCTRL_ID_WDT
+    | GCLK_CLKCTRL_CLKEN
+    | GCLK_CLKCTRL_GEN(2);
+
+  // CONFIG and EWCTRL are ignored when the fuses already enabled it
+  WDT->CONFIG.reg = LOOP_MONITOR_WATCHDOG_PERIOD;
+  WDT->EWCTRL.reg = LOOP_MONITOR_WATCHDOG_WARNING;
+  WDT->INTENSET.reg = WDT_INTENSET_EW;
+  WDT->CTRL.reg = WDT_CTRL_ENABLE;
+  while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY);
+  NVIC_EnableIRQ(WDT_IRQn);
+}
+
+void irq_handler_wdt(void);
+void irq_handler_wdt(void)
+{
+  LOOP_MONITOR_RECORD_Type *record = &loop_monitor_record;
+
+  WDT->INTFLAG.reg = WDT_INTFLAG_EW;
+
+  // Not cleared, the reset follows
+  record->stage = loop_monitor_current;
+  record->elapsed = timestamp_elapsed(loop_monitor_stage_begin);
+  record->check = ~(record->stage ^ record->elapsed);
+  record->magic = LOOP_MONITOR_MAGIC;
+}
+
+// A clear takes a few cycles of GCLK_WDT to synchronize, writing CLEAR
+// again before that would stall the bus. Far within the early warning,
+// once a millisecond is enough.
+#define LOOP_MONITOR_CLEAR (1000 * TIMESTAMP_PER_US)
+
+static uint32_t loop_monitor_cleared = 0;
+
+static inline void loop_monitor_watchdog_clear(uint32_t now)
+{
+  if (timestamp_between(loop_monitor_cleared, now) >= LOOP_MONITOR_CLEAR
+      && !(WDT->STATUS.reg & WDT_STATUS_SYNCBUSY)) {
+    WDT->CLEAR.reg = WDT_CLEAR_CLEAR_KEY;
+    loop_monitor_cleared = now;
+  }
+}
+#else
+#define loop_monitor_read_record(...) do {} while (0)
+#define loop_monitor_watchdog_init(...) do {} while (0)
+#define loop_monitor_watchdog_clear(...) do {} while (0)
+#endif // LOOP_MONITOR_WATCHDOG
+
+//-----------------------------------------------------------------------------
+void loop_monitor_init(void)
+{
+  loop_monitor_read_record();
+  timestamp_init();
+  loop_monitor_stage_begin = timestamp_now();
+  loop_monitor_watchdog_init();
+}
+
+//-----------------------------------------------------------------------------
+// End the current stage at now
+static void loop_monitor_stage_end(uint32_t now)
+{
+  uint8_t stage = loop_monitor_current;
+  uint32_t elapsed = timestamp_between(loop_monitor_stage_begin, now);
+
+  if (elapsed >= LOOP_MONITOR_STALL) {
+    loop_monitor_stats.stalls[stage]++;
+  }
+  if (elapsed > loop_monitor_stats.longest) {
+    loop_monitor_stats.longest = elapsed;
+    loop_monitor_stats.longest_stage = stage;
+  }
+}
+
+void loop_monitor_stage(uint8_t stage)
+{
+  uint32_t now = timestamp_now();
+
+  if (loop_monitor_current == LOOP_MONITOR_IDLE) {
+    loop_monitor_pass_begin = now;
+  } else {
+    loop_monitor_stage_end(now);
+  }
+  loop_monitor_current = stage;
+  loop_monitor_stage_begin = now;
+}
+
+void loop_monitor_end(void)
+{
+  uint32_t now = timestamp_now();
+  uint32_t elapsed = timestamp_between(loop_monitor_pass_begin, now);
+  uint32_t limit = TIMESTAMP_PER_US;
+  uint8_t bucket = 0;
+
+  if (loop_monitor_current == LOOP_MONITOR_IDLE) {
+    return;
+  }
+  loop_monitor_stage_end(now);
+  loop_monitor_current = LOOP_MONITOR_IDLE;
+  loop_monitor_stage_begin = now;
+
+  // Bucket n starts at 2^(n-1) us
+  while (bucket < LOOP_MONITOR_BUCKETS - 1 && elapsed >= limit) {
+    bucket++;
+    limit <<= 1;
+  }
+  loop_monitor_stats.histogram[bucket]++;
+
+  loop_monitor_watchdog_clear(now);
+}
+
+//-----------------------------------------------------------------------------
+bool loop_monitor_get_hung(LOOP_MONITOR_HUNG_Type *hung)
+{
+  if (loop_monitor_has_hung && hung != NULL) {
+    *hung = loop_monitor_hung;
+  }
+  return loop_monitor_has_hung;
+}
+
+const char *loop_monitor_name(uint8_t stage)
+{
+  return loop_monitor_names[stage];
+}
+
+//-----------------------------------------------------------------------------
+// Passes per bucket as "< limit count", stalls and the longest stage
+void loop_monitor_dump(void)
+{
+  logger_cstring("loop (us): count");
+  logger_newline();
+  for (uint8_t bucket = 0; bucket < LOOP_MONITOR_BUCKETS; bucket++) {
+    if (!loop_monitor_stats.histogram[bucket]) {
+      continue;
+    }
+    if (bucket < LOOP_MONITOR_BUCKETS - 1) {
+      logger_cstring("< ");
+      logger_number(0x01ul << bucket);
+    } else {
+      logger_cstring(">= ");
+      logger_number(0x01ul << (bucket - 1));
+    }
+    logger_char(' ');
+    logger_number(loop_monitor_stats.histogram[bucket]);
+    logger_newline();
+  }
+  for (uint8_t stage = 0; stage < LOOP_MONITOR_STAGES_Size; stage++) {
+    if (!loop_monitor_stats.stalls[stage]) {
+      continue;
+    }
+    logger_cstring("stall ");
+    logger_cstring(loop_monitor_names[stage]);
+    logger_char(' ');
+    logger_number(loop_monitor_stats.stalls[stage]);
+    logger_newline();
+  }
+  logger_cstring("longest ");
+  logger_cstring(loop_monitor_names[loop_monitor_stats.longest_stage]);
+  logger_char(' ');
+  logger_number(loop_monitor_stats.longest);
+  logger_cstring(" " TIMESTAMP_UNIT);
+  logger_newline();
+  if (loop_monitor_has_hung) {
+    logger_cstring("hung ");
+    logger_cstring(loop_monitor_names[loop_monitor_hung.stage]);
+    logger_char(' ');
+    logger_number(loop_monitor_hung.elapsed);
+    logger_cstring(" " TIMESTAMP_UNIT);
+    logger_newline();
+  }
+}
+
+#endif // UTILS_LOOP_MONITOR
@@ -0,0 +1,124 @@
+/**
+ * @file loop_monitor.h
+ * @brief Latency of the main loop, stalls and watchdog hangs
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * The main loop marks the start of each stage and the end of each pass:
+ *
+ *   loop_monitor_stage(LOOP_MONITOR_LOCONET);
+ *   loconet_loop();
+ *   loop_monitor_stage(LOOP_MONITOR_FAST_CLOCK);
+ *   fast_clock_loop();
+ *   loop_monitor_end();
+ *
+ * The time of a pass goes into a histogram of LOOP_MONITOR_BUCKETS
+ * buckets. Bucket 0 counts passes shorter than 1 us and bucket n passes
+ * of 2^(n-1) up to 2^n us, the last bucket all longer ones. A stage that
+ * takes LOOP_MONITOR_STALL_US or longer, like a flash row erase when an
+ * LNCV is written, counts as a stall of that stage. Times come from
+ * utils/timestamp.h and include the interrupts that ran in the stage.
+ *
+ * With LOOP_MONITOR_WATCHDOG loop_monitor_init also starts the watchdog,
+ * which loop_monitor_end clears. If the loop does not come around, the
+ * early warning interrupt writes the stage it hangs in to a record in
+ * .noinit, which the reset does not clear. After the reset
+ * loop_monitor_init reads it back, loop_monitor_get_hung returns it. The
+ * early warning does not preempt interrupt handlers, a hang in one of
+ * them resets without a record.
+ *
+ * The monitor is built with UTILS_LOOP_MONITOR (`make LOOP_MONITOR=1`),
+ * the watchdog with `make WATCHDOG=1`. Otherwise the macros and functions
+ * are empty.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _UTILS_LOOP_MONITOR_H_
+#define _UTILS_LOOP_MONITOR_H_
+
+// Do we want to monitor the main loop?
+#ifdef UTILS_LOOP_MONITOR
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils/timestamp.h"
+
+//-----------------------------------------------------------------------------
+#ifndef LOOP_MONITOR_BUCKETS
+#define LOOP_MONITOR_BUCKETS 16
+#endif
+
+// Stages longer than this are stalls
+#ifndef LOOP_MONITOR_STALL_US
+#define LOOP_MONITOR_STALL_US 2000
+#endif
+
+// Watchdog period and early warning, in cycles of the 1024 Hz GCLK_WDT
+#ifndef LOOP_MONITOR_WATCHDOG_PERIOD
+#define LOOP_MONITOR_WATCHDOG_PERIOD WDT_CONFIG_PER_256
+#endif
+#ifndef LOOP_MONITOR_WATCHDOG_WARNING
+#define LOOP_MONITOR_WATCHDOG_WARNING WDT_EWCTRL_EWOFFSET_128
+#endif
+
+//-----------------------------------------------------------------------------
+// Stages, with the name printed by loop_monitor_dump. IDLE is outside
+// of the stages, between loop_monitor_end and the next stage.
+#define LOOP_MONITOR_STAGES(X)                                                \
+  X(IDLE,       "idle")                                                       \
+  X(LOCONET,    "loconet_loop")                                               \
+  X(FAST_CLOCK, "fast_clock_loop")                                            \
+  X(DOMOTICA,   "domotica_loop")
+
+#define LOOP_MONITOR_STAGE_ID(id, name) LOOP_MONITOR_##id,
+enum {
+  LOOP_MONITOR_STAGES(LOOP_MONITOR_STAGE_ID)
+  LOOP_MONITOR_STAGES_Size
+};
+#undef LOOP_MONITOR_STAGE_ID
+
+typedef struct {
+  uint32_t histogram[LOOP_MONITOR_BUCKETS]; // Passes per bucket
+  uint32_t stalls[LOOP_MONITOR_STAGES_Size]; // Stalls per stage
+  uint32_t longest;                         // Longest stage
+  uint8_t longest_stage;
+} LOOP_MONITOR_STATS_Type;
+
+typedef struct {
+  uint8_t stage;                            // Stage at the early warning
+  uint32_t elapsed;                         // Time in the stage
+} LOOP_MONITOR_HUNG_Type;
+
+extern LOOP_MONITOR_STATS_Type loop_monitor_stats;
+
+//-----------------------------------------------------------------------------
+// Read back a hang, start the counter and the watchdog
+extern void loop_monitor_init(void);
+
+// Start a stage, ending the previous one
+extern void loop_monitor_stage(uint8_t stage);
+
+// End the pass, clears the watchdog
+extern void loop_monitor_end(void);
+
+// The hang before the last reset, false if there was none
+extern bool loop_monitor_get_hung(LOOP_MONITOR_HUNG_Type *hung);
+
+extern const char *loop_monitor_name(uint8_t stage);
+
+// Write the histogram, the stalls and a hang through the logger
+extern void loop_monitor_dump(void);
+
+#else // UTILS_LOOP_MONITOR
+
+#define loop_monitor_init(...) do {} while (0)
+#define loop_monitor_stage(...) do {} while (0)
+#define loop_monitor_end(...) do {} while (0)
+#define loop_monitor_get_hung(...) (false)
+#define loop_monitor_dump(...) do {} while (0)
+
+#endif // UTILS_LOOP_MONITOR
+
+#endif // _UTILS_LOOP_MONITOR_H_
@@ -0,0 +1,96 @@
+/**
+ * @file profile.c
+ * @brief Time sections of code, with statistics per probe
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#include "profile.h"
+
+// Do we want profiling?
+#ifdef UTILS_PROFILE
+
+#include "utils/interrupt_nvic.h"
+#include "utils/logger.h"
+
+//-----------------------------------------------------------------------------
+#define PROFILE_PROBE_NAME(id, name) name,
+static const char *const profile_names[PROFILE_PROBES_Size] = {
+  PROFILE_PROBES(PROFILE_PROBE_NAME)
+};
+#undef PROFILE_PROBE_NAME
+
+// A probe records either in the main loop or in one interrupt handler,
+// which do not preempt each other on the same probe
+static PROFILE_STATS_Type profile_stats[PROFILE_PROBES_Size];
+
+//-----------------------------------------------------------------------------
+void profile_init(void)
+{
+  for (uint8_t probe = 0; probe < PROFILE_PROBES_Size; probe++) {
+    profile_stats[probe].count = 0;
+    profile_stats[probe].min = UINT32_MAX;
+    profile_stats[probe].max = 0;
+    profile_stats[probe].total = 0;
+  }
+
+  timestamp_init();
+}
+
+//-----------------------------------------------------------------------------
+RAMFUNC void profile_record(uint8_t probe, uint32_t elapsed)
+{
+  PROFILE_STATS_Type *stats = &profile_stats[probe];
+  stats->count++;
+  stats->total += elapsed;
+  if (elapsed < stats->min) {
+    stats->min = elapsed;
+  }
+  if (elapsed > stats->max) {
+    stats->max = elapsed;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void profile_get(uint8_t probe, PROFILE_STATS_Type *stats)
+{
+  cpu_irq_enter_critical();
+  *stats = profile_stats[probe];
+  cpu_irq_leave_critical();
+}
+
+const char *profile_name(uint8_t probe)
+{
+  return profile_names[probe];
+}
+
+//-----------------------------------------------------------------------------
+// One line per probe that recorded: name, count, min, average and max
+void profile_dump(void)
+{
+  PROFILE_STATS_Type stats;
+
+  logger_cstring("profile (" PROFILE_UNIT "): count min avg max");
+  logger_newline();
+  for (uint8_t probe = 0; probe < PROFILE_PROBES_Size; probe++) {
+    profile_get(probe, &stats);
+    if (!stats.count) {
+      continue;
+    }
+    logger_cstring(profile_names[probe]);
+    logger_char(' ');
+    logger_number(stats.count);
+    logger_char(' ');
+    logger_number(stats.min);
+    logger_char(' ');
+    logger_number((uint32_t)(stats.total / stats.count));
+    logger_char(' ');
+    logger_number(stats.max);
+    logger_newline();
+  }
+}
+
+#endif // UTILS_PROFILE
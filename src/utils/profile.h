@@ -0,0 +1,95 @@
+/**
+ * @file profile.h
+ * @brief Time sections of code, with statistics per probe
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * A probe times the code between PROFILE_BEGIN and PROFILE_END of the
+ * same name, in the same block:
+ *
+ *   PROFILE_BEGIN(LOOP_LOCONET);
+ *   loconet_loop();
+ *   PROFILE_END(LOOP_LOCONET);
+ *
+ * Each probe keeps the count and the minimum, maximum and total time of
+ * its sections. profile_dump writes them through the logger. Probes are
+ * listed in PROFILE_PROBES, add a line for a new one.
+ *
+ * Profiling is built with UTILS_PROFILE (`make PROFILE=1`), otherwise the
+ * macros and functions are empty. Times are those of utils/timestamp.h,
+ * cycles of SysTick on the device and nanoseconds on the host.
+ *
+ * Interrupts are timed by probes in their handlers. A main loop section
+ * includes the interrupts that ran during it.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _UTILS_PROFILE_H_
+#define _UTILS_PROFILE_H_
+
+// Do we want profiling?
+#ifdef UTILS_PROFILE
+
+#include <stdint.h>
+#include "utils/ramfunc.h"
+#include "utils/timestamp.h"
+
+//-----------------------------------------------------------------------------
+// Probes, with the name printed by profile_dump
+#define PROFILE_PROBES(X)                                                     \
+  X(LOOP,              "loop")                                                \
+  X(LOOP_LOCONET,      "loconet_loop")                                        \
+  X(LOOP_FAST_CLOCK,   "fast_clock_loop")                                     \
+  X(LOOP_DOMOTICA,     "domotica_loop")                                       \
+  X(IRQ_EIC,           "irq eic")                                             \
+  X(IRQ_LOCONET_USART, "irq loconet usart")                                   \
+  X(IRQ_LOCONET_TIMER, "irq loconet timer")                                   \
+  X(IRQ_LOCONET_BASE,  "irq loconet timebase")                                \
+  X(IRQ_FAST_CLOCK,    "irq fast clock")
+
+#define PROFILE_PROBE_ID(id, name) PROFILE_##id,
+enum {
+  PROFILE_PROBES(PROFILE_PROBE_ID)
+  PROFILE_PROBES_Size
+};
+#undef PROFILE_PROBE_ID
+
+typedef struct {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+} PROFILE_STATS_Type;
+
+//-----------------------------------------------------------------------------
+#define PROFILE_UNIT TIMESTAMP_UNIT
+
+#define PROFILE_BEGIN(probe) uint32_t profile_begin_##probe = timestamp_now()
+#define PROFILE_END(probe) profile_record(PROFILE_##probe, timestamp_elapsed(profile_begin_##probe))
+
+//-----------------------------------------------------------------------------
+// Start the counter and clear the statistics
+extern void profile_init(void);
+
+// Add a section of the probe
+extern RAMFUNC void profile_record(uint8_t probe, uint32_t elapsed);
+
+// Statistics and name of the probe, consistent with the interrupts
+extern void profile_get(uint8_t probe, PROFILE_STATS_Type *stats);
+extern const char *profile_name(uint8_t probe);
+
+// Write the statistics of all probes through the logger
+extern void profile_dump(void);
+
+#else // UTILS_PROFILE
+
+#define PROFILE_BEGIN(...) do {} while (0)
+#define PROFILE_END(...) do {} while (0)
+#define profile_init(...) do {} while (0)
+#define profile_dump(...) do {} while (0)
+
+#endif // UTILS_PROFILE
+
+#endif // _UTILS_PROFILE_H_
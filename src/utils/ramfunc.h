@@ -0,0 +1,42 @@
+/**
+ * @file ramfunc.h
+ * @brief Run time critical functions from SRAM
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * Functions marked RAMFUNC are linked in the .ramfunc section, which
+ * irq_handler_reset copies to SRAM together with .data. Above 24 MHz the
+ * flash needs a wait state, which makes interrupt handlers slower and
+ * their timing depend on the flash cache. From SRAM they run without
+ * wait states.
+ *
+ * RAMFUNC_ENABLE defaults to 1 above 24 MHz and to 0 otherwise, where the
+ * flash runs without wait states and the copy would only cost SRAM. Run
+ * `make ram` to see what the section costs.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _UTILS_RAMFUNC_H_
+#define _UTILS_RAMFUNC_H_
+
+//-----------------------------------------------------------------------------
+#ifndef RAMFUNC_ENABLE
+#if F_CPU > 24000000
+#define RAMFUNC_ENABLE 1
+#else
+#define RAMFUNC_ENABLE 0
+#endif
+#endif
+
+// Calls between flash and SRAM are out of range of a BL instruction, so
+// callers load the full address. Inlining would pull the code back into
+// the section of the caller.
+#if RAMFUNC_ENABLE
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
+#else
+#define RAMFUNC
+#endif
+
+#endif // _UTILS_RAMFUNC_H_
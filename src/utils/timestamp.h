@@ -0,0 +1,75 @@
+/**
+ * @file timestamp.h
+ * @brief Free running time stamps for measuring sections of code
+ *
+ * \copyright Copyright 2017 /Dev. All rights reserved.
+ * \license This project is released under MIT license.
+ *
+ * On the device timestamp_init starts SysTick as a free running 24 bit
+ * counter at F_CPU, without interrupt, and a time stamp is a count of
+ * cycles. timestamp_elapsed is correct for sections shorter than 2^24
+ * cycles (2 seconds at 8 MHz). The host build counts nanoseconds of
+ * clock_gettime.
+ *
+ * @author Ferdi van der Werf <ferdi@slashdev.nl>
+ */
+
+#ifndef _UTILS_TIMESTAMP_H_
+#define _UTILS_TIMESTAMP_H_
+
+#include <stdint.h>
+#include "samd20.h"
+
+#ifndef __arm__
+#include <time.h>
+#endif
+
+//-----------------------------------------------------------------------------
+#ifdef __arm__
+#define TIMESTAMP_UNIT   "cycles"
+#define TIMESTAMP_PER_US (F_CPU / 1000000)
+
+static inline void timestamp_init(void)
+{
+  SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+// SysTick counts down from 0xFFFFFF
+static inline uint32_t timestamp_now(void)
+{
+  return SysTick->VAL;
+}
+
+static inline uint32_t timestamp_between(uint32_t begin, uint32_t end)
+{
+  return (begin - end) & SysTick_VAL_CURRENT_Msk;
+}
+#else
+#define TIMESTAMP_UNIT   "ns"
+#define TIMESTAMP_PER_US 1000
+
+static inline void timestamp_init(void)
+{
+}
+
+static inline uint32_t timestamp_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline uint32_t timestamp_between(uint32_t begin, uint32_t end)
+{
+  return end - begin;
+}
+#endif
+
+static inline uint32_t timestamp_elapsed(uint32_t begin)
+{
+  return timestamp_between(begin, timestamp_now());
+}
+
+#endif // _UTILS_TIMESTAMP_H_